@@ -0,0 +1,146 @@
+/*
+WeldBench.cpp
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Times the two duplicate vertex searches in GLTriangleBatch against each
+// other. Every mesh is built with GLT_WELD_LINEAR and again with
+// GLT_WELD_HASH_GRID, and the vertex and index counts have to come out the
+// same. Pass the number of builds to average over, the default is 5.
+
+#include <GLTools.h>
+#include <GLTriangleBatch.h>
+#include <StopWatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __APPLE__
+#include <glut/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+
+
+struct WELD_BENCH_MESH
+	{
+	const char	*szName;
+	bool		bTorus;
+	GLint		nMajor;		// Slices, or segments around the ring
+	GLint		nMinor;		// Stacks, or segments around the tube
+	};
+
+static const WELD_BENCH_MESH benchMeshes[] = {
+	{ "sphere 24x12",	false,	24,		12 },
+	{ "sphere 64x32",	false,	64,		32 },
+	{ "sphere 128x64",	false,	128,	64 },
+	{ "torus 32x16",	true,	32,		16 },
+	{ "torus 96x48",	true,	96,		48 },
+	{ "torus 192x96",	true,	192,	96 },
+	};
+
+static const char *szModeNames[] = { "linear", "hash grid" };
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Build one mesh nIterations times and return the average time in seconds.
+static float BuildMesh(const WELD_BENCH_MESH &mesh, GLT_WELD_MODE mode, int nIterations,
+					   GLuint &nVerts, GLuint &nIndexes)
+	{
+	CStopWatch timer;
+	float fTotal = 0.0f;
+
+	for(int i = 0; i < nIterations; i++)
+		{
+		GLTriangleBatch batch;
+		batch.SetWeldMode(mode);
+
+		timer.Reset();
+		if(mesh.bTorus)
+			gltMakeTorus(batch, 0.4f, 0.15f, mesh.nMajor, mesh.nMinor);
+		else
+			gltMakeSphere(batch, 0.5f, mesh.nMajor, mesh.nMinor);
+		fTotal += timer.GetElapsedSeconds();
+
+		nVerts = batch.GetVertexCount();
+		nIndexes = batch.GetIndexCount();
+		}
+
+	return fTotal / float(nIterations);
+	}
+
+
+int main(int argc, char* argv[])
+	{
+	int nIterations = 5;
+	if(argc > 1)
+		nIterations = atoi(argv[1]);
+	if(nIterations < 1)
+		nIterations = 1;
+
+	// The batches upload to buffer objects when they're done, so they
+	// need a context even though nothing is drawn.
+	glutInit(&argc, argv);
+	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+	glutInitWindowSize(64, 64);
+	glutCreateWindow("WeldBench");
+
+	GLenum err = glewInit();
+	if(GLEW_OK != err)
+		{
+		fprintf(stderr, "GLEW Error: %s\n", glewGetErrorString(err));
+		return 1;
+		}
+
+	printf("%-16s %-10s %8s %8s %12s\n", "mesh", "weld", "verts", "indexes", "ms");
+
+	int nMismatches = 0;
+	for(size_t m = 0; m < sizeof(benchMeshes) / sizeof(benchMeshes[0]); m++)
+		{
+		GLuint nVerts[2], nIndexes[2];
+		float fSeconds[2];
+
+		for(int mode = 0; mode < 2; mode++)
+			{
+			fSeconds[mode] = BuildMesh(benchMeshes[m], GLT_WELD_MODE(mode), nIterations, nVerts[mode], nIndexes[mode]);
+			printf("%-16s %-10s %8u %8u %12.3f\n", mode == 0 ? benchMeshes[m].szName : "", szModeNames[mode],
+				   nVerts[mode], nIndexes[mode], fSeconds[mode] * 1000.0f);
+			}
+
+		if(nVerts[0] != nVerts[1] || nIndexes[0] != nIndexes[1])
+			{
+			printf("%-16s counts differ!\n", "");
+			nMismatches++;
+			}
+		else if(fSeconds[1] > 0.0f)
+			printf("%-16s %-10s %31.1fx\n", "", "speedup", fSeconds[0] / fSeconds[1]);
+		}
+
+	return nMismatches == 0 ? 0 : 1;
+	}
@@ -65,16 +65,46 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 
 #include <math3d.h>
 #include <GLBatchBase.h>
+#include <GLVertexFormat.h>
+#include <GLInstanceArray.h>
 
 
+// Most copies a streaming batch can cycle through
+#define GLT_MAX_STREAM_SLOTS	4
+
+// Most texture coordinate sets a batch can have
+#define GLT_BATCH_TEXTURE_UNITS	4
+
+// Vertex, normal, color and the texture coordinate arrays
+#define GLT_BATCH_ARRAYS		(3 + GLT_BATCH_TEXTURE_UNITS)
+
+// Parts of an array that need uploading, in order and not touching. Past
+// GLT_MAX_DIRTY_RANGES the two closest ranges are merged into one.
+#define GLT_MAX_DIRTY_RANGES	8
+struct GLT_DIRTY_RANGES
+	{
+	GLuint	nRanges;
+	GLuint	nFirst[GLT_MAX_DIRTY_RANGES + 1];
+	GLuint	nEnd[GLT_MAX_DIRTY_RANGES + 1];
+	};
+
 class GLBatch : public GLBatchBase
     {
     public:
         GLBatch(void);
         virtual ~GLBatch(void);
         
-		// Start populating the array
-        void Begin(GLenum primitive, GLuint nVerts, GLuint nTextureUnits = 0);
+		// Start populating the array. With nIndexes the batch also gets an
+		// element array, filled with CopyIndexData(), and draws indexed.
+		// Calling Begin() again on a built batch reuses its vertex array
+		// object, buffers and client memory, growing them only if the new
+		// batch doesn't fit.
+        void Begin(GLenum primitive, GLuint nVerts, GLuint nTextureUnits = 0, GLuint nIndexes = 0);
+
+		// Or start a batch of interleaved vertices laid out the way format
+		// says, filled with CopyVertexData(). The float Copy functions and
+		// immediate mode do nothing in a batch like this.
+		void Begin(GLenum primitive, GLuint nVerts, const GLVertexFormat &format, GLuint nIndexes = 0);
         
 		// Tell the batch you are done
 		void End(void);
@@ -91,10 +121,41 @@ class GLBatch : public GLBatchBase
 		inline void CopyColorData4f(GLfloat *vColors) { CopyColorData4f((M3DVector4f *)(vColors)); }
 		inline void CopyTexCoordData2f(GLfloat *vTex, GLuint uiTextureLayer) { CopyTexCoordData2f((M3DVector2f *)(vTex), uiTextureLayer); }
 
+		// Block copy in vertices of the batch's vertex format, all nVerts of
+		// them, or nCount starting at nFirst (sent at the next Draw() like the
+		// ranged copies below)
+		void CopyVertexData(const GLvoid *pVertices);
+		void CopyVertexData(const GLvoid *pVertices, GLuint nFirst, GLuint nCount);
+
+		// Block copy in the indexes, nIndexes of them, each less than nVerts.
+		// They're stored 16 bit when nVerts allows it.
+		void CopyIndexData(GLuint *pIndexes);
+
+		// Replace just nCount elements starting at vertex nFirst, vVerts etc.
+		// point at the new values. The edits collect in client memory and go
+		// out at the next Draw() (or End()), with overlapping and adjacent
+		// ranges merged so a handful of small edits cost a handful of uploads.
+		void CopyVertexData3f(M3DVector3f *vVerts, GLuint nFirst, GLuint nCount);
+		void CopyNormalDataf(M3DVector3f *vNorms, GLuint nFirst, GLuint nCount);
+		void CopyColorData4f(M3DVector4f *vColors, GLuint nFirst, GLuint nCount);
+		void CopyTexCoordData2f(M3DVector2f *vTexCoords, GLuint uiTextureLayer, GLuint nFirst, GLuint nCount);
+
 		virtual void Draw(void);
+		virtual void DrawInstanced(GLInstanceArray &instances);
+
+		// Streaming, for batches that change every frame. The vertex data lives
+		// in a persistently mapped buffer (ARB_buffer_storage) holding nSlots
+		// copies of the batch. Each update goes into a copy the GPU has finished
+		// with, fenced, so neither the Copy functions nor Draw() wait on draws
+		// still in flight. Call before Begin(). Without OpenGL 4.4 or the
+		// extension, and on OpenGL ES, the batch quietly works the usual way.
+		void SetStreaming(bool bStream, GLuint nSlots = 3);
+		inline bool IsStreaming(void) { return uiStreamBuffer != 0; }
  
 		// Immediate mode emulation
-		// Slowest way to build an array on purpose... Use the above if you can instead
+		// Slowest way to build an array on purpose... Use the above if you can instead.
+		// The vertices collect in client memory and End() uploads them in one go.
+		// Reset() starts the same batch over without reallocating anything.
         void Reset(void);
         
         void Vertex3f(GLfloat x, GLfloat y, GLfloat z);
@@ -110,17 +171,45 @@ class GLBatch : public GLBatchBase
         void MultiTexCoord2fv(GLuint texture, M3DVector2f vTexCoord);               
         
     protected:
+		void StartBatch(GLenum primitive, GLuint nVerts, GLuint nIndexes, GLuint nVertexBytes);
+		void DrawBatch(GLInstanceArray *pInstances);
+		bool ReserveArrayBuffer(GLuint &uiBuffer, GLsizeiptr &nCapacity, GLsizeiptr nBytes);
+		void WriteArrayBuffer(GLuint uiBuffer, GLintptr nOffset, GLsizeiptr nBytes, const GLvoid *pData);
+		void UploadStagedArray(GLuint iArray);
+		void CreateStreamRing(void);
+		void ResetStreamRing(void);
+		void DeleteStreamRing(void);
+		void DisableUnusedAttributes(void);
+		void StreamAttribute(GLuint uiAttribute, const GLfloat *pData, GLuint nComponents);
+		void StreamToNextSlot(void);
+		void CopyArray(GLuint iArray, const GLvoid *pSource);
+		void CopyRange(GLuint iArray, const GLvoid *pSource, GLuint nFirst, GLuint nCount);
+		void FlushDirtyRanges(void);
+		GLuint *ArrayBuffer(GLuint iArray);
+		GLubyte *StagedArray(GLuint iArray);
+		GLsizei ArrayStride(GLuint iArray);
+		GLuint ArrayCount(void);
+
 		GLenum		primitiveType;		// What am I drawing....
         
 		GLuint		uiVertexArray;
 		GLuint      uiNormalArray;
 		GLuint		uiColorArray;
-		GLuint		*uiTextureCoordArray;
+		GLuint		uiTextureCoordArray[GLT_BATCH_TEXTURE_UNITS];
+		GLuint		uiIndexArray;
 		GLuint		vertexArrayObject;
+		GLsizeiptr	nArrayBytes[GLT_BATCH_ARRAYS];	// Size of each buffer above
+		GLsizeiptr	nIndexBytes;					// and of the element array
+		GLuint		uiEnabledAttributes;			// Attributes switched on in the vertex array object
+		GLint		nDirectState;					// Buffers edited without binding, -1 until asked
         
         GLuint nVertsBuilding;			// Building up vertexes counter (immediate mode emulator)
         GLuint nNumVerts;				// Number of verticies in this batch
         GLuint nNumTextureUnits;		// Number of texture coordinate sets
+        GLuint nNumIndexes;				// Number of indexes, 0 draws with glDrawArrays
+        GLenum indexType;				// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+        GLushort *pShortIndexes;		// Where 16 bit indexes are narrowed before upload
+        GLuint nMaxShortIndexes;		// Room in pShortIndexes
 		
         bool	bBatchDone;				// Batch has been built
  
@@ -128,8 +217,53 @@ class GLBatch : public GLBatchBase
 		M3DVector3f *pVerts;
 		M3DVector3f *pNormals;
 		M3DVector4f *pColors;
-		M3DVector2f **pTexCoords;
+		M3DVector2f *pTexCoords[GLT_BATCH_TEXTURE_UNITS];
+
+		GLfloat	*pStaging;				// Immediate mode arrays above all live in here
+		GLuint	nMaxStaging;			// Room in pStaging, in floats
+		GLVertexFormat vertexFormat;	// Layout of the vertices when bFormatted
+		bool	bFormatted;				// One interleaved array, described by vertexFormat
+		GLuint	uiStagedArrays;			// Arrays written since the last End()
+		GLuint	uiUsedArrays;			// Arrays written since Begin()
+
+		GLT_DIRTY_RANGES dirtyRanges[GLT_BATCH_ARRAYS];	// Edits waiting for Draw(), per array
+		bool	bDirtyRanges;			// Any of the above
+
+		bool	bStreaming;				// Asked for streaming at the next Begin()
+		GLuint	nStreamSlots;			// Copies of the batch in the ring
+		GLuint	uiStreamBuffer;			// The ring, 0 if not streaming
+		GLubyte	*pStreamMap;			// Where it's mapped
+		GLsizeiptr nStreamBytes;		// and how big it is
+		GLuint	nStreamSlot;			// Copy that Draw() uses
+		GLT_DIRTY_RANGES *pStreamDirty;	// What each copy in the ring is missing, per array
+		bool	bStreamDirty;			// Ranged edits waiting for Draw()
+	#ifndef OPENGL_ES
+		GLsync	streamFences[GLT_MAX_STREAM_SLOTS];	// Set when the GPU is done with a copy
+	#endif
 	
 		};
 
+
+////////////////////////////////////////////////////////////////////
+// A GLBatch of one vertex struct. VERTEX describes itself with
+//
+//	static void DescribeFormat(GLVertexFormat &format);
+//
+// (GLT_VERTEX_MEMBER does most of the work) and the batch only takes
+// arrays of it, so the layout and the data can't disagree.
+template <class VERTEX> class GLTypedBatch : public GLBatch
+	{
+	public:
+		void Begin(GLenum primitive, GLuint nVerts, GLuint nIndexes = 0)
+			{
+			GLVertexFormat format;
+			VERTEX::DescribeFormat(format);
+			format.SetStride(sizeof(VERTEX));
+			GLBatch::Begin(primitive, nVerts, format, nIndexes);
+			}
+
+		inline void CopyVertices(const VERTEX *pVertices) { CopyVertexData(pVertices); }
+		inline void CopyVertices(const VERTEX *pVertices, GLuint nFirst, GLuint nCount) { CopyVertexData(pVertices, nFirst, nCount); }
+	};
+
 #endif // __GL_BATCH__
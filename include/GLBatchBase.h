@@ -30,15 +30,23 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 #define __GL_BATCH_BASE__
 
 ////////////////////////////////////////////////////////////////////
-// This base class is a pure virtual class with one single virtual 
-// function, Draw(). The GLBegin class and GLTriangleBatch classes
+// This base class is an abstract class with one pure virtual
+// function, Draw(), and one virtual function with a default,
+// DrawInstanced(). The GLBegin class and GLTriangleBatch classes
 // are derived from this. Having a virtual Draw() function allows
 // these classes to be collected by container classes that can
 // then iterate over them and call their draw methods. 
+class GLInstanceArray;
+
 class GLBatchBase
 	{
 	public:
 		virtual void Draw(void) = 0;
+
+		// Draw once for every instance in instances, each with its own model
+		// matrix and color (see GLInstanceArray). Batches that can do it in a
+		// single call override this; the fallback calls Draw() per instance.
+		virtual void DrawInstanced(GLInstanceArray &instances);
 	};
 
 
@@ -0,0 +1,154 @@
+/*
+GLBufferPool.h
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __GL_BUFFER_POOL__
+#define __GL_BUFFER_POOL__
+
+// Bring in OpenGL 
+// Windows
+#ifdef WIN32
+#include <windows.h>		// Must have for Windows platform builds
+#ifndef GLEW_STATIC
+#define GLEW_STATIC
+#endif
+
+#include <gl\glew.h>			// OpenGL Extension "autoloader"
+#include <gl\gl.h>			// Microsoft OpenGL headers (version 1.1 by themselves)
+#endif
+
+// Mac OS X
+#ifdef __APPLE__
+#include <TargetConditionals.h>
+#if TARGET_OS_IPHONE | TARGET_IPHONE_SIMULATOR
+#include <OpenGLES/ES2/gl.h>
+#include <OpenGLES/ES2/glext.h>
+#define OPENGL_ES
+#else
+#include <GL/glew.h>
+#include <OpenGL/gl.h>		// Apple OpenGL haders (version depends on OS X SDK version)
+#endif
+#endif
+
+// Linux
+#ifdef linux
+#define GLEW_STATIC
+#include <glew.h>
+#endif
+
+#include <stddef.h>
+
+// Points the vertex attributes of one vertex format at the buffer bound to
+// GL_ARRAY_BUFFER, offsets counted from the start of the buffer. Meshes
+// that hand the pool the same function and stride share pages.
+typedef void (*GLT_POOL_ATTRIBUTE_SETUP)(void);
+
+struct GLT_POOL_PAGE;
+class GLInstanceArray;
+
+// Where a mesh ended up, filled in by GLBufferPool::Alloc()
+struct GLT_POOL_BLOCK
+	{
+	GLT_POOL_PAGE	*pPage;			// NULL when nothing is allocated
+	GLuint		iVertexRange;		// Allocator handles, for Free()
+	GLuint		iIndexRange;
+	GLint		nBaseVertex;		// Added to every index when drawing
+	GLsizeiptr	nIndexOffset;		// Byte offset of the first index
+	};
+
+////////////////////////////////////////////////////////////////////
+// Shared home for static mesh data. Rather than every batch owning a
+// vertex array object and a handful of buffer objects, meshes with the
+// same vertex format are packed into a few large pages, each one a
+// vertex buffer, an index buffer and a single vertex array object set up
+// once. A mesh is drawn with a byte offset into the index buffer and a
+// base vertex, so its indexes stay relative to its own first vertex.
+//
+// Space inside a page is managed with a two level segregated fit
+// allocator (TLSF): free ranges are filed by size class with a bitmap
+// per level, so finding a fit and giving space back are constant time,
+// and freed ranges merge with free neighbors straight away.
+//
+// Needs glDrawElementsBaseVertex (OpenGL 3.2 or
+// GL_ARB_draw_elements_base_vertex). Without it, and always on OpenGL ES,
+// Alloc() fails and batches keep their own buffers. Not thread safe, and
+// the pool has to outlive the meshes in it.
+class GLBufferPool
+	{
+	public:
+		GLBufferPool(GLsizeiptr nPageVertexBytes = 4 * 1024 * 1024, GLsizeiptr nPageIndexBytes = 1024 * 1024);
+		~GLBufferPool(void);
+
+		// Find room for nVerts vertices of nStride bytes and nIndexBytes of
+		// indexes. A mesh too big for a page gets a page of its own.
+		bool Alloc(GLsizei nStride, GLT_POOL_ATTRIBUTE_SETUP pSetup, GLuint nVerts, GLsizeiptr nIndexBytes,
+				   GLT_POOL_BLOCK &block);
+
+		// Fill in the space Alloc() found
+		void Upload(const GLT_POOL_BLOCK &block, GLuint nVerts, const GLvoid *pVertexData,
+					GLsizeiptr nIndexBytes, const GLvoid *pIndexData);
+
+		// Give the space back. The block is marked empty.
+		void Free(GLT_POOL_BLOCK &block);
+
+		// Draw nCount indexes of a block with its page's vertex array object,
+		// once per instance if pInstances is given
+		void DrawElements(const GLT_POOL_BLOCK &block, GLenum mode, GLsizei nCount, GLenum type,
+						  GLInstanceArray *pInstances = NULL);
+
+		// The vertex array object a block draws with, 0 for an empty block.
+		// Blocks that share one can be drawn together.
+		static GLuint GetVertexArray(const GLT_POOL_BLOCK &block);
+
+		// Delete the buffer objects of pages nothing lives in anymore
+		void Trim(void);
+
+		// Pages (one vertex array object and two buffer objects each)
+		inline GLuint GetPageCount(void) { return nPages; }
+
+		// A pool for everyone to share. It's never destroyed, so batches
+		// that are globals can still give their space back on the way out.
+		static GLBufferPool *GetDefault(void);
+
+	protected:
+		bool IsSupported(void);
+		GLT_POOL_PAGE *NewPage(GLsizei nStride, GLT_POOL_ATTRIBUTE_SETUP pSetup, GLuint nVerts, GLuint nIndexUnits);
+		void DeletePage(GLT_POOL_PAGE *pPage);
+
+		GLT_POOL_PAGE	*pFirst;		// All pages, newest first
+		GLuint		nPages;
+		GLsizeiptr	nPageVertexBytes;	// Size of a normal page
+		GLsizeiptr	nPageIndexBytes;
+		GLint		nSupported;			// -1 until the context has been asked
+		bool		bDirectState;		// Pages are immutable storage, written without binding
+	};
+
+#endif
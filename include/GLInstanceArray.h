@@ -0,0 +1,117 @@
+/*
+GLInstanceArray.h
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __GL_INSTANCE_ARRAY__
+#define __GL_INSTANCE_ARRAY__
+
+// Bring in OpenGL 
+// Windows
+#ifdef WIN32
+#include <windows.h>		// Must have for Windows platform builds
+#ifndef GLEW_STATIC
+#define GLEW_STATIC
+#endif
+
+#include <gl\glew.h>			// OpenGL Extension "autoloader"
+#include <gl\gl.h>			// Microsoft OpenGL headers (version 1.1 by themselves)
+#endif
+
+// Mac OS X
+#ifdef __APPLE__
+#include <TargetConditionals.h>
+#if TARGET_OS_IPHONE | TARGET_IPHONE_SIMULATOR
+#include <OpenGLES/ES2/gl.h>
+#include <OpenGLES/ES2/glext.h>
+#define OPENGL_ES
+#else
+#include <GL/glew.h>
+#include <OpenGL/gl.h>		// Apple OpenGL haders (version depends on OS X SDK version)
+#endif
+#endif
+
+// Linux
+#ifdef linux
+#define GLEW_STATIC
+#include <glew.h>
+#endif
+
+#include <math3d.h>
+
+////////////////////////////////////////////////////////////////////
+// Per instance data for GLBatchBase::DrawInstanced(): a model matrix and a
+// color for each copy of the batch. They feed the GLT_ATTRIBUTE_INSTANCE_
+// attributes with a divisor of one, so the instanced stock shaders see
+// the next matrix and color for each instance while the batch's own
+// vertices are reused.
+//
+// Hardware instancing needs OpenGL 3.3. Without it, and on OpenGL ES,
+// DrawInstanced() draws the instances one at a time, setting the
+// attributes' current values in between. The shaders can't tell.
+class GLInstanceArray
+	{
+	public:
+		GLInstanceArray(void);
+		~GLInstanceArray(void);
+
+		// Matrices and colors for nInstances copies. Either may be NULL, in
+		// which case every instance gets the identity matrix, or white.
+		// Storage only grows, so refilling each frame doesn't allocate.
+		void CopyInstanceData(GLuint nInstances, const M3DMatrix44f *pMatrices, const M3DVector4f *pColors = NULL);
+
+		inline GLuint GetInstanceCount(void) { return nNumInstances; }
+
+		// Can the batches draw all the instances in one call?
+		bool IsSupported(void);
+
+		// Enable the instance attributes and point them at the arrays in
+		// whatever vertex array object is bound. Unbind() disables them again
+		// so the batch can still draw without instances.
+		void Bind(void);
+		void Unbind(void);
+
+		// Or load instance i into the attributes' current values
+		void SetCurrent(GLuint i);
+
+	protected:
+		GLuint		nNumInstances;
+		GLuint		nMaxInstances;		// Room in the arrays below
+		M3DMatrix44f *pMatrices;		// Client copies, for drawing one at a time
+		M3DVector4f	*pColors;
+		bool		bMatrices;			// False when all identity
+		bool		bColors;			// False when all white
+
+		GLuint		uiInstanceBuffer;	// Matrices, then colors
+		GLsizeiptr	nBufferBytes;
+		GLint		nSupported;			// -1 until the context has been asked
+	};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+GLMeshArena.h
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __GL_MESH_ARENA__
+#define __GL_MESH_ARENA__
+
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////
+// Scratch memory for building meshes. Allocations are carved out of
+// large chunks and are never freed one at a time. Instead, every batch
+// that is building a mesh calls Acquire(), and when the last one calls
+// Release() the whole arena is rewound. The chunks are kept, so building
+// the next mesh reuses the same memory instead of going back to the heap.
+//
+// An arena is not thread safe. Batches built on different threads at
+// the same time need arenas of their own.
+class GLMeshArena
+	{
+	public:
+		GLMeshArena(size_t nChunkBytes = 1024 * 1024);
+		~GLMeshArena(void);
+
+		// Register/unregister a user. Rewinds when the last user lets go.
+		void Acquire(void);
+		void Release(void);
+
+		// Get some memory, aligned to 16 bytes. Only good until the arena rewinds.
+		void *Alloc(size_t nBytes);
+
+		// Make an allocation bigger, keeping its contents. Grows in place if
+		// it was the last thing allocated and there is room, otherwise copies.
+		void *Grow(void *pOld, size_t nOldBytes, size_t nNewBytes);
+
+		// Give the chunks back to the heap. Does nothing while in use.
+		void Trim(void);
+
+		// Bytes held from the heap, used or not
+		inline size_t GetReservedBytes(void) { return nReserved; }
+
+		// The arena GLTriangleBatch uses unless told otherwise
+		static GLMeshArena *GetDefault(void);
+
+	protected:
+		struct Chunk {
+			Chunk	*pNext;
+			size_t	nSize;		// Usable bytes after the header
+			size_t	nUsed;
+			};
+
+		Chunk	*pFirst;		// All chunks, in the order they are used
+		Chunk	*pCurrent;		// Chunk allocations are coming from
+		void	*pLast;			// Most recent allocation, for growing in place
+		size_t	nChunkBytes;
+		size_t	nReserved;
+		unsigned int nUsers;
+	};
+
+#endif
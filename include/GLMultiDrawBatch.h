@@ -0,0 +1,124 @@
+/*
+GLMultiDrawBatch.h
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __GL_MULTI_DRAW_BATCH__
+#define __GL_MULTI_DRAW_BATCH__
+
+#include <GLBatchBase.h>
+#include <GLTriangleBatch.h>
+#include <GLInstanceArray.h>
+
+// One draw of glMultiDrawElementsIndirect, laid out the way OpenGL reads it
+struct GLT_DRAW_ELEMENTS_COMMAND
+	{
+	GLuint	nCount;
+	GLuint	nInstanceCount;
+	GLuint	nFirstIndex;
+	GLint	nBaseVertex;
+	GLuint	nBaseInstance;
+	};
+
+// Draws that go out in one call: same vertex array object, same index type
+struct GLT_DRAW_GROUP
+	{
+	GLuint	uiVertexArray;		// 0 for meshes that aren't pooled
+	GLenum	indexType;
+	GLuint	nFirst;				// First command of the group
+	GLuint	nCount;
+	};
+
+////////////////////////////////////////////////////////////////////
+// A collection of GLTriangleBatch meshes, each with its own model matrix
+// and color, drawn with as few calls as possible. Meshes that live in the
+// same GLBufferPool page share a vertex array object, so they go out in
+// one glMultiDrawElementsIndirect with a command per mesh. Each command's
+// base instance picks the mesh's matrix and color out of a GLInstanceArray,
+// so draw with GLT_SHADER_FLAT_INSTANCED or
+// GLT_SHADER_POINT_LIGHT_DIFF_INSTANCED (or shaders of your own reading
+// the same attributes), with view matrices.
+//
+// Meshes that aren't pooled still draw, one Draw() at a time. So does
+// everything without OpenGL 4.3 (or GL_ARB_multi_draw_indirect and
+// GL_ARB_base_instance), and on OpenGL ES.
+class GLMultiDrawBatch : public GLBatchBase
+	{
+	public:
+		GLMultiDrawBatch(void);
+		virtual ~GLMultiDrawBatch(void);
+
+		// Start a new list of draws. Storage from last time is reused.
+		void Begin(void);
+
+		// Draw a mesh with this model matrix and color (white if NULL). The
+		// mesh has to stay as it is until the next Begin(). The same mesh can
+		// be added any number of times.
+		void AddBatch(GLTriangleBatch &batch, const M3DMatrix44f mModel, const M3DVector4f vColor = NULL);
+
+		// Sort the draws by vertex array object and upload the commands
+		void End(void);
+
+		virtual void Draw(void);
+
+		inline GLuint GetDrawCount(void) { return nNumDraws; }
+
+		// Calls Draw() makes, one per group plus one per unpooled mesh
+		GLuint GetCallCount(void);
+
+		// Can the pooled meshes go out with one call per group?
+		bool IsSupported(void);
+
+	protected:
+		GLuint FindGroup(GLuint uiVertexArray, GLenum indexType);
+
+		GLuint		nNumDraws;
+		GLuint		nMaxDraws;			// Room in the arrays below
+		GLTriangleBatch **ppBatches;	// In the order they were added
+		M3DMatrix44f *pMatrices;
+		M3DVector4f	*pColors;
+		GLuint		*pGroupOf;			// Group of each draw
+
+		GLTriangleBatch **ppSorted;		// Same again, grouped
+		M3DMatrix44f *pSortedMatrices;
+		M3DVector4f	*pSortedColors;
+		GLT_DRAW_ELEMENTS_COMMAND *pCommands;
+
+		GLT_DRAW_GROUP *pGroups;
+		GLuint		nNumGroups;
+		GLuint		nMaxGroups;
+
+		GLInstanceArray	instances;		// Matrices and colors, by base instance
+		GLuint		uiCommandBuffer;
+		GLsizeiptr	nCommandBytes;
+		GLint		nSupported;			// -1 until the context has been asked
+	};
+
+#endif
@@ -63,6 +63,9 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 #include <glew.h>
 #endif
 
+#include <string.h>
+#include <math3d.h>
+
 //#include <vector>
 //using namespace std;
 
@@ -72,12 +75,69 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 
 enum GLT_STOCK_SHADER { GLT_SHADER_IDENTITY = 0, GLT_SHADER_FLAT, GLT_SHADER_SHADED, GLT_SHADER_DEFAULT_LIGHT, GLT_SHADER_POINT_LIGHT_DIFF,
 								GLT_SHADER_TEXTURE_REPLACE, GLT_SHADER_TEXTURE_MODULATE, GLT_SHADER_TEXTURE_POINT_LIGHT_DIFF, GLT_SHADER_TEXTURE_RECT_REPLACE,
+                                GLT_SHADER_FLAT_INSTANCED, GLT_SHADER_POINT_LIGHT_DIFF_INSTANCED,
                                 GLT_SHADER_LAST };
 
 enum GLT_SHADER_ATTRIBUTE { GLT_ATTRIBUTE_VERTEX = 0, GLT_ATTRIBUTE_COLOR, GLT_ATTRIBUTE_NORMAL, 
                                     GLT_ATTRIBUTE_TEXTURE0, GLT_ATTRIBUTE_TEXTURE1, GLT_ATTRIBUTE_TEXTURE2, GLT_ATTRIBUTE_TEXTURE3, 
+                                    GLT_ATTRIBUTE_INSTANCE_MATRIX0, GLT_ATTRIBUTE_INSTANCE_MATRIX1, GLT_ATTRIBUTE_INSTANCE_MATRIX2, GLT_ATTRIBUTE_INSTANCE_MATRIX3,
+                                    GLT_ATTRIBUTE_INSTANCE_COLOR,
                                     GLT_ATTRIBUTE_LAST};
 
+// Uniforms of the stock shaders, looked up once when they're loaded
+enum GLT_STOCK_UNIFORM { GLT_UNIFORM_MVP_MATRIX = 0, GLT_UNIFORM_MV_MATRIX, GLT_UNIFORM_P_MATRIX, GLT_UNIFORM_COLOR,
+                                    GLT_UNIFORM_LIGHT_POSITION, GLT_UNIFORM_TEXTURE_UNIT0,
+                                    GLT_UNIFORM_LAST };
+
+
+// Last value a stock shader uniform was given, big enough for a 4x4 matrix
+struct GLT_UNIFORM_SHADOW {
+	GLfloat	fValue[16];
+	bool	bValid;
+	};
+
+
+// The argument lists the stock shaders take, for the typed UseStockShader<>()
+enum GLT_STOCK_SHADER_ARGS { GLT_ARGS_COLOR = 0, GLT_ARGS_MVP, GLT_ARGS_MVP_COLOR, GLT_ARGS_MVP_TEXTURE,
+                                    GLT_ARGS_MVP_COLOR_TEXTURE, GLT_ARGS_MV_P_COLOR, GLT_ARGS_MV_P_LIGHT_COLOR,
+                                    GLT_ARGS_MV_P_LIGHT_COLOR_TEXTURE };
+
+// Which stock shader takes which argument list. Only the pairs listed here
+// have a return type, so UseStockShader<>() with the wrong arguments for
+// the shader doesn't compile.
+template <GLT_STOCK_SHADER nShaderID, GLT_STOCK_SHADER_ARGS nArgs> struct GLTStockShaderArgs { };
+
+#define GLT_STOCK_SHADER_TAKES(nShaderID, nArgs)	\
+	template <> struct GLTStockShaderArgs<nShaderID, nArgs> { typedef GLint type; }
+
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_IDENTITY, GLT_ARGS_COLOR);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_FLAT, GLT_ARGS_MVP_COLOR);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_FLAT_INSTANCED, GLT_ARGS_MVP_COLOR);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_SHADED, GLT_ARGS_MVP);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_DEFAULT_LIGHT, GLT_ARGS_MV_P_COLOR);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_POINT_LIGHT_DIFF, GLT_ARGS_MV_P_LIGHT_COLOR);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_POINT_LIGHT_DIFF_INSTANCED, GLT_ARGS_MV_P_LIGHT_COLOR);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_TEXTURE_REPLACE, GLT_ARGS_MVP_TEXTURE);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_TEXTURE_RECT_REPLACE, GLT_ARGS_MVP_TEXTURE);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_TEXTURE_MODULATE, GLT_ARGS_MVP_COLOR_TEXTURE);
+GLT_STOCK_SHADER_TAKES(GLT_SHADER_TEXTURE_POINT_LIGHT_DIFF, GLT_ARGS_MV_P_LIGHT_COLOR_TEXTURE);
+
+
+// What the stock shaders' std140 uniform block holds when
+// SetTransformBlock() is on. The light position's w is padding.
+struct GLT_TRANSFORM_BLOCK {
+	M3DMatrix44f	mvpMatrix;
+	M3DMatrix44f	mvMatrix;
+	M3DMatrix44f	pMatrix;
+	M3DVector4f		vLightPos;
+	};
+
+// Uniform buffer binding point the block is read from
+#define GLT_TRANSFORM_BLOCK_BINDING		0
+
+// The ring of blocks is fenced in this many pieces
+#define GLT_TRANSFORM_RING_SEGMENTS		4
+
 
 struct SHADERLOOKUPETRY {
 	char szVertexShaderName[MAX_SHADER_NAME_LENGTH];
@@ -98,9 +158,137 @@ class GLShaderManager
 		// Find one of the standard stock shaders and return it's shader handle. 
 		GLuint GetStockShader(GLT_STOCK_SHADER nShaderID);
 
-		// Use a stock shader, and pass in the parameters needed
+		// Where one of its uniforms is, -1 if it doesn't have it
+		GLint GetStockUniform(GLT_STOCK_SHADER nShaderID, GLT_STOCK_UNIFORM nUniform);
+
+		// Use a stock shader, and pass in the parameters needed. The instanced
+		// shaders take the same parameters as GLT_SHADER_FLAT and
+		// GLT_SHADER_POINT_LIGHT_DIFF, with the model part of the matrices
+		// coming from each instance's matrix and the color multiplied by its color.
 		GLint UseStockShader(GLT_STOCK_SHADER nShaderID, ...);
 
+		// The same with the shader picked at compile time, for example
+		//
+		//	shaderManager.UseStockShader<GLT_SHADER_FLAT>(mvpMatrix, vColor);
+		//
+		// The arguments are type checked, and binding is inlined down to the
+		// glUniform*() calls the shader needs.
+		template <GLT_STOCK_SHADER nShaderID>
+		typename GLTStockShaderArgs<nShaderID, GLT_ARGS_COLOR>::type UseStockShader(const M3DVector4f vColor)
+			{
+			BindStockShader(nShaderID);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, vColor);
+			CommitTransforms();
+			return uiStockShaders[nShaderID];
+			}
+
+		template <GLT_STOCK_SHADER nShaderID>
+		typename GLTStockShaderArgs<nShaderID, GLT_ARGS_MVP>::type UseStockShader(const M3DMatrix44f mvpMatrix)
+			{
+			BindStockShader(nShaderID);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MVP_MATRIX, mvpMatrix);
+			CommitTransforms();
+			return uiStockShaders[nShaderID];
+			}
+
+		template <GLT_STOCK_SHADER nShaderID>
+		typename GLTStockShaderArgs<nShaderID, GLT_ARGS_MVP_COLOR>::type UseStockShader(const M3DMatrix44f mvpMatrix, const M3DVector4f vColor)
+			{
+			BindStockShader(nShaderID);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MVP_MATRIX, mvpMatrix);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, vColor);
+			CommitTransforms();
+			return uiStockShaders[nShaderID];
+			}
+
+		template <GLT_STOCK_SHADER nShaderID>
+		typename GLTStockShaderArgs<nShaderID, GLT_ARGS_MVP_TEXTURE>::type UseStockShader(const M3DMatrix44f mvpMatrix, GLint iTextureUnit)
+			{
+			BindStockShader(nShaderID);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MVP_MATRIX, mvpMatrix);
+			StockUniform1i(nShaderID, GLT_UNIFORM_TEXTURE_UNIT0, iTextureUnit);
+			CommitTransforms();
+			return uiStockShaders[nShaderID];
+			}
+
+		template <GLT_STOCK_SHADER nShaderID>
+		typename GLTStockShaderArgs<nShaderID, GLT_ARGS_MVP_COLOR_TEXTURE>::type UseStockShader(const M3DMatrix44f mvpMatrix, const M3DVector4f vColor,
+																							   GLint iTextureUnit)
+			{
+			BindStockShader(nShaderID);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MVP_MATRIX, mvpMatrix);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, vColor);
+			StockUniform1i(nShaderID, GLT_UNIFORM_TEXTURE_UNIT0, iTextureUnit);
+			CommitTransforms();
+			return uiStockShaders[nShaderID];
+			}
+
+		template <GLT_STOCK_SHADER nShaderID>
+		typename GLTStockShaderArgs<nShaderID, GLT_ARGS_MV_P_COLOR>::type UseStockShader(const M3DMatrix44f mvMatrix, const M3DMatrix44f pMatrix,
+																						const M3DVector4f vColor)
+			{
+			BindStockShader(nShaderID);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MV_MATRIX, mvMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_P_MATRIX, pMatrix);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, vColor);
+			CommitTransforms();
+			return uiStockShaders[nShaderID];
+			}
+
+		template <GLT_STOCK_SHADER nShaderID>
+		typename GLTStockShaderArgs<nShaderID, GLT_ARGS_MV_P_LIGHT_COLOR>::type UseStockShader(const M3DMatrix44f mvMatrix, const M3DMatrix44f pMatrix,
+																							  const M3DVector3f vLightPos, const M3DVector4f vColor)
+			{
+			BindStockShader(nShaderID);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MV_MATRIX, mvMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_P_MATRIX, pMatrix);
+			StockUniform3(nShaderID, GLT_UNIFORM_LIGHT_POSITION, vLightPos);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, vColor);
+			CommitTransforms();
+			return uiStockShaders[nShaderID];
+			}
+
+		template <GLT_STOCK_SHADER nShaderID>
+		typename GLTStockShaderArgs<nShaderID, GLT_ARGS_MV_P_LIGHT_COLOR_TEXTURE>::type UseStockShader(const M3DMatrix44f mvMatrix, const M3DMatrix44f pMatrix,
+																									  const M3DVector3f vLightPos, const M3DVector4f vColor,
+																									  GLint iTextureUnit)
+			{
+			BindStockShader(nShaderID);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MV_MATRIX, mvMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_P_MATRIX, pMatrix);
+			StockUniform3(nShaderID, GLT_UNIFORM_LIGHT_POSITION, vLightPos);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, vColor);
+			StockUniform1i(nShaderID, GLT_UNIFORM_TEXTURE_UNIT0, iTextureUnit);
+			CommitTransforms();
+			return uiStockShaders[nShaderID];
+			}
+
+		// Keep track of the program in use and the uniforms last sent to each
+		// stock shader, and skip glUseProgram() and glUniform*() calls that
+		// wouldn't change anything. Off by default. With it on, call
+		// InvalidateState() after calling glUseProgram() yourself, or setting
+		// a stock shader's uniforms directly.
+		void SetStateTracking(bool bTrack);
+		void InvalidateState(void);
+
+		// Have the stock shaders read their transforms and light position
+		// from one std140 uniform block (GLT_TRANSFORM_BLOCK) instead of
+		// loose uniforms. UseStockShader() takes the same arguments and
+		// writes them into the next slot of a persistently mapped ring of
+		// nSlots blocks, bound with glBindBufferRange(), but only when they
+		// differ from the slot bound now. GetStockUniform() has no location
+		// for the ones in the block. Call before InitializeStockShaders().
+		// Needs OpenGL 4.4 or 3.1 with ARB_buffer_storage, otherwise (and
+		// on OpenGL ES) the stock shaders quietly use loose uniforms.
+		void SetTransformBlock(bool bUse, GLuint nSlots = 1024);
+		inline bool IsUsingTransformBlock(void) { return pTransformMap != NULL; }
+
+		// With the block in use, put an object's transforms in it once
+		// (mvpMatrix is worked out here) for all the stock shaders that
+		// draw it. UseStockShader() calls given the same matrices then
+		// don't write anything. vLightPos NULL leaves the light where it is.
+		void SetTransforms(const M3DMatrix44f mvMatrix, const M3DMatrix44f pMatrix, const M3DVector3f vLightPos = NULL);
+
 		// Load a shader pair from file, return NULL or shader handle. 
 		// Vertex program name (minus file extension)
 		// is saved in the lookup table
@@ -118,6 +306,108 @@ class GLShaderManager
 	
 	protected:
 		GLuint	uiStockShaders[GLT_SHADER_LAST];
+		GLint	iStockUniforms[GLT_SHADER_LAST][GLT_UNIFORM_LAST];	// -1 where a shader doesn't have one
+
+		void LoadStockShaders(const char *szVertexPrefix, const char *szFragmentPrefix);
+		bool CreateTransformRing(void);
+		void DeleteTransformRing(void);
+		void WriteTransforms(void);
+
+		bool	bUseTransformBlock;		// Asked for at the next InitializeStockShaders()
+		GLuint	nTransformSlots;		// Blocks in the ring, a multiple of GLT_TRANSFORM_RING_SEGMENTS
+		GLuint	uiTransformBuffer;		// The ring, 0 when not in use
+		GLubyte	*pTransformMap;			// Where it's mapped
+		GLsizei	nTransformStride;		// Block size rounded up to the offset alignment
+		GLuint	nTransformSlot;			// Slot bound now
+	#ifndef OPENGL_ES
+		GLsync	transformFences[GLT_TRANSFORM_RING_SEGMENTS];	// Set when the GPU is done with a piece of the ring
+	#endif
+		GLT_TRANSFORM_BLOCK	pendingTransforms;	// Contents of the bound slot plus changes
+		bool	bTransformsChanged;		// pendingTransforms needs a new slot
+
+		bool	bTrackState;
+		GLuint	uiCurrentProgram;		// 0 when unknown
+		GLT_UNIFORM_SHADOW	stockShadows[GLT_SHADER_LAST][GLT_UNIFORM_LAST];
+
+		// Bind a stock shader unless it already is
+		inline void BindStockShader(GLT_STOCK_SHADER nShaderID)
+			{
+			if(!bTrackState || uiCurrentProgram != uiStockShaders[nShaderID]) {
+				glUseProgram(uiStockShaders[nShaderID]);
+				uiCurrentProgram = uiStockShaders[nShaderID];
+				}
+			}
+
+		// With state tracking on, a uniform is only sent when it differs from
+		// what the stock shader was last given. Uniform values belong to the
+		// program, so these copies stay good while other programs are in use.
+		inline bool StockUniformChanged(GLT_STOCK_SHADER nShaderID, GLT_STOCK_UNIFORM nUniform, const void *pValue, GLuint nBytes)
+			{
+			if(!bTrackState)
+				return true;
+
+			GLT_UNIFORM_SHADOW &shadow = stockShadows[nShaderID][nUniform];
+			if(shadow.bValid && memcmp(shadow.fValue, pValue, nBytes) == 0)
+				return false;
+
+			memcpy(shadow.fValue, pValue, nBytes);
+			shadow.bValid = true;
+			return true;
+			}
+
+		// With the transform block in use, the transforms and light position
+		// go into the pending block instead. CommitTransforms() writes it
+		// out if anything in it changed.
+		inline void StockTransform(GLT_STOCK_UNIFORM nUniform, const GLfloat *v, GLuint nBytes)
+			{
+			GLfloat *pField;
+			switch(nUniform)
+				{
+				case GLT_UNIFORM_MVP_MATRIX:	pField = pendingTransforms.mvpMatrix; break;
+				case GLT_UNIFORM_MV_MATRIX:		pField = pendingTransforms.mvMatrix; break;
+				case GLT_UNIFORM_P_MATRIX:		pField = pendingTransforms.pMatrix; break;
+				default:						pField = pendingTransforms.vLightPos; break;
+				}
+
+			if(memcmp(pField, v, nBytes) != 0) {
+				memcpy(pField, v, nBytes);
+				bTransformsChanged = true;
+				}
+			}
+
+		inline void CommitTransforms(void)
+			{
+			if(bTransformsChanged && pTransformMap != NULL)
+				WriteTransforms();
+			}
+
+		inline void StockUniformMatrix4(GLT_STOCK_SHADER nShaderID, GLT_STOCK_UNIFORM nUniform, const GLfloat *m)
+			{
+			if(pTransformMap != NULL)
+				StockTransform(nUniform, m, sizeof(M3DMatrix44f));
+			else if(StockUniformChanged(nShaderID, nUniform, m, sizeof(M3DMatrix44f)))
+				glUniformMatrix4fv(iStockUniforms[nShaderID][nUniform], 1, GL_FALSE, m);
+			}
+
+		inline void StockUniform4(GLT_STOCK_SHADER nShaderID, GLT_STOCK_UNIFORM nUniform, const GLfloat *v)
+			{
+			if(StockUniformChanged(nShaderID, nUniform, v, sizeof(M3DVector4f)))
+				glUniform4fv(iStockUniforms[nShaderID][nUniform], 1, v);
+			}
+
+		inline void StockUniform3(GLT_STOCK_SHADER nShaderID, GLT_STOCK_UNIFORM nUniform, const GLfloat *v)
+			{
+			if(pTransformMap != NULL)
+				StockTransform(nUniform, v, sizeof(M3DVector3f));
+			else if(StockUniformChanged(nShaderID, nUniform, v, sizeof(M3DVector3f)))
+				glUniform3fv(iStockUniforms[nShaderID][nUniform], 1, v);
+			}
+
+		inline void StockUniform1i(GLT_STOCK_SHADER nShaderID, GLT_STOCK_UNIFORM nUniform, GLint i)
+			{
+			if(StockUniformChanged(nShaderID, nUniform, &i, sizeof(GLint)))
+				glUniform1i(iStockUniforms[nShaderID][nUniform], i);
+			}
 //		vector <SHADERLOOKUPETRY>	shaderTable;
 
 	};
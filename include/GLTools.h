@@ -84,6 +84,7 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 
 // Universal includes
 #include <stdio.h>
+#include <stdarg.h>
 #include <math.h>
 #include <math3d.h>
 #include <GLBatch.h>
@@ -146,6 +147,10 @@ void gltGetOpenGLVersion(GLint &nMajor, GLint &nMinor);
 // Check to see if an exension is supported
 int gltIsExtSupported(const char *szExtension);
 
+// Direct state access and immutable buffer storage, OpenGL 4.5 or the
+// ARB extensions. Returns 1 or 0, always 0 on OpenGL ES.
+int gltIsDirectStateAccessSupported(void);
+
 // Set working directoyr to /Resources on the Mac
 void gltSetWorkingDirectory(const char *szArgv);
 
@@ -176,12 +181,22 @@ bool	gltLoadShaderFile(const char *szFile, GLuint shader);
 
 GLuint	gltLoadShaderPair(const char *szVertexProg, const char *szFragmentProg);
 GLuint   gltLoadShaderPairWithAttributes(const char *szVertexProg, const char *szFragmentProg, ...);
+GLuint   gltLoadShaderPairWithAttributesV(const char *szVertexProg, const char *szFragmentProg, va_list attributeList);
 GLuint gltLoadShaderTripletWithAttributes(const char *szVertexShader,
                                           const char *szGeometryShader,
                                           const char *szFragmentShader, ...);
 
 GLuint gltLoadShaderPairSrc(const char *szVertexSrc, const char *szFragmentSrc);
 GLuint gltLoadShaderPairSrcWithAttributes(const char *szVertexProg, const char *szFragmentProg, ...);
+GLuint gltLoadShaderPairSrcWithAttributesV(const char *szVertexSrc, const char *szFragmentSrc, va_list attributeList);
+
+// Program binary cache. With a directory set, the loaders above (and the
+// stock shaders) look there for a binary of the same sources, attribute
+// bindings and driver before compiling anything, and save one after each
+// successful link. NULL or "" (the default) is off. Needs OpenGL 4.1 or
+// ARB_get_program_binary. A binary the driver rejects is deleted and the
+// program is compiled from source as usual.
+void gltSetProgramCacheDir(const char *szDir);
 
 bool gltCheckErrors(GLuint progName = 0);
 void gltGenerateOrtho2DMat(GLuint width, GLuint height, M3DMatrix44f &orthoMatrix, GLBatch &screenQuad);
@@ -33,8 +33,8 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
  *  container. The AddTriangle() function searches the current list of triangles
  *  and determines if the vertex/normal/texcoord is a duplicate. If so, it addes
  *  an entry to the index array instead of the list of vertices.
- *  When finished, call EndMesh() to free up extra unneeded memory that is reserved
- *  as workspace when you call BeginMesh().
+ *  When finished, call End() to hand back the workspace memory that BeginMesh()
+ *  borrowed from the mesh arena.
  *
  *  This class can easily be extended to contain other vertex attributes, and to 
  *  save itself and load itself from disk (thus forming the beginnings of a custom
@@ -80,42 +80,192 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 #include <math3d.h>
 #include <GLBatchBase.h>
 #include <GLShaderManager.h>
+#include <GLBufferPool.h>
+#include <GLInstanceArray.h>
+
+class GLMeshArena;
 
 #define VERTEX_DATA     0
 #define NORMAL_DATA     1
 #define TEXTURE_DATA    2
 #define INDEX_DATA      3
 
+// How AddTriangle() looks for an existing copy of a vertex. The linear scan
+// compares against every vertex added so far (O(n^2) for the whole mesh), the
+// hash grid only against vertices that land in nearby grid cells. Both use the
+// same tolerance and produce identical meshes.
+enum GLT_WELD_MODE { GLT_WELD_LINEAR = 0, GLT_WELD_HASH_GRID };
+
+// How End() stores the vertex data. Separate puts positions, normals and
+// texture coordinates in three buffer objects. Interleaved packs them into
+// one buffer, 32 bytes per vertex (position, normal, texcoord), so a vertex
+// fetch reads one contiguous block. Packed is interleaved at 16 bytes per
+// vertex: positions are 16 bit normalized integers spanning the mesh bounds,
+// normals are GL_INT_2_10_10_10_REV and texture coordinates half floats.
+// Packed positions need GetPositionMatrix() applied (see below). Packed
+// needs OpenGL 3.3 or the matching extensions, otherwise (and on OpenGL ES)
+// End() quietly uses interleaved instead.
+enum GLT_VERTEX_LAYOUT { GLT_LAYOUT_SEPARATE = 0, GLT_LAYOUT_INTERLEAVED, GLT_LAYOUT_PACKED };
+
+// Size of the FIFO post-transform vertex cache that the triangle reordering
+// targets and the ACMR statistic is measured against
+#define GLT_VERTEX_CACHE_SIZE   16
+
 class GLTriangleBatch : public GLBatchBase
     {
     public:
         GLTriangleBatch(void);
         virtual ~GLTriangleBatch(void);
         
-        // Use these three functions to add triangles
+        // Select the duplicate vertex search. Ignored while a mesh is being
+        // built, call before BeginMesh()
+        void SetWeldMode(GLT_WELD_MODE mode);
+        inline GLT_WELD_MODE GetWeldMode(void) { return weldMode; }
+
+        // Select the buffer layout, call before End()
+        inline void SetVertexLayout(GLT_VERTEX_LAYOUT layout) { vertexLayout = layout; }
+        inline GLT_VERTEX_LAYOUT GetVertexLayout(void) { return vertexLayout; }
+
+        // Reorder the triangles in End() for better post-transform vertex
+        // cache reuse (Tipsify). Off by default, call before End()
+        inline void SetOptimizeVertexCache(bool bOptimize) { bOptimizeCache = bOptimize; }
+
+        // Renumber the vertices in End() in the order the index buffer first
+        // uses them, so vertex fetch walks memory mostly front to back.
+        // Off by default, call before End()
+        inline void SetOptimizeVertexFetch(bool bOptimize) { bOptimizeFetch = bOptimize; }
+
+        // Where BeginMesh() gets its workspace, the shared default arena if NULL.
+        // Call between meshes, not while building one.
+        void SetMeshArena(GLMeshArena *pNewArena);
+
+        // Put the mesh in a shared buffer pool (GLBufferPool::GetDefault() or
+        // one of your own) instead of buffer objects of its own. NULL, the
+        // default, is own buffers. Takes effect at the next End(). Pooled
+        // meshes are interleaved or packed, a separate layout is interleaved.
+        // Falls back to own buffers when the pool can't take the mesh.
+        inline void SetBufferPool(GLBufferPool *pPool) { pBufferPool = pPool; }
+        inline GLBufferPool *GetBufferPool(void) { return pBufferPool; }
+        inline bool IsPooled(void) { return pBlockPool != NULL; }
+        inline const GLT_POOL_BLOCK &GetPoolBlock(void) { return poolBlock; }
+
+        // Use these three functions to add triangles. nMaxVerts (the number of
+        // indexes expected) is only a first guess, the workspace grows as needed.
         void BeginMesh(GLuint nMaxVerts);
         void AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3DVector2f vTexCoords[3]);
         void End(void);
 
+        // Or hand over a mesh that is already welded and indexed. This skips
+        // AddTriangle() and goes straight to End(). The arrays are read in place
+        // and are not kept or freed, and normals are taken as already unit length.
+        // Only the optional reordering passes need a private copy.
+        void LoadIndexedMesh(GLuint nVerts, M3DVector3f *verts, M3DVector3f *vNorms, M3DVector2f *vTexCoords,
+                             GLuint nIndexes, GLuint *indexes);
+
+        // Or weld a whole triangle soup (three vertices per triangle, nothing
+        // shared) on several threads and go straight to End(). nThreads of 0
+        // means one per core. Vertices are welded by sorting quantized keys, so
+        // two of them merge when every attribute rounds to the same multiple of
+        // the weld tolerance. That's a grid rather than AddTriangle()'s distance
+        // test, so a pair that straddles a rounding boundary can stay separate.
+        // The caller's arrays are only read.
+        void BuildMeshParallel(GLuint nTriangles, M3DVector3f *verts, M3DVector3f *vNorms, M3DVector2f *vTexCoords,
+                               GLuint nThreads = 0);
+
+        // Keep a read only copy of the finished mesh in memory after End(),
+        // for picking, collision, bounds and the like. Off by default, call
+        // before End(). Turning it off frees any copy already made.
+        void SetRetainGeometry(bool bRetain);
+        inline bool GetRetainGeometry(void) { return bRetainGeometry; }
+
+        // The retained copy, in the same order as the buffer objects. NULL
+        // unless retention was on for the last End(). Indexes are stored in
+        // GetIndexType() format, GetIndex() reads one either way.
+        inline const M3DVector3f *GetVertices(void) { return pRetainedVerts; }
+        inline const M3DVector3f *GetNormals(void) { return pRetainedNorms; }
+        inline const M3DVector2f *GetTexCoords(void) { return pRetainedTexCoords; }
+        inline const GLvoid *GetIndexData(void) { return pRetainedIndexes; }
+        inline GLuint GetIndex(GLuint i) { return (indexType == GL_UNSIGNED_SHORT) ? 
+                                                  ((const GLushort *)pRetainedIndexes)[i] : ((const GLuint *)pRetainedIndexes)[i]; }
+
+        // Takes the packed positions of a GLT_LAYOUT_PACKED mesh back to model
+        // space (a uniform scale and a translation). Multiply it onto the
+        // model-view matrix before drawing. Identity for the other layouts.
+        inline void GetPositionMatrix(M3DMatrix44f mMatrix) { m3dCopyMatrix44(mMatrix, positionMatrix); }
+
         // Useful for statistics
         inline GLuint GetIndexCount(void) { return nNumIndexes; }
         inline GLuint GetVertexCount(void) { return nNumVerts; }
 
+        // Average cache miss ratio: vertex shader runs per triangle with a
+        // GLT_VERTEX_CACHE_SIZE entry FIFO cache, measured by End().
+        // 3.0 is no reuse at all, 0.5 is the best a big regular grid can do.
+        inline GLfloat GetACMR(void) { return fACMR; }
+
+        // GL_UNSIGNED_SHORT when all the vertices can be reached with 16 bit
+        // indexes, GL_UNSIGNED_INT for bigger meshes
+        inline GLenum GetIndexType(void) { return indexType; }
+
         
         // Draw - make sure you call glEnableClientState for these arrays
         virtual void Draw(void);
+        virtual void DrawInstanced(GLInstanceArray &instances);
         
     protected:
-        GLushort  *pIndexes;        // Array of indexes
+        GLuint FindVertex(M3DVector3f vVert, M3DVector3f vNorm, M3DVector2f vTexCoord);
+        void SetupVertexAttributes(void);
+        void CreateBuffers(const GLvoid *pVertexData, GLsizei nStride, const GLvoid *pIndexData, GLsizeiptr nIndexBytes);
+    #ifndef OPENGL_ES
+        void CreateImmutableBuffers(const GLvoid *pVertexData, GLsizei nStride, const GLvoid *pIndexData, GLsizeiptr nIndexBytes);
+    #endif
+        void ReleaseWorkspace(void);
+        void RehashVertices(void);
+        void GrowIndexes(void);
+        void GrowVertices(void);
+        void OptimizeVertexCache(void);
+        void OptimizeVertexFetch(void);
+        GLfloat MeasureACMR(void);
+        const GLvoid *PackVertices(void);
+        const GLvoid *InterleaveVertices(void);
+        void RetainGeometry(const GLvoid *pIndexData);
+        void FreeRetainedGeometry(void);
+
+        GLuint  *pIndexes;          // Array of indexes
         M3DVector3f *pVerts;        // Array of vertices
         M3DVector3f *pNorms;        // Array of normals
         M3DVector2f *pTexCoords;    // Array of texture coordinates
         
-        GLuint nMaxIndexes;         // Maximum workspace
+        GLMeshArena *pArena;        // Workspace memory comes from here
+        bool bBuilding;             // Holding workspace from the arena
+        bool bExternalArrays;       // Arrays belong to the caller of LoadIndexedMesh()
+        GLuint nMaxIndexes;         // Room in the index workspace
+        GLuint nMaxVerts;           // Room in the vertex workspace
         GLuint nNumIndexes;         // Number of indexes currently used
         GLuint nNumVerts;           // Number of vertices actually used
+        GLenum indexType;           // Type of the indexes in the index buffer
+        bool bOptimizeCache;        // Reorder triangles for the vertex cache
+        bool bOptimizeFetch;        // Reorder vertices to match the index order
+        GLfloat fACMR;              // Average cache miss ratio of the final index order
         
-        GLuint bufferObjects[4];
+        GLT_WELD_MODE weldMode;     // Duplicate vertex search
+        GLuint *pHashBuckets;       // Head of each hash grid bucket (vertex index + 1, 0 is empty)
+        GLuint *pHashNext;          // Next vertex in the same bucket, per vertex
+        GLuint nHashMask;           // Number of buckets - 1 (a power of two)
+
+        bool bRetainGeometry;               // Keep a copy after End()
+        M3DVector3f *pRetainedVerts;        // Copies of the mesh as uploaded, exact size
+        M3DVector3f *pRetainedNorms;
+        M3DVector2f *pRetainedTexCoords;
+        GLubyte *pRetainedIndexes;
+
+        GLT_VERTEX_LAYOUT vertexLayout; // Separate or interleaved buffers
+        bool bPackedVertices;           // End() really did use the packed layout
+        M3DMatrix44f positionMatrix;    // Unpacks positions, identity if not packed
+        GLuint bufferObjects[4];        // Unused entries are 0
+
+        GLBufferPool *pBufferPool;      // Where the next End() puts the mesh, NULL for own buffers
+        GLBufferPool *pBlockPool;       // Where the mesh is now, NULL if in bufferObjects
+        GLT_POOL_BLOCK poolBlock;
 		GLuint vertexArrayBufferObject;
     };
 
@@ -0,0 +1,167 @@
+/*
+GLVertexFormat.h
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef __GL_VERTEX_FORMAT__
+#define __GL_VERTEX_FORMAT__
+
+// Bring in OpenGL 
+// Windows
+#ifdef WIN32
+#include <windows.h>		// Must have for Windows platform builds
+#ifndef GLEW_STATIC
+#define GLEW_STATIC
+#endif
+
+#include <gl\glew.h>			// OpenGL Extension "autoloader"
+#include <gl\gl.h>			// Microsoft OpenGL headers (version 1.1 by themselves)
+#endif
+
+// Mac OS X
+#ifdef __APPLE__
+#include <TargetConditionals.h>
+#if TARGET_OS_IPHONE | TARGET_IPHONE_SIMULATOR
+#include <OpenGLES/ES2/gl.h>
+#include <OpenGLES/ES2/glext.h>
+#define OPENGL_ES
+#else
+#include <GL/glew.h>
+#include <OpenGL/gl.h>		// Apple OpenGL haders (version depends on OS X SDK version)
+#endif
+#endif
+
+// Linux
+#ifdef linux
+#define GLEW_STATIC
+#include <glew.h>
+#endif
+
+#include <stddef.h>
+
+// Most attributes one format can describe, the smallest GL_MAX_VERTEX_ATTRIBS
+// an implementation is allowed to have
+#define GLT_MAX_FORMAT_ATTRIBUTES	16
+
+// One attribute inside an interleaved vertex
+struct GLT_VERTEX_ATTRIBUTE
+	{
+	GLuint		uiIndex;		// Attribute location (GLT_ATTRIBUTE_VERTEX etc.)
+	GLint		nComponents;	// 1 to 4
+	GLenum		type;			// GL_FLOAT, GL_UNSIGNED_BYTE, GL_HALF_FLOAT...
+	GLboolean	bNormalized;	// Integers map to [0, 1] or [-1, 1]
+	GLuint		nOffset;		// Bytes from the start of the vertex
+	};
+
+////////////////////////////////////////////////////////////////////
+// The layout of one interleaved vertex: which attributes, where they are
+// and what they are stored as. A batch sets up its vertex array object
+// from this instead of assuming three floats here and four floats there,
+// so a color can be four normalized bytes and a texture coordinate two
+// half floats, with as many texture coordinate sets (or anything else)
+// as the shaders want.
+//
+// Attributes can be added one after another, each starting on the next
+// 4 byte boundary, or at explicit offsets to match a struct. For a struct
+// the compiler already knows everything, see GLT_VERTEX_MEMBER below.
+class GLVertexFormat
+	{
+	public:
+		GLVertexFormat(void);
+
+		// Append an attribute after the last one. False if the format is full
+		// or nComponents is out of range.
+		bool AddAttribute(GLuint uiIndex, GLint nComponents, GLenum type, GLboolean bNormalized = GL_FALSE);
+
+		// Or put it at a given offset
+		bool AddAttribute(GLuint uiIndex, GLint nComponents, GLenum type, GLboolean bNormalized, GLuint nOffset);
+
+		// Bytes from one vertex to the next. Unless set, the end of the last
+		// attribute rounded up to 4 bytes.
+		inline void SetStride(GLsizei nBytes) { nStride = nBytes; }
+		GLsizei GetStride(void) const;
+
+		inline GLuint GetAttributeCount(void) const { return nAttributes; }
+		inline const GLT_VERTEX_ATTRIBUTE &GetAttribute(GLuint i) const { return attributes[i]; }
+
+		// Enable and point every attribute at the buffer bound to
+		// GL_ARRAY_BUFFER, vertex 0 starting nBaseOffset bytes in
+		void Setup(GLintptr nBaseOffset = 0) const;
+
+		// Disable them again (for when there's no vertex array object)
+		void Disable(void) const;
+
+		// Size of one component of a type, 0 for the packed types
+		static GLuint TypeSize(GLenum type);
+
+	protected:
+		GLT_VERTEX_ATTRIBUTE	attributes[GLT_MAX_FORMAT_ATTRIBUTES];
+		GLuint		nAttributes;
+		GLuint		nEnd;			// Where the next appended attribute goes
+		GLsizei		nStride;		// 0 until set
+	};
+
+
+////////////////////////////////////////////////////////////////////
+// The OpenGL type and component count of a C++ type, worked out by the
+// compiler. Arrays count their elements, so M3DVector3f is three GL_FLOATs.
+template <class T> struct GLTypeTraits;
+
+#define GLT_TYPE_TRAITS(T, glType)	\
+	template <> struct GLTypeTraits<T> { static const GLenum type = glType; static const GLint nComponents = 1; }
+
+GLT_TYPE_TRAITS(GLfloat, GL_FLOAT);
+GLT_TYPE_TRAITS(GLbyte, GL_BYTE);
+GLT_TYPE_TRAITS(GLubyte, GL_UNSIGNED_BYTE);
+GLT_TYPE_TRAITS(GLshort, GL_SHORT);
+GLT_TYPE_TRAITS(GLushort, GL_UNSIGNED_SHORT);
+GLT_TYPE_TRAITS(GLint, GL_INT);
+GLT_TYPE_TRAITS(GLuint, GL_UNSIGNED_INT);
+
+template <class T, int N> struct GLTypeTraits<T[N]>
+	{
+	static const GLenum type = GLTypeTraits<T>::type;
+	static const GLint nComponents = N * GLTypeTraits<T>::nComponents;
+	};
+
+// Add a member of a vertex struct to a format, with the type, size and
+// offset taken from the struct itself:
+//
+//	struct MyVertex { M3DVector3f vPos; GLubyte color[4]; };
+//	GLT_VERTEX_MEMBER(format, MyVertex, vPos, GLT_ATTRIBUTE_VERTEX, GL_FALSE);
+//	GLT_VERTEX_MEMBER(format, MyVertex, color, GLT_ATTRIBUTE_COLOR, GL_TRUE);
+//	format.SetStride(sizeof(MyVertex));
+//
+// Half floats are GLushorts to the compiler, add those with AddAttribute().
+#define GLT_VERTEX_MEMBER(format, VERTEX, member, uiIndex, bNormalized)								\
+	(format).AddAttribute((uiIndex), GLTypeTraits<decltype(((VERTEX *)0)->member)>::nComponents,		\
+						  GLTypeTraits<decltype(((VERTEX *)0)->member)>::type, (bNormalized),		\
+						  (GLuint)offsetof(VERTEX, member))
+
+#endif
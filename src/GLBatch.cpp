@@ -35,6 +35,7 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 
 #include <GLBatch.h>
 #include <GLShaderManager.h>
+#include <GLTools.h>
 
 
 //////////////////////// TEMPORARY TEMPORARY TEMPORARY - On SnowLeopard this is suppored, but GLEW doens't hook up properly
@@ -45,16 +46,133 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 #define glBindVertexArray	glBindVertexArrayAPPLE
 #endif
 
-/////////////////////// OpenGL ES support on iPhone/iPad
-#ifdef OPENGL_ES
-#define GL_WRITE_ONLY   GL_WRITE_ONLY_OES
-#define glMapBuffer     glMapBufferOES
-#define glUnmapBuffer   glUnmapBufferOES
+// Which arrays have been filled in one vertex at a time since the last End()
+#define STAGED_VERTEX       0x01
+#define STAGED_NORMAL       0x02
+#define STAGED_COLOR        0x04
+#define STAGED_TEXTURE0     0x08    // One bit per texture unit from here up
+
+// Floats per vertex in each array, in the same order as the bits above
+static const GLuint nArrayComponents[GLT_BATCH_ARRAYS] = { 3, 3, 4, 2, 2, 2, 2 };
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Add [nFirst, nEnd) to a list of dirty ranges, merging it with anything it
+// overlaps or touches. If that makes one range too many, the two with the
+// smallest gap between them become one.
+static void AddDirtyRange(GLT_DIRTY_RANGES &dirty, GLuint nFirst, GLuint nEnd)
+	{
+	GLuint nKept = 0;
+	for(GLuint i = 0; i < dirty.nRanges; i++) {
+		if(dirty.nEnd[i] >= nFirst && dirty.nFirst[i] <= nEnd) {
+			if(dirty.nFirst[i] < nFirst)
+				nFirst = dirty.nFirst[i];
+			if(dirty.nEnd[i] > nEnd)
+				nEnd = dirty.nEnd[i];
+			}
+		else {
+			dirty.nFirst[nKept] = dirty.nFirst[i];
+			dirty.nEnd[nKept] = dirty.nEnd[i];
+			nKept++;
+			}
+		}
+
+	// Slot the new one in, keeping them in order
+	GLuint iInsert = nKept;
+	while(iInsert > 0 && dirty.nFirst[iInsert-1] > nFirst) {
+		dirty.nFirst[iInsert] = dirty.nFirst[iInsert-1];
+		dirty.nEnd[iInsert] = dirty.nEnd[iInsert-1];
+		iInsert--;
+		}
+	dirty.nFirst[iInsert] = nFirst;
+	dirty.nEnd[iInsert] = nEnd;
+	dirty.nRanges = nKept + 1;
+
+	if(dirty.nRanges <= GLT_MAX_DIRTY_RANGES)
+		return;
+
+	GLuint iClosest = 0;
+	for(GLuint i = 1; i < dirty.nRanges - 1; i++)
+		if(dirty.nFirst[i+1] - dirty.nEnd[i] < dirty.nFirst[iClosest+1] - dirty.nEnd[iClosest])
+			iClosest = i;
+
+	dirty.nEnd[iClosest] = dirty.nEnd[iClosest+1];
+	for(GLuint i = iClosest + 1; i < dirty.nRanges - 1; i++) {
+		dirty.nFirst[i] = dirty.nFirst[i+1];
+		dirty.nEnd[i] = dirty.nEnd[i+1];
+		}
+	dirty.nRanges--;
+	}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Get a buffer object ready for nBytes of data. It's created the first time
+// and reallocated when too small, which loses what was in it. True when that
+// happened, so the caller knows to send all of its data rather than just
+// what changed. Without direct state access the buffer is left bound to
+// GL_ARRAY_BUFFER for WriteArrayBuffer().
+bool GLBatch::ReserveArrayBuffer(GLuint &uiBuffer, GLsizeiptr &nCapacity, GLsizeiptr nBytes)
+	{
+#ifndef OPENGL_ES
+	if(nDirectState > 0) {
+		if(uiBuffer == 0)
+			glCreateBuffers(1, &uiBuffer);
+
+		if(nBytes <= nCapacity)
+			return false;
+
+		glNamedBufferData(uiBuffer, nBytes, NULL, GL_DYNAMIC_DRAW);
+		nCapacity = nBytes;
+		return true;
+		}
+#endif
+
+	if(uiBuffer == 0)
+		glGenBuffers(1, &uiBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, uiBuffer);
+
+	if(nBytes <= nCapacity)
+		return false;
+
+	glBufferData(GL_ARRAY_BUFFER, nBytes, NULL, GL_DYNAMIC_DRAW);
+	nCapacity = nBytes;
+	return true;
+	}
+
+void GLBatch::WriteArrayBuffer(GLuint uiBuffer, GLintptr nOffset, GLsizeiptr nBytes, const GLvoid *pData)
+	{
+#ifndef OPENGL_ES
+	if(nDirectState > 0) {
+		glNamedBufferSubData(uiBuffer, nOffset, nBytes, pData);
+		return;
+		}
 #endif
 
-GLBatch::GLBatch(void): nNumTextureUnits(0), nNumVerts(0), pVerts(NULL), pNormals(NULL), pColors(NULL), pTexCoords(NULL), uiVertexArray(0),
-	uiNormalArray(0), uiColorArray(0), vertexArrayObject(0), bBatchDone(false), nVertsBuilding(0), uiTextureCoordArray(NULL)
+	glBufferSubData(GL_ARRAY_BUFFER, nOffset, nBytes, pData);
+	}
+
+GLBatch::GLBatch(void): uiVertexArray(0), uiNormalArray(0), uiColorArray(0), uiIndexArray(0), vertexArrayObject(0),
+	nIndexBytes(0), uiEnabledAttributes(0), nDirectState(-1), nVertsBuilding(0), nNumVerts(0), nNumTextureUnits(0), nNumIndexes(0),
+	indexType(GL_UNSIGNED_SHORT), pShortIndexes(NULL), nMaxShortIndexes(0), bBatchDone(false),
+	pVerts(NULL), pNormals(NULL), pColors(NULL), pStaging(NULL), nMaxStaging(0), bFormatted(false),
+	uiStagedArrays(0), uiUsedArrays(0), bDirtyRanges(false),
+	bStreaming(false), nStreamSlots(3), uiStreamBuffer(0), pStreamMap(NULL), nStreamBytes(0),
+	nStreamSlot(0), pStreamDirty(NULL), bStreamDirty(false)
 	{
+	for(unsigned int i = 0; i < GLT_BATCH_ARRAYS; i++) {
+		dirtyRanges[i].nRanges = 0;
+		nArrayBytes[i] = 0;
+		}
+
+	for(unsigned int i = 0; i < GLT_BATCH_TEXTURE_UNITS; i++) {
+		uiTextureCoordArray[i] = 0;
+		pTexCoords[i] = NULL;
+		}
+
+    #ifndef OPENGL_ES
+	for(unsigned int i = 0; i < GLT_MAX_STREAM_SLOTS; i++)
+		streamFences[i] = 0;
+    #endif
 	}
 
 GLBatch::~GLBatch(void)
@@ -68,178 +186,643 @@ GLBatch::~GLBatch(void)
 	
 	if(uiColorArray != 0)
 		glDeleteBuffers(1, &uiColorArray);
+
+	if(uiIndexArray != 0)
+		glDeleteBuffers(1, &uiIndexArray);
 	
-	for(unsigned int i = 0; i < nNumTextureUnits; i++)
-		glDeleteBuffers(1, &uiTextureCoordArray[i]);
+	for(unsigned int i = 0; i < GLT_BATCH_TEXTURE_UNITS; i++)
+		if(uiTextureCoordArray[i] != 0)
+			glDeleteBuffers(1, &uiTextureCoordArray[i]);
+
+	DeleteStreamRing();
 
     #ifndef OPENGL_ES
 	glDeleteVertexArrays(1, &vertexArrayObject);
     #endif
         
-	delete [] uiTextureCoordArray;
-	delete [] pTexCoords;
+	delete [] pStaging;
+	delete [] pShortIndexes;
 	}
 
 
-// Start the primitive batch.
-void GLBatch::Begin(GLenum primitive, GLuint nVerts, GLuint nTextureUnits)
+////////////////////////////////////////////////////////////////////////////
+// What both kinds of batch need: the index setup, a staging block of
+// nVertexBytes per vertex, and the stream ring and vertex array object.
+// A batch that is begun again keeps all of these from last time, and only
+// the client memory that is now too small is reallocated. Buffer objects
+// grow when something is copied into them that doesn't fit.
+void GLBatch::StartBatch(GLenum primitive, GLuint nVerts, GLuint nIndexes, GLuint nVertexBytes)
 	{
 	primitiveType = primitive;
 	nNumVerts = nVerts;
-    
-    if(nTextureUnits > 4)   // Limit to four texture units
-        nTextureUnits = 4;
-        
-	nNumTextureUnits = nTextureUnits;
-	
-	if(nNumTextureUnits != 0) {
-		uiTextureCoordArray = new GLuint[nNumTextureUnits];
-
-		// An array of pointers to texture coordinate arrays
-		pTexCoords = new M3DVector2f*[nNumTextureUnits];
-		for(unsigned int i = 0; i < nNumTextureUnits; i++) {
-			uiTextureCoordArray[i] = 0;
-			pTexCoords[i] = NULL;
-			}
+	nVertsBuilding = 0;
+	bBatchDone = false;
+
+	// Asked once, buffers are created differently with and without it
+	if(nDirectState < 0)
+		nDirectState = gltIsDirectStateAccessSupported();
+
+	// Indexes are 16 bit whenever every vertex can be reached with them
+	nNumIndexes = nIndexes;
+	indexType = (nNumVerts <= 65536) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	if(nNumIndexes != 0 && indexType == GL_UNSIGNED_SHORT && nNumIndexes > nMaxShortIndexes) {
+		delete [] pShortIndexes;
+		pShortIndexes = new GLushort[nNumIndexes];
+		nMaxShortIndexes = nNumIndexes;
+		}
+
+	// The vertices are collected in one block of client memory, carved up
+	// into an array per attribute (or one interleaved array). End() uploads
+	// what was used.
+	GLuint nStagingFloats = (nNumVerts * nVertexBytes + sizeof(GLfloat) - 1) / sizeof(GLfloat);
+	if(nStagingFloats > nMaxStaging) {
+		delete [] pStaging;
+		pStaging = new GLfloat[nStagingFloats];
+		nMaxStaging = nStagingFloats;
+		}
+	uiStagedArrays = 0;
+	uiUsedArrays = 0;
+
+	for(unsigned int i = 0; i < GLT_BATCH_ARRAYS; i++)
+		dirtyRanges[i].nRanges = 0;
+	bDirtyRanges = false;
+
+	// A streaming batch copies the staging block into a ring at draw time.
+	// Last time's ring does if it's big enough.
+	GLsizeiptr nRingBytes = (GLsizeiptr)nNumVerts * nVertexBytes * nStreamSlots;
+	if(!bStreaming || nRingBytes > nStreamBytes)
+		DeleteStreamRing();
+	if(bStreaming) {
+		if(uiStreamBuffer == 0)
+			CreateStreamRing();
+		else
+			ResetStreamRing();
 		}
 		
 	// Vertex Array object for this Array
     #ifndef OPENGL_ES
-	glGenVertexArrays(1, &vertexArrayObject);
+	if(vertexArrayObject == 0)
+		glGenVertexArrays(1, &vertexArrayObject);
 	glBindVertexArray(vertexArrayObject);
 	#endif
+	}
+
+
+// Start the primitive batch.
+void GLBatch::Begin(GLenum primitive, GLuint nVerts, GLuint nTextureUnits, GLuint nIndexes)
+	{
+    if(nTextureUnits > GLT_BATCH_TEXTURE_UNITS)   // Limit to four texture units
+        nTextureUnits = GLT_BATCH_TEXTURE_UNITS;
+        
+	nNumTextureUnits = nTextureUnits;
+	bFormatted = false;
+
+	StartBatch(primitive, nVerts, nIndexes, sizeof(GLfloat) * (3 + 3 + 4 + 2 * nNumTextureUnits));
+
+	GLfloat *pNext = pStaging;
+	pVerts = (M3DVector3f *)pNext;
+	pNext += 3 * nNumVerts;
+	pNormals = (M3DVector3f *)pNext;
+	pNext += 3 * nNumVerts;
+	pColors = (M3DVector4f *)pNext;
+	pNext += 4 * nNumVerts;
+	for(unsigned int i = 0; i < nNumTextureUnits; i++) {
+		pTexCoords[i] = (M3DVector2f *)pNext;
+		pNext += 2 * nNumVerts;
+		}
     }
+
+
+// Start a batch of interleaved vertices in a format of the caller's choosing.
+// The staging block is just the one array.
+void GLBatch::Begin(GLenum primitive, GLuint nVerts, const GLVertexFormat &format, GLuint nIndexes)
+	{
+	vertexFormat = format;
+	bFormatted = true;
+	nNumTextureUnits = 0;
+
+	StartBatch(primitive, nVerts, nIndexes, format.GetStride());
+
+	pVerts = NULL;
+	pNormals = NULL;
+	pColors = NULL;
+	}
 	
 	
 // Block Copy in vertex data
 void GLBatch::CopyVertexData3f(M3DVector3f *vVerts) 
 	{
-	// First time, create the buffer object, allocate the space
-	if(uiVertexArray == 0) {
-        glGenBuffers(1, &uiVertexArray);
-        glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nNumVerts, vVerts, GL_DYNAMIC_DRAW);
-        }
-    else	{ // Just bind to existing object
-        glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
-
-        // Copy the data in
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 3 * nNumVerts, vVerts);
-        pVerts = NULL;
-        }
+	if(!bFormatted)
+		CopyArray(0, vVerts);
     }
         
 // Block copy in normal data
 void GLBatch::CopyNormalDataf(M3DVector3f *vNorms) 
 	{
-	// First time, create the buffer object, allocate the space
-	if(uiNormalArray == 0) {
-		glGenBuffers(1, &uiNormalArray);
-		glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nNumVerts, vNorms, GL_DYNAMIC_DRAW);
-	    }
-	else {	// Just bind to existing object
-		glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
-	
-        // Copy the data in
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 3 * nNumVerts, vNorms);
-        pNormals = NULL;
-        }
+	if(!bFormatted)
+		CopyArray(1, vNorms);
 	}
 
 void GLBatch::CopyColorData4f(M3DVector4f *vColors) 
 	{
-	// First time, create the buffer object, allocate the space
-	if(uiColorArray == 0) {
-		glGenBuffers(1, &uiColorArray);
-		glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 4 * nNumVerts, vColors, GL_DYNAMIC_DRAW);
-	}
-	else {	// Just bind to existing object
-		glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
-	
-        // Copy the data in
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 4 * nNumVerts, vColors);
-        pColors = NULL;
-        }
+	if(!bFormatted)
+		CopyArray(2, vColors);
     }
 
 void GLBatch::CopyTexCoordData2f(M3DVector2f *vTexCoords, GLuint uiTextureLayer) 
 	{
-	// First time, create the buffer object, allocate the space
-	if(uiTextureCoordArray[uiTextureLayer] == 0) {
-		glGenBuffers(1, &uiTextureCoordArray[uiTextureLayer]);
-		glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[uiTextureLayer]);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 2 * nNumVerts, vTexCoords, GL_DYNAMIC_DRAW);
-	    }
-	else {	// Just bind to existing object
-		glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[uiTextureLayer]);
-	
-        // Copy the data in
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 2 * nNumVerts, vTexCoords);
-        pTexCoords[uiTextureLayer] = NULL;
-        }
+	if(!bFormatted)
+		CopyArray(3 + uiTextureLayer, vTexCoords);
+    }
+
+// Block copy in vertices of the batch's own format
+void GLBatch::CopyVertexData(const GLvoid *pVertices)
+	{
+	if(bFormatted)
+		CopyArray(0, pVertices);
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Replace a whole array
+void GLBatch::CopyArray(GLuint iArray, const GLvoid *pSource)
+	{
+	if(iArray >= ArrayCount())
+		return;
+
+	// The staging block always holds the latest data, ranged copies
+	// may upload parts of it later
+	GLsizeiptr nBytes = ArrayStride(iArray) * nNumVerts;
+	memcpy(StagedArray(iArray), pSource, nBytes);
+	uiUsedArrays |= 1 << iArray;
+
+	// Streaming batches send everything at draw time
+	if(uiStreamBuffer != 0) {
+		uiStagedArrays |= 1 << iArray;
+		return;
+		}
+
+	// Copy the data in, making room first if it doesn't fit
+	GLuint *pBuffer = ArrayBuffer(iArray);
+	ReserveArrayBuffer(*pBuffer, nArrayBytes[iArray], nBytes);
+	WriteArrayBuffer(*pBuffer, 0, nBytes, pSource);
+
+    // Don't let End() overwrite this with anything added one vertex at a time
+    uiStagedArrays &= ~(1 << iArray);
+    dirtyRanges[iArray].nRanges = 0;
     }
 	
-// Bind everything up in a little package
-void GLBatch::End(void)
+////////////////////////////////////////////////////////////////////////////
+// Block copy in index data. This goes through GL_ARRAY_BUFFER so it doesn't
+// disturb the element array of whatever vertex array object is bound. End()
+// attaches it to the batch's own.
+void GLBatch::CopyIndexData(GLuint *pIndexes)
+	{
+	if(nNumIndexes == 0)
+		return;
+
+	const GLvoid *pData = pIndexes;
+	GLsizeiptr nBytes = sizeof(GLuint) * nNumIndexes;
+	if(indexType == GL_UNSIGNED_SHORT) {
+		for(GLuint i = 0; i < nNumIndexes; i++)
+			pShortIndexes[i] = (GLushort)pIndexes[i];
+		pData = pShortIndexes;
+		nBytes = sizeof(GLushort) * nNumIndexes;
+		}
+
+	ReserveArrayBuffer(uiIndexArray, nIndexBytes, nBytes);
+	WriteArrayBuffer(uiIndexArray, 0, nBytes, pData);
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Ranged copies. These go through the staging block and are sent in Draw().
+void GLBatch::CopyVertexData3f(M3DVector3f *vVerts, GLuint nFirst, GLuint nCount)
+	{
+	if(!bFormatted)
+		CopyRange(0, vVerts, nFirst, nCount);
+	}
+
+void GLBatch::CopyNormalDataf(M3DVector3f *vNorms, GLuint nFirst, GLuint nCount)
+	{
+	if(!bFormatted)
+		CopyRange(1, vNorms, nFirst, nCount);
+	}
+
+void GLBatch::CopyColorData4f(M3DVector4f *vColors, GLuint nFirst, GLuint nCount)
+	{
+	if(!bFormatted)
+		CopyRange(2, vColors, nFirst, nCount);
+	}
+
+void GLBatch::CopyTexCoordData2f(M3DVector2f *vTexCoords, GLuint uiTextureLayer, GLuint nFirst, GLuint nCount)
+	{
+	if(!bFormatted)
+		CopyRange(3 + uiTextureLayer, vTexCoords, nFirst, nCount);
+	}
+
+void GLBatch::CopyVertexData(const GLvoid *pVertices, GLuint nFirst, GLuint nCount)
+	{
+	if(bFormatted)
+		CopyRange(0, pVertices, nFirst, nCount);
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Write part of an array into the staging block and remember which part
+void GLBatch::CopyRange(GLuint iArray, const GLvoid *pSource, GLuint nFirst, GLuint nCount)
+	{
+	// Clip to the batch
+	if(iArray >= ArrayCount() || nFirst >= nNumVerts)
+		return;
+	if(nCount > nNumVerts - nFirst)
+		nCount = nNumVerts - nFirst;
+	if(nCount == 0)
+		return;
+
+	GLsizei nStride = ArrayStride(iArray);
+	memcpy(StagedArray(iArray) + nFirst * nStride, pSource, nStride * nCount);
+
+	uiUsedArrays |= 1 << iArray;
+
+	// A streaming batch has to get the edit into every copy in the ring
+	if(uiStreamBuffer != 0) {
+		for(unsigned int iSlot = 0; iSlot < nStreamSlots; iSlot++)
+			AddDirtyRange(pStreamDirty[iSlot * GLT_BATCH_ARRAYS + iArray], nFirst, nFirst + nCount);
+		bStreamDirty = true;
+		return;
+		}
+
+	AddDirtyRange(dirtyRanges[iArray], nFirst, nFirst + nCount);
+	bDirtyRanges = true;
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// The buffer object and staging array for an array number (STAGED_ bit order)
+GLuint *GLBatch::ArrayBuffer(GLuint iArray)
+	{
+	switch(iArray) {
+		case 0:
+			return &uiVertexArray;
+		case 1:
+			return &uiNormalArray;
+		case 2:
+			return &uiColorArray;
+		}
+	return &uiTextureCoordArray[iArray - 3];
+	}
+
+GLubyte *GLBatch::StagedArray(GLuint iArray)
+	{
+	if(bFormatted)
+		return (GLubyte *)pStaging;
+
+	switch(iArray) {
+		case 0:
+			return (GLubyte *)pVerts;
+		case 1:
+			return (GLubyte *)pNormals;
+		case 2:
+			return (GLubyte *)pColors;
+		}
+	return (GLubyte *)pTexCoords[iArray - 3];
+	}
+
+// Bytes per vertex in an array
+GLsizei GLBatch::ArrayStride(GLuint iArray)
+	{
+	if(bFormatted)
+		return vertexFormat.GetStride();
+
+	return sizeof(GLfloat) * nArrayComponents[iArray];
+	}
+
+// Arrays in use, the first ArrayCount() in STAGED_ bit order
+GLuint GLBatch::ArrayCount(void)
+	{
+	return bFormatted ? 1 : 3 + nNumTextureUnits;
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Upload the ranges edited since the last time. An array that doesn't have
+// a buffer object yet (or a big enough one) gets the whole staging array.
+void GLBatch::FlushDirtyRanges(void)
+	{
+	for(GLuint iArray = 0; iArray < ArrayCount(); iArray++) {
+		GLT_DIRTY_RANGES &dirty = dirtyRanges[iArray];
+		if(dirty.nRanges == 0)
+			continue;
+
+		GLsizei nStride = ArrayStride(iArray);
+		GLubyte *pArray = StagedArray(iArray);
+		GLuint *pBuffer = ArrayBuffer(iArray);
+		if(ReserveArrayBuffer(*pBuffer, nArrayBytes[iArray], nStride * nNumVerts))
+			WriteArrayBuffer(*pBuffer, 0, nStride * nNumVerts, pArray);
+		else {
+			for(GLuint r = 0; r < dirty.nRanges; r++)
+				WriteArrayBuffer(*pBuffer, nStride * dirty.nFirst[r],
+								 nStride * (dirty.nEnd[r] - dirty.nFirst[r]),
+								 pArray + nStride * dirty.nFirst[r]);
+			}
+
+		dirty.nRanges = 0;
+		}
+
+	bDirtyRanges = false;
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Send one staged array to its buffer object, creating it the first time
+void GLBatch::UploadStagedArray(GLuint iArray)
+	{
+	GLsizei nStride = ArrayStride(iArray);
+	GLuint *pBuffer = ArrayBuffer(iArray);
+	if(ReserveArrayBuffer(*pBuffer, nArrayBytes[iArray], nStride * nNumVerts))
+		WriteArrayBuffer(*pBuffer, 0, nStride * nNumVerts, StagedArray(iArray));
+	else	// Only the vertices that were actually added
+		WriteArrayBuffer(*pBuffer, 0, nStride * nVertsBuilding, StagedArray(iArray));
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Use a ring of persistently mapped copies for the vertex data
+void GLBatch::SetStreaming(bool bStream, GLuint nSlots)
+	{
+	if(nSlots < 2)
+		nSlots = 2;
+	if(nSlots > GLT_MAX_STREAM_SLOTS)
+		nSlots = GLT_MAX_STREAM_SLOTS;
+
+	// The ring is laid out for a number of copies, a different number
+	// needs a new one
+	if(nSlots != nStreamSlots)
+		DeleteStreamRing();
+
+	bStreaming = bStream;
+	nStreamSlots = nSlots;
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// The ring is laid out like the staging block, one array after another,
+// except each array holds nStreamSlots copies back to back. That way the
+// attribute pointers never change and Draw() picks a copy with the first
+// vertex it asks for.
+void GLBatch::CreateStreamRing(void)
 	{
 #ifndef OPENGL_ES
-	// Check to see if items have been added one at a time
-	if(pVerts != NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
-		glUnmapBuffer(GL_ARRAY_BUFFER);
-		pVerts = NULL;
+	GLint nMajor = 0, nMinor = 0;
+	gltGetOpenGLVersion(nMajor, nMinor);
+	if((nMajor < 4 || (nMajor == 4 && nMinor < 4)) && !gltIsExtSupported("GL_ARB_buffer_storage"))
+		return;
+
+	GLsizeiptr nBytes = 0;
+	for(GLuint i = 0; i < ArrayCount(); i++)
+		nBytes += ArrayStride(i) * nNumVerts * nStreamSlots;
+	if(nBytes == 0)
+		return;
+
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &uiStreamBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, uiStreamBuffer);
+	glBufferStorage(GL_ARRAY_BUFFER, nBytes, NULL, flags);
+	pStreamMap = (GLubyte *)glMapBufferRange(GL_ARRAY_BUFFER, 0, nBytes, flags);
+	if(pStreamMap == NULL) {
+		glDeleteBuffers(1, &uiStreamBuffer);
+		uiStreamBuffer = 0;
+		return;
 		}
-		
-	if(pColors != NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
+	nStreamBytes = nBytes;
+
+	pStreamDirty = new GLT_DIRTY_RANGES[nStreamSlots * GLT_BATCH_ARRAYS];
+	ResetStreamRing();
+#endif
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Start a ring over for a new batch. The fences stay, the GPU may still
+// be reading copies drawn before Begin().
+void GLBatch::ResetStreamRing(void)
+	{
+	// The first update goes to copy 0
+	nStreamSlot = nStreamSlots - 1;
+
+	for(unsigned int i = 0; i < nStreamSlots * GLT_BATCH_ARRAYS; i++)
+		pStreamDirty[i].nRanges = 0;
+	bStreamDirty = false;
+	}
+
+
+void GLBatch::DeleteStreamRing(void)
+	{
+#ifndef OPENGL_ES
+	for(unsigned int i = 0; i < GLT_MAX_STREAM_SLOTS; i++)
+		if(streamFences[i] != 0) {
+			glDeleteSync(streamFences[i]);
+			streamFences[i] = 0;
+			}
+
+	if(uiStreamBuffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, uiStreamBuffer);
 		glUnmapBuffer(GL_ARRAY_BUFFER);
-		pColors = NULL; 
+		glDeleteBuffers(1, &uiStreamBuffer);
 		}
-		
-	if(pNormals != NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
-		glUnmapBuffer(GL_ARRAY_BUFFER);
-		pNormals = NULL;
+#endif
+	uiStreamBuffer = 0;
+	nStreamBytes = 0;
+	pStreamMap = NULL;
+
+	delete [] pStreamDirty;
+	pStreamDirty = NULL;
+	bStreamDirty = false;
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Point an attribute at its array in the ring. pData is the same array in
+// the staging block, which says where it is.
+void GLBatch::StreamAttribute(GLuint uiAttribute, const GLfloat *pData, GLuint nComponents)
+	{
+	GLsizeiptr nOffset = sizeof(GLfloat) * (pData - pStaging) * nStreamSlots;
+	glEnableVertexAttribArray(uiAttribute);
+	glVertexAttribPointer(uiAttribute, nComponents, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)nOffset);
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Move on to the next copy in the ring and fill it from the staging block.
+// The copy was last drawn nStreamSlots - 1 updates ago, so its fence has
+// normally long since passed and this doesn't wait at all.
+void GLBatch::StreamToNextSlot(void)
+	{
+#ifndef OPENGL_ES
+	nStreamSlot = (nStreamSlot + 1) % nStreamSlots;
+
+	if(streamFences[nStreamSlot] != 0) {
+		while(glClientWaitSync(streamFences[nStreamSlot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(streamFences[nStreamSlot]);
+		streamFences[nStreamSlot] = 0;
 		}
-		
-	for(unsigned int i = 0; i < nNumTextureUnits; i++)
-		if(pTexCoords[i] != NULL) {
-			glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[i]);
-			glUnmapBuffer(GL_ARRAY_BUFFER);
-			pTexCoords[i] = NULL;
+
+	// Arrays filled in one vertex at a time (or all at once) are out of
+	// date in every copy
+	for(unsigned int i = 0; i < ArrayCount(); i++)
+		if(uiStagedArrays & (1 << i))
+			for(unsigned int iSlot = 0; iSlot < nStreamSlots; iSlot++)
+				AddDirtyRange(pStreamDirty[iSlot * GLT_BATCH_ARRAYS + i], 0, nNumVerts);
+
+	uiUsedArrays |= uiStagedArrays;
+	uiStagedArrays = 0;
+	bStreamDirty = false;
+
+	// Bring this copy up to date. It's missing whatever changed since it
+	// was last used, a few updates back.
+	for(unsigned int i = 0; i < ArrayCount(); i++) {
+		GLT_DIRTY_RANGES &dirty = pStreamDirty[nStreamSlot * GLT_BATCH_ARRAYS + i];
+		GLsizei nStride = ArrayStride(i);
+		GLubyte *pArray = StagedArray(i);
+		GLubyte *pCopy = pStreamMap + (pArray - (GLubyte *)pStaging) * nStreamSlots + nStride * nNumVerts * nStreamSlot;
+
+		for(GLuint r = 0; r < dirty.nRanges; r++)
+			memcpy(pCopy + nStride * dirty.nFirst[r], pArray + nStride * dirty.nFirst[r],
+				   nStride * (dirty.nEnd[r] - dirty.nFirst[r]));
+		dirty.nRanges = 0;
+		}
+#endif
+	}
+
+
+////////////////////////////////////////////////////////////////////////////
+// The vertex array object is kept from one Begin() to the next, so it can
+// have attributes switched on that this batch no longer feeds. Switch those
+// off, and remember what this batch does feed for next time.
+void GLBatch::DisableUnusedAttributes(void)
+	{
+	GLuint uiAttributes = 0;
+	if(bFormatted) {
+		if(uiUsedArrays & STAGED_VERTEX)
+			for(GLuint i = 0; i < vertexFormat.GetAttributeCount(); i++)
+				uiAttributes |= 1 << vertexFormat.GetAttribute(i).uiIndex;
+		}
+	else {
+		if(uiUsedArrays & STAGED_VERTEX)
+			uiAttributes |= 1 << GLT_ATTRIBUTE_VERTEX;
+		if(uiUsedArrays & STAGED_NORMAL)
+			uiAttributes |= 1 << GLT_ATTRIBUTE_NORMAL;
+		if(uiUsedArrays & STAGED_COLOR)
+			uiAttributes |= 1 << GLT_ATTRIBUTE_COLOR;
+		for(unsigned int i = 0; i < nNumTextureUnits; i++)
+			if(uiUsedArrays & (STAGED_TEXTURE0 << i))
+				uiAttributes |= 1 << (GLT_ATTRIBUTE_TEXTURE0 + i);
+		}
+
+	GLuint uiStale = uiEnabledAttributes & ~uiAttributes;
+	for(GLuint i = 0; uiStale != 0; i++, uiStale >>= 1)
+		if(uiStale & 1)
+			glDisableVertexAttribArray(i);
+
+	uiEnabledAttributes = uiAttributes;
+	}
+
+	
+// Bind everything up in a little package
+void GLBatch::End(void)
+	{
+#ifndef OPENGL_ES
+	// Streaming batches point straight at the ring. Leave the staged
+	// arrays alone, Draw() copies them in.
+	if(uiStreamBuffer != 0) {
+		uiUsedArrays |= uiStagedArrays;
+
+		glBindVertexArray(vertexArrayObject);
+		DisableUnusedAttributes();
+		glBindBuffer(GL_ARRAY_BUFFER, uiStreamBuffer);
+		if(bFormatted) {
+			if(uiUsedArrays & STAGED_VERTEX)
+				vertexFormat.Setup(0);
 			}
+		else {
+			if(uiUsedArrays & STAGED_VERTEX)
+				StreamAttribute(GLT_ATTRIBUTE_VERTEX, pVerts[0], 3);
+			if(uiUsedArrays & STAGED_COLOR)
+				StreamAttribute(GLT_ATTRIBUTE_COLOR, pColors[0], 4);
+			if(uiUsedArrays & STAGED_NORMAL)
+				StreamAttribute(GLT_ATTRIBUTE_NORMAL, pNormals[0], 3);
+			for(unsigned int i = 0; i < nNumTextureUnits; i++)
+				if(uiUsedArrays & (STAGED_TEXTURE0 << i))
+					StreamAttribute(GLT_ATTRIBUTE_TEXTURE0 + i, pTexCoords[i][0], 2);
+			}
+
+		if(nNumIndexes != 0)
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, uiIndexArray);
+
+		bBatchDone = true;
+		glBindVertexArray(0);
+		return;
+		}
+#endif
 
+	// Check to see if items have been added one at a time. They are all
+	// sitting in the staging block, one upload per array takes care of it.
+	for(unsigned int i = 0; i < ArrayCount(); i++)
+		if(uiStagedArrays & (1 << i))
+			UploadStagedArray(i);
+
+	uiUsedArrays |= uiStagedArrays;
+	uiStagedArrays = 0;
+
+	if(bDirtyRanges)
+		FlushDirtyRanges();
+
+#ifndef OPENGL_ES
 	// Set up the vertex array object
 	glBindVertexArray(vertexArrayObject);
+	DisableUnusedAttributes();
 #endif
-	
-	if(uiVertexArray !=0) {
-		glEnableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
-		glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
-		glVertexAttribPointer(GLT_ATTRIBUTE_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		}
-		
-	if(uiColorArray != 0) {
-		glEnableVertexAttribArray(GLT_ATTRIBUTE_COLOR);
-		glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
-		glVertexAttribPointer(GLT_ATTRIBUTE_COLOR, 4, GL_FLOAT, GL_FALSE, 0, 0);
-		}
-		
-	if(uiNormalArray != 0) {
-		glEnableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
-		glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
-		glVertexAttribPointer(GLT_ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	// A vertex format knows where its own attributes are
+	if(bFormatted) {
+		if(uiUsedArrays & STAGED_VERTEX) {
+			glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
+			vertexFormat.Setup(0);
+			}
 		}
-		
-	// How many texture units
-	for(unsigned int i = 0; i < nNumTextureUnits; i++)
-		if(uiTextureCoordArray[i] != 0) {
-			glEnableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0 + i),
-			glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[i]);
-			glVertexAttribPointer(GLT_ATTRIBUTE_TEXTURE0 + i, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	else {
+		if(uiUsedArrays & STAGED_VERTEX) {
+			glEnableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
+			glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
+			glVertexAttribPointer(GLT_ATTRIBUTE_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
+			}
+
+		if(uiUsedArrays & STAGED_COLOR) {
+			glEnableVertexAttribArray(GLT_ATTRIBUTE_COLOR);
+			glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
+			glVertexAttribPointer(GLT_ATTRIBUTE_COLOR, 4, GL_FLOAT, GL_FALSE, 0, 0);
+			}
+
+		if(uiUsedArrays & STAGED_NORMAL) {
+			glEnableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
+			glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
+			glVertexAttribPointer(GLT_ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, 0, 0);
 			}
+
+		// How many texture units
+		for(unsigned int i = 0; i < nNumTextureUnits; i++)
+			if(uiUsedArrays & (STAGED_TEXTURE0 << i)) {
+				glEnableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0 + i),
+				glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[i]);
+				glVertexAttribPointer(GLT_ATTRIBUTE_TEXTURE0 + i, 2, GL_FLOAT, GL_FALSE, 0, 0);
+				}
+		}
+
+	// The element array is part of the vertex array object
+	if(nNumIndexes != 0)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, uiIndexArray);
 	
 	bBatchDone = true;
     #ifndef OPENGL_ES
@@ -256,54 +839,32 @@ void GLBatch::Reset(void)
 }
 
 
-// Add a single vertex to the end of the array
+// Add a single vertex to the end of the array. Everything goes into the
+// staging block from Begin(), nothing touches OpenGL until End(). A batch
+// with a vertex format has no float arrays to put it in.
 void GLBatch::Vertex3f(GLfloat x, GLfloat y, GLfloat z)
 	{
-	// First see if the vertex array buffer has been created...
-	if(uiVertexArray == 0) {	// Nope, we need to create it
-		glGenBuffers(1, &uiVertexArray);
-		glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nNumVerts, NULL, GL_DYNAMIC_DRAW);
-		}
-		
-	// Now see if it's already mapped, if not, map it
-	if(pVerts == NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
-		pVerts = (M3DVector3f *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-		}
-		
 	// Ignore if we go past the end, keeps things from blowing up
-	if(nVertsBuilding >= nNumVerts)
+	if(nVertsBuilding >= nNumVerts || bFormatted)
 		return;
 	
 	// Copy it in...
 	pVerts[nVertsBuilding][0] = x;
 	pVerts[nVertsBuilding][1] = y;
 	pVerts[nVertsBuilding][2] = z;
+	uiStagedArrays |= STAGED_VERTEX;
 	nVertsBuilding++;
 	}
         
 void GLBatch::Vertex3fv(M3DVector3f vVertex)
 	{
-	// First see if the vertex array buffer has been created...
-	if(uiVertexArray == 0) {	// Nope, we need to create it
-		glGenBuffers(1, &uiVertexArray);
-		glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nNumVerts, NULL, GL_DYNAMIC_DRAW);
-        }
-	
-	// Now see if it's already mapped, if not, map it
-	if(pVerts == NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
-		pVerts = (M3DVector3f *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-        }
-	
 	// Ignore if we go past the end, keeps things from blowing up
-	if(nVertsBuilding >= nNumVerts)
+	if(nVertsBuilding >= nNumVerts || bFormatted)
 		return;
 	
 	// Copy it in...
 	memcpy(pVerts[nVertsBuilding], vVertex, sizeof(M3DVector3f));
+	uiStagedArrays |= STAGED_VERTEX;
 	nVertsBuilding++;
 	}
         
@@ -311,71 +872,34 @@ void GLBatch::Vertex3fv(M3DVector3f vVertex)
 // or you will get junk...
 void GLBatch::Normal3f(GLfloat x, GLfloat y, GLfloat z)
 	{
-	// First see if the vertex array buffer has been created...
-	if(uiNormalArray == 0) {	// Nope, we need to create it
-		glGenBuffers(1, &uiNormalArray);
-		glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nNumVerts, NULL, GL_DYNAMIC_DRAW);
-        }
-	
-	// Now see if it's already mapped, if not, map it
-	if(pNormals == NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
-		pNormals = (M3DVector3f *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-        }
-	
 	// Ignore if we go past the end, keeps things from blowing up
-	if(nVertsBuilding >= nNumVerts)
+	if(nVertsBuilding >= nNumVerts || bFormatted)
 		return;
 	
 	// Copy it in...
 	pNormals[nVertsBuilding][0] = x;
 	pNormals[nVertsBuilding][1] = y;
 	pNormals[nVertsBuilding][2] = z;
+	uiStagedArrays |= STAGED_NORMAL;
 	}
         
 // Ditto above
 void GLBatch::Normal3fv(M3DVector3f vNormal)
 	{
-	// First see if the vertex array buffer has been created...
-	if(uiNormalArray == 0) {	// Nope, we need to create it
-		glGenBuffers(1, &uiNormalArray);
-		glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * nNumVerts, NULL, GL_DYNAMIC_DRAW);
-		}
-	
-	// Now see if it's already mapped, if not, map it
-	if(pNormals == NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
-		pNormals = (M3DVector3f *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-		}
-	
 	// Ignore if we go past the end, keeps things from blowing up
-	if(nVertsBuilding >= nNumVerts)
+	if(nVertsBuilding >= nNumVerts || bFormatted)
 		return;
 	
 	// Copy it in...
 	memcpy(pNormals[nVertsBuilding], vNormal, sizeof(M3DVector3f));
+	uiStagedArrays |= STAGED_NORMAL;
 	}
 	
 
 void GLBatch::Color4f(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
 	{
-	// First see if the vertex array buffer has been created...
-	if(uiColorArray == 0) {	// Nope, we need to create it
-		glGenBuffers(1, &uiColorArray);
-		glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 4 * nNumVerts, NULL, GL_DYNAMIC_DRAW);
-		}
-	
-	// Now see if it's already mapped, if not, map it
-	if(pColors == NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
-		pColors = (M3DVector4f *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-		}
-	
 	// Ignore if we go past the end, keeps things from blowing up
-	if(nVertsBuilding >= nNumVerts)
+	if(nVertsBuilding >= nNumVerts || bFormatted)
 		return;
 	
 	// Copy it in...
@@ -383,104 +907,106 @@ void GLBatch::Color4f(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
 	pColors[nVertsBuilding][1] = g;
 	pColors[nVertsBuilding][2] = b;
 	pColors[nVertsBuilding][3] = a;
+	uiStagedArrays |= STAGED_COLOR;
 	}
 	
 void GLBatch::Color4fv(M3DVector4f vColor)
 	{
-	// First see if the vertex array buffer has been created...
-	if(uiColorArray == 0) {	// Nope, we need to create it
-		glGenBuffers(1, &uiColorArray);
-		glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 4 * nNumVerts, NULL, GL_DYNAMIC_DRAW);
-        }
-	
-	// Now see if it's already mapped, if not, map it
-	if(pColors == NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
-		pColors = (M3DVector4f *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-        }
-	
 	// Ignore if we go past the end, keeps things from blowing up
-	if(nVertsBuilding >= nNumVerts)
+	if(nVertsBuilding >= nNumVerts || bFormatted)
 		return;
 	
 	// Copy it in...
 	memcpy(pColors[nVertsBuilding], vColor, sizeof(M3DVector4f));
+	uiStagedArrays |= STAGED_COLOR;
 	}
         
 // Unlike normal OpenGL immediate mode, you must specify a texture coord
 // per vertex or you will get junk...
 void GLBatch::MultiTexCoord2f(GLuint texture, GLclampf s, GLclampf t)
 	{
-	// First see if the vertex array buffer has been created...
-	if(uiTextureCoordArray[texture] == 0) {	// Nope, we need to create it
-		glGenBuffers(1, &uiTextureCoordArray[texture]);
-		glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[texture]);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 2 * nNumVerts, NULL, GL_DYNAMIC_DRAW);
-	}
-	
-	// Now see if it's already mapped, if not, map it
-	if(pTexCoords[texture] == NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[texture]);
-		pTexCoords[texture] = (M3DVector2f *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-        }
-	
 	// Ignore if we go past the end, keeps things from blowing up
-	if(nVertsBuilding >= nNumVerts)
+	if(nVertsBuilding >= nNumVerts || bFormatted)
 		return;
 	
 	// Copy it in...
 	pTexCoords[texture][nVertsBuilding][0] = s;
 	pTexCoords[texture][nVertsBuilding][1] = t;
+	uiStagedArrays |= STAGED_TEXTURE0 << texture;
 	}
    
 // Ditto above  
 void GLBatch::MultiTexCoord2fv(GLuint texture, M3DVector2f vTexCoord)
 	{	
-	// First see if the vertex array buffer has been created...
-	if(uiTextureCoordArray[texture] == 0) {	// Nope, we need to create it
-		glGenBuffers(1, &uiTextureCoordArray[texture]);
-		glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[texture]);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 2 * nNumVerts, NULL, GL_DYNAMIC_DRAW);
-        }
-	
-	// Now see if it's already mapped, if not, map it
-	if(pTexCoords[texture] == NULL) {
-		glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[texture]);
-		pTexCoords[texture] = (M3DVector2f *)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-        }
-	
 	// Ignore if we go past the end, keeps things from blowing up
-	if(nVertsBuilding >= nNumVerts)
+	if(nVertsBuilding >= nNumVerts || bFormatted)
 		return;
 	
 	// Copy it in...
-	memcpy(pTexCoords[texture], vTexCoord, sizeof(M3DVector2f));
+	memcpy(pTexCoords[texture][nVertsBuilding], vTexCoord, sizeof(M3DVector2f));
+	uiStagedArrays |= STAGED_TEXTURE0 << texture;
 	}
 
 
 void GLBatch::Draw(void)
+	{
+	DrawBatch(NULL);
+	}
+
+
+// All the instances in one draw call when the context can do it
+void GLBatch::DrawInstanced(GLInstanceArray &instances)
+	{
+	if(instances.IsSupported()) {
+		if(instances.GetInstanceCount() != 0)
+			DrawBatch(&instances);
+		return;
+		}
+
+	GLBatchBase::DrawInstanced(instances);
+	}
+
+
+void GLBatch::DrawBatch(GLInstanceArray *pInstances)
 	{
 	if(!bBatchDone)
 		return;
+
+	// A streaming batch draws from one copy in the ring
+	GLint nFirst = 0;
+	if(uiStreamBuffer != 0) {
+		if(uiStagedArrays != 0 || bStreamDirty)
+			StreamToNextSlot();
+		nFirst = nStreamSlot * nNumVerts;
+		}
+	else if(bDirtyRanges)
+		FlushDirtyRanges();
     
     #ifndef OPENGL_ES
 	// Set up the vertex array object
 	glBindVertexArray(vertexArrayObject);
+	if(pInstances != NULL)
+		pInstances->Bind();
     #else
-    if(uiVertexArray !=0) {
+    if(bFormatted) {
+        if(uiUsedArrays & STAGED_VERTEX) {
+            glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
+            vertexFormat.Setup(0);
+            }
+        }
+    else if(uiUsedArrays & STAGED_VERTEX) {
         glEnableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
         glBindBuffer(GL_ARRAY_BUFFER, uiVertexArray);
         glVertexAttribPointer(GLT_ATTRIBUTE_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
         }
     
-    if(uiColorArray != 0) {
+    if(!bFormatted && (uiUsedArrays & STAGED_COLOR)) {
         glEnableVertexAttribArray(GLT_ATTRIBUTE_COLOR);
         glBindBuffer(GL_ARRAY_BUFFER, uiColorArray);
         glVertexAttribPointer(GLT_ATTRIBUTE_COLOR, 4, GL_FLOAT, GL_FALSE, 0, 0);
         }
     
-    if(uiNormalArray != 0) {
+    if(!bFormatted && (uiUsedArrays & STAGED_NORMAL)) {
         glEnableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
         glBindBuffer(GL_ARRAY_BUFFER, uiNormalArray);
         glVertexAttribPointer(GLT_ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, 0, 0);
@@ -488,26 +1014,61 @@ void GLBatch::Draw(void)
     
     // How many texture units
     for(unsigned int i = 0; i < nNumTextureUnits; i++)
-        if(uiTextureCoordArray[i] != 0) {
+        if(uiUsedArrays & (STAGED_TEXTURE0 << i)) {
             glEnableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0 + i),
             glBindBuffer(GL_ARRAY_BUFFER, uiTextureCoordArray[i]);
             glVertexAttribPointer(GLT_ATTRIBUTE_TEXTURE0 + i, 2, GL_FLOAT, GL_FALSE, 0, 0);
             }
+
+    if(nNumIndexes != 0)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, uiIndexArray);
     #endif
 
 
-	glDrawArrays(primitiveType, 0, nNumVerts);
+	if(nNumIndexes != 0) {
+    #ifndef OPENGL_ES
+		// Indexes count from the start of the batch, the ring copy in use
+		// starts further along
+		if(pInstances != NULL)
+			glDrawElementsInstancedBaseVertex(primitiveType, nNumIndexes, indexType, 0, pInstances->GetInstanceCount(), nFirst);
+		else if(nFirst != 0)
+			glDrawElementsBaseVertex(primitiveType, nNumIndexes, indexType, 0, nFirst);
+		else
+    #endif
+			glDrawElements(primitiveType, nNumIndexes, indexType, 0);
+		}
+	else {
+    #ifndef OPENGL_ES
+		if(pInstances != NULL)
+			glDrawArraysInstanced(primitiveType, nFirst, nNumVerts, pInstances->GetInstanceCount());
+		else
+    #endif
+			glDrawArrays(primitiveType, nFirst, nNumVerts);
+		}
+
+    #ifndef OPENGL_ES
+	// Don't write over this copy until the GPU has finished with it
+	if(uiStreamBuffer != 0) {
+		if(streamFences[nStreamSlot] != 0)
+			glDeleteSync(streamFences[nStreamSlot]);
+		streamFences[nStreamSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+    #endif
 	
     #ifndef OPENGL_ES
+	if(pInstances != NULL)
+		pInstances->Unbind();
 	glBindVertexArray(0);
     #else
+    if(bFormatted)
+        vertexFormat.Disable();
+
     glDisableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
     glDisableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
     glDisableVertexAttribArray(GLT_ATTRIBUTE_COLOR);
 
     for(unsigned int i = 0; i < nNumTextureUnits; i++)
-        if(uiTextureCoordArray[i] != 0)
-            glDisableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0 + i);
+        glDisableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0 + i);
 
     #endif
 	}
@@ -0,0 +1,568 @@
+/*
+GLBufferPool.cpp
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <GLBufferPool.h>
+#include <GLInstanceArray.h>
+#include <GLTools.h>
+#include <string.h>
+
+//////////////////////// TEMPORARY TEMPORARY TEMPORARY - On SnowLeopard this is suppored, but GLEW doens't hook up properly
+//////////////////////// Fixed probably in 10.6.3
+#ifdef __APPLE__
+#define glGenVertexArrays glGenVertexArraysAPPLE
+#define glDeleteVertexArrays  glDeleteVertexArraysAPPLE
+#define glBindVertexArray	glBindVertexArrayAPPLE
+#endif
+
+// Size classes: the first level is the power of two, the second splits
+// each power of two into 2^POOL_SL_BITS steps. Sizes below POOL_SL_COUNT
+// units get a class each.
+#define POOL_SL_BITS	4
+#define POOL_SL_COUNT	(1 << POOL_SL_BITS)
+#define POOL_FL_COUNT	32
+#define POOL_NONE		0xffffffff
+
+// Indexes are allocated in units of 4 bytes, which keeps every mesh's
+// first index aligned for either index type
+#define POOL_INDEX_UNIT	4
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Bit scans for the free list bitmaps. n must not be 0.
+static inline GLuint LowestBit(GLuint n)
+	{
+#if defined(__GNUC__)
+	return (GLuint)__builtin_ctz(n);
+#else
+	GLuint i = 0;
+	while((n & 1) == 0) {
+		n >>= 1;
+		i++;
+		}
+	return i;
+#endif
+	}
+
+static inline GLuint HighestBit(GLuint n)
+	{
+#if defined(__GNUC__)
+	return 31 - (GLuint)__builtin_clz(n);
+#else
+	GLuint i = 0;
+	while(n >>= 1)
+		i++;
+	return i;
+#endif
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TLSF over a range of units. It never touches the memory it manages, it
+// only hands out offsets, so it works the same for buffer objects. Every
+// range, free or used, has a record; records are linked in address order
+// so neighbors can be merged, and free ones also into a list per size class.
+class GLRangeAllocator
+	{
+	public:
+		GLRangeAllocator(void): pRanges(NULL), nRanges(0), nMaxRanges(0), iSpare(POOL_NONE), nUsed(0), nFlBitmap(0)
+			{
+			memset(nSlBitmap, 0, sizeof(nSlBitmap));
+			for(GLuint fl = 0; fl < POOL_FL_COUNT; fl++)
+				for(GLuint sl = 0; sl < POOL_SL_COUNT; sl++)
+					iFree[fl][sl] = POOL_NONE;
+			}
+
+		~GLRangeAllocator(void)
+			{
+			delete [] pRanges;
+			}
+
+		// Start out with one free range covering everything
+		void Init(GLuint nUnits)
+			{
+			GLuint i = NewRange();
+			pRanges[i].nOffset = 0;
+			pRanges[i].nSize = nUnits;
+			pRanges[i].iPrev = pRanges[i].iNext = POOL_NONE;
+			InsertFree(i);
+			}
+
+		// Returns a handle, or POOL_NONE when there's no free range big enough
+		GLuint Alloc(GLuint nUnits)
+			{
+			if(nUnits == 0)
+				nUnits = 1;
+			if(nUnits > 0x7fffffff)
+				return POOL_NONE;
+
+			// Round the request up to the next class boundary, so whatever
+			// heads the list that is found is big enough without searching it
+			GLuint nSearch = nUnits;
+			if(nSearch >= POOL_SL_COUNT)
+				nSearch += (1 << (HighestBit(nSearch) - POOL_SL_BITS)) - 1;
+
+			GLuint i = FindFree(nSearch);
+
+			// Nothing in the bigger classes, but the request's own class can
+			// still hold a range that fits. Worth a look before giving up.
+			if(i == POOL_NONE) {
+				GLuint fl, sl;
+				MapSize(nUnits, fl, sl);
+				for(i = iFree[fl][sl]; i != POOL_NONE; i = pRanges[i].iNextFree)
+					if(pRanges[i].nSize >= nUnits)
+						break;
+				if(i == POOL_NONE)
+					return POOL_NONE;
+				}
+			RemoveFree(i);
+
+			// Put what's left over back as a free range of its own
+			if(pRanges[i].nSize > nUnits) {
+				GLuint iRest = NewRange();
+				pRanges[iRest].nOffset = pRanges[i].nOffset + nUnits;
+				pRanges[iRest].nSize = pRanges[i].nSize - nUnits;
+				pRanges[iRest].iPrev = i;
+				pRanges[iRest].iNext = pRanges[i].iNext;
+				if(pRanges[i].iNext != POOL_NONE)
+					pRanges[pRanges[i].iNext].iPrev = iRest;
+				pRanges[i].iNext = iRest;
+				pRanges[i].nSize = nUnits;
+				InsertFree(iRest);
+				}
+
+			nUsed++;
+			return i;
+			}
+
+		// Give a range back, merging it with free neighbors
+		void Free(GLuint i)
+			{
+			GLuint iNext = pRanges[i].iNext;
+			if(iNext != POOL_NONE && pRanges[iNext].bFree) {
+				RemoveFree(iNext);
+				pRanges[i].nSize += pRanges[iNext].nSize;
+				Unlink(iNext);
+				}
+
+			GLuint iPrev = pRanges[i].iPrev;
+			if(iPrev != POOL_NONE && pRanges[iPrev].bFree) {
+				RemoveFree(iPrev);
+				pRanges[iPrev].nSize += pRanges[i].nSize;
+				Unlink(i);
+				i = iPrev;
+				}
+
+			InsertFree(i);
+			nUsed--;
+			}
+
+		inline GLuint GetOffset(GLuint i) { return pRanges[i].nOffset; }
+		inline bool IsEmpty(void) { return nUsed == 0; }
+
+	protected:
+		struct Range {
+			GLuint	nOffset;
+			GLuint	nSize;
+			GLuint	iPrev, iNext;			// Neighbors in address order
+			GLuint	iPrevFree, iNextFree;	// Same size class, free ranges only
+			bool	bFree;
+			};
+
+		// First level is the power of two, second the step within it
+		static void MapSize(GLuint nUnits, GLuint &fl, GLuint &sl)
+			{
+			if(nUnits < POOL_SL_COUNT) {
+				fl = 0;
+				sl = nUnits;
+				return;
+				}
+
+			GLuint nHigh = HighestBit(nUnits);
+			fl = nHigh - POOL_SL_BITS + 1;
+			sl = (nUnits >> (nHigh - POOL_SL_BITS)) & (POOL_SL_COUNT - 1);
+			}
+
+		// Head of the first non-empty list at or above the class of nUnits
+		GLuint FindFree(GLuint nUnits)
+			{
+			GLuint fl, sl;
+			MapSize(nUnits, fl, sl);
+
+			GLuint nBits = nSlBitmap[fl] & (~0u << sl);
+			if(nBits == 0) {
+				GLuint nFlBits = (fl + 1 < POOL_FL_COUNT) ? (nFlBitmap & (~0u << (fl + 1))) : 0;
+				if(nFlBits == 0)
+					return POOL_NONE;
+				fl = LowestBit(nFlBits);
+				nBits = nSlBitmap[fl];
+				}
+			sl = LowestBit(nBits);
+
+			return iFree[fl][sl];
+			}
+
+		void InsertFree(GLuint i)
+			{
+			GLuint fl, sl;
+			MapSize(pRanges[i].nSize, fl, sl);
+
+			pRanges[i].bFree = true;
+			pRanges[i].iPrevFree = POOL_NONE;
+			pRanges[i].iNextFree = iFree[fl][sl];
+			if(iFree[fl][sl] != POOL_NONE)
+				pRanges[iFree[fl][sl]].iPrevFree = i;
+			iFree[fl][sl] = i;
+
+			nFlBitmap |= 1u << fl;
+			nSlBitmap[fl] |= 1u << sl;
+			}
+
+		void RemoveFree(GLuint i)
+			{
+			GLuint fl, sl;
+			MapSize(pRanges[i].nSize, fl, sl);
+
+			if(pRanges[i].iPrevFree != POOL_NONE)
+				pRanges[pRanges[i].iPrevFree].iNextFree = pRanges[i].iNextFree;
+			else
+				iFree[fl][sl] = pRanges[i].iNextFree;
+			if(pRanges[i].iNextFree != POOL_NONE)
+				pRanges[pRanges[i].iNextFree].iPrevFree = pRanges[i].iPrevFree;
+
+			if(iFree[fl][sl] == POOL_NONE) {
+				nSlBitmap[fl] &= ~(1u << sl);
+				if(nSlBitmap[fl] == 0)
+					nFlBitmap &= ~(1u << fl);
+				}
+
+			pRanges[i].bFree = false;
+			}
+
+		// Take a range out of the address order list and recycle its record
+		void Unlink(GLuint i)
+			{
+			if(pRanges[i].iPrev != POOL_NONE)
+				pRanges[pRanges[i].iPrev].iNext = pRanges[i].iNext;
+			if(pRanges[i].iNext != POOL_NONE)
+				pRanges[pRanges[i].iNext].iPrev = pRanges[i].iPrev;
+
+			pRanges[i].iNextFree = iSpare;
+			iSpare = i;
+			}
+
+		GLuint NewRange(void)
+			{
+			if(iSpare != POOL_NONE) {
+				GLuint i = iSpare;
+				iSpare = pRanges[i].iNextFree;
+				return i;
+				}
+
+			if(nRanges == nMaxRanges) {
+				GLuint nNewMax = (nMaxRanges == 0) ? 64 : nMaxRanges * 2;
+				Range *pNew = new Range[nNewMax];
+				if(pRanges != NULL)
+					memcpy(pNew, pRanges, sizeof(Range) * nRanges);
+				delete [] pRanges;
+				pRanges = pNew;
+				nMaxRanges = nNewMax;
+				}
+
+			return nRanges++;
+			}
+
+		Range	*pRanges;		// Records, handles are indexes into this
+		GLuint	nRanges;
+		GLuint	nMaxRanges;
+		GLuint	iSpare;			// Recycled records, chained through iNextFree
+		GLuint	nUsed;			// Ranges handed out
+		GLuint	nFlBitmap;		// Bit per first level class with anything free
+		GLuint	nSlBitmap[POOL_FL_COUNT];
+		GLuint	iFree[POOL_FL_COUNT][POOL_SL_COUNT];
+	};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// A vertex buffer and an index buffer, and the vertex array object that
+// reads them in one format
+struct GLT_POOL_PAGE
+	{
+	GLT_POOL_PAGE	*pNext;
+	GLsizei		nStride;
+	GLT_POOL_ATTRIBUTE_SETUP	pSetup;
+	GLuint		uiVertexBuffer;
+	GLuint		uiIndexBuffer;
+	GLuint		uiVertexArray;
+	GLRangeAllocator	vertexSpace;	// In vertices
+	GLRangeAllocator	indexSpace;		// In POOL_INDEX_UNITs
+	};
+
+
+GLBufferPool::GLBufferPool(GLsizeiptr nVertexBytes, GLsizeiptr nIndexBytes): pFirst(NULL), nPages(0),
+	nPageVertexBytes(nVertexBytes), nPageIndexBytes(nIndexBytes), nSupported(-1), bDirectState(false)
+	{
+	}
+
+GLBufferPool::~GLBufferPool(void)
+	{
+	while(pFirst != NULL) {
+		GLT_POOL_PAGE *pNext = pFirst->pNext;
+		DeletePage(pFirst);
+		pFirst = pNext;
+		}
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Base vertex drawing is what makes sharing possible. Asked once, the
+// first time there's a context to ask.
+bool GLBufferPool::IsSupported(void)
+	{
+#ifdef OPENGL_ES
+	return false;
+#else
+	if(nSupported < 0) {
+		GLint nMajor = 0, nMinor = 0;
+		gltGetOpenGLVersion(nMajor, nMinor);
+		nSupported = (nMajor > 3 || (nMajor == 3 && nMinor >= 2) ||
+					  gltIsExtSupported("GL_ARB_draw_elements_base_vertex")) ? 1 : 0;
+		bDirectState = (gltIsDirectStateAccessSupported() != 0);
+		}
+	return nSupported != 0;
+#endif
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Try every page of the right format, and start a new one if none has room
+bool GLBufferPool::Alloc(GLsizei nStride, GLT_POOL_ATTRIBUTE_SETUP pSetup, GLuint nVerts, GLsizeiptr nIndexBytes,
+						 GLT_POOL_BLOCK &block)
+	{
+	block.pPage = NULL;
+	if(nStride <= 0 || pSetup == NULL || !IsSupported())
+		return false;
+
+	GLuint nIndexUnits = (GLuint)((nIndexBytes + POOL_INDEX_UNIT - 1) / POOL_INDEX_UNIT);
+
+	GLT_POOL_PAGE *pPage;
+	for(pPage = pFirst; pPage != NULL; pPage = pPage->pNext) {
+		if(pPage->nStride != nStride || pPage->pSetup != pSetup)
+			continue;
+
+		GLuint iVertexRange = pPage->vertexSpace.Alloc(nVerts);
+		if(iVertexRange == POOL_NONE)
+			continue;
+
+		GLuint iIndexRange = pPage->indexSpace.Alloc(nIndexUnits);
+		if(iIndexRange == POOL_NONE) {
+			pPage->vertexSpace.Free(iVertexRange);
+			continue;
+			}
+
+		block.iVertexRange = iVertexRange;
+		block.iIndexRange = iIndexRange;
+		break;
+		}
+
+	if(pPage == NULL) {
+		// Normal size, unless this mesh wouldn't even fit in an empty page
+		GLuint nPageVerts = (GLuint)(nPageVertexBytes / nStride);
+		GLuint nPageIndexUnits = (GLuint)(nPageIndexBytes / POOL_INDEX_UNIT);
+		if(nPageVerts < nVerts)
+			nPageVerts = nVerts;
+		if(nPageIndexUnits < nIndexUnits)
+			nPageIndexUnits = nIndexUnits;
+
+		pPage = NewPage(nStride, pSetup, nPageVerts, nPageIndexUnits);
+		if(pPage == NULL)
+			return false;
+
+		block.iVertexRange = pPage->vertexSpace.Alloc(nVerts);
+		block.iIndexRange = pPage->indexSpace.Alloc(nIndexUnits);
+		}
+
+	block.pPage = pPage;
+	block.nBaseVertex = (GLint)pPage->vertexSpace.GetOffset(block.iVertexRange);
+	block.nIndexOffset = (GLsizeiptr)pPage->indexSpace.GetOffset(block.iIndexRange) * POOL_INDEX_UNIT;
+	return true;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Both buffers go through GL_ARRAY_BUFFER, binding the index buffer to
+// GL_ELEMENT_ARRAY_BUFFER would change whatever vertex array object is bound
+void GLBufferPool::Upload(const GLT_POOL_BLOCK &block, GLuint nVerts, const GLvoid *pVertexData,
+						  GLsizeiptr nIndexBytes, const GLvoid *pIndexData)
+	{
+	if(block.pPage == NULL)
+		return;
+
+	GLT_POOL_PAGE *pPage = block.pPage;
+#ifndef OPENGL_ES
+	if(bDirectState) {
+		glNamedBufferSubData(pPage->uiVertexBuffer, (GLintptr)block.nBaseVertex * pPage->nStride, (GLsizeiptr)nVerts * pPage->nStride, pVertexData);
+		glNamedBufferSubData(pPage->uiIndexBuffer, block.nIndexOffset, nIndexBytes, pIndexData);
+		return;
+		}
+#endif
+
+	glBindBuffer(GL_ARRAY_BUFFER, pPage->uiVertexBuffer);
+	glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)block.nBaseVertex * pPage->nStride, (GLsizeiptr)nVerts * pPage->nStride, pVertexData);
+
+	glBindBuffer(GL_ARRAY_BUFFER, pPage->uiIndexBuffer);
+	glBufferSubData(GL_ARRAY_BUFFER, block.nIndexOffset, nIndexBytes, pIndexData);
+	}
+
+
+void GLBufferPool::Free(GLT_POOL_BLOCK &block)
+	{
+	if(block.pPage == NULL)
+		return;
+
+	block.pPage->vertexSpace.Free(block.iVertexRange);
+	block.pPage->indexSpace.Free(block.iIndexRange);
+	block.pPage = NULL;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Every mesh in a page draws with the same vertex array object, only the
+// index offset and base vertex change
+void GLBufferPool::DrawElements(const GLT_POOL_BLOCK &block, GLenum mode, GLsizei nCount, GLenum type,
+								GLInstanceArray *pInstances)
+	{
+#ifndef OPENGL_ES
+	if(block.pPage == NULL)
+		return;
+
+	glBindVertexArray(block.pPage->uiVertexArray);
+	if(pInstances != NULL) {
+		pInstances->Bind();
+		glDrawElementsInstancedBaseVertex(mode, nCount, type, (const GLvoid *)block.nIndexOffset,
+										  pInstances->GetInstanceCount(), block.nBaseVertex);
+		pInstances->Unbind();
+		}
+	else
+		glDrawElementsBaseVertex(mode, nCount, type, (const GLvoid *)block.nIndexOffset, block.nBaseVertex);
+	glBindVertexArray(0);
+#endif
+	}
+
+
+GLuint GLBufferPool::GetVertexArray(const GLT_POOL_BLOCK &block)
+	{
+	if(block.pPage == NULL)
+		return 0;
+
+	return block.pPage->uiVertexArray;
+	}
+
+
+void GLBufferPool::Trim(void)
+	{
+	GLT_POOL_PAGE **ppPage = &pFirst;
+	while(*ppPage != NULL) {
+		GLT_POOL_PAGE *pPage = *ppPage;
+		if(pPage->vertexSpace.IsEmpty() && pPage->indexSpace.IsEmpty()) {
+			*ppPage = pPage->pNext;
+			DeletePage(pPage);
+			}
+		else
+			ppPage = &pPage->pNext;
+		}
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Storage for both buffers up front, filled in later a mesh at a time.
+// The vertex array object is set up once and never changes. With direct
+// state access the storage is immutable, only its contents change.
+GLT_POOL_PAGE *GLBufferPool::NewPage(GLsizei nStride, GLT_POOL_ATTRIBUTE_SETUP pSetup, GLuint nVerts, GLuint nIndexUnits)
+	{
+#ifdef OPENGL_ES
+	return NULL;
+#else
+	GLT_POOL_PAGE *pPage = new GLT_POOL_PAGE;
+	pPage->nStride = nStride;
+	pPage->pSetup = pSetup;
+	pPage->vertexSpace.Init(nVerts);
+	pPage->indexSpace.Init(nIndexUnits);
+
+	if(bDirectState) {
+		glCreateBuffers(1, &pPage->uiVertexBuffer);
+		glNamedBufferStorage(pPage->uiVertexBuffer, (GLsizeiptr)nVerts * nStride, NULL, GL_DYNAMIC_STORAGE_BIT);
+
+		glCreateBuffers(1, &pPage->uiIndexBuffer);
+		glNamedBufferStorage(pPage->uiIndexBuffer, (GLsizeiptr)nIndexUnits * POOL_INDEX_UNIT, NULL, GL_DYNAMIC_STORAGE_BIT);
+		}
+	else {
+		glGenBuffers(1, &pPage->uiVertexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, pPage->uiVertexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)nVerts * nStride, NULL, GL_STATIC_DRAW);
+
+		glGenBuffers(1, &pPage->uiIndexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, pPage->uiIndexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)nIndexUnits * POOL_INDEX_UNIT, NULL, GL_STATIC_DRAW);
+		}
+
+	glGenVertexArrays(1, &pPage->uiVertexArray);
+	glBindVertexArray(pPage->uiVertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, pPage->uiVertexBuffer);
+	pSetup();
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pPage->uiIndexBuffer);
+	glBindVertexArray(0);
+
+	pPage->pNext = pFirst;
+	pFirst = pPage;
+	nPages++;
+	return pPage;
+#endif
+	}
+
+
+void GLBufferPool::DeletePage(GLT_POOL_PAGE *pPage)
+	{
+#ifndef OPENGL_ES
+	glDeleteVertexArrays(1, &pPage->uiVertexArray);
+	glDeleteBuffers(1, &pPage->uiVertexBuffer);
+	glDeleteBuffers(1, &pPage->uiIndexBuffer);
+#endif
+	delete pPage;
+	nPages--;
+	}
+
+
+GLBufferPool *GLBufferPool::GetDefault(void)
+	{
+	static GLBufferPool *pDefaultPool = new GLBufferPool;
+	return pDefaultPool;
+	}
@@ -0,0 +1,174 @@
+/*
+GLInstanceArray.cpp
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <GLInstanceArray.h>
+#include <GLShaderManager.h>
+#include <GLTools.h>
+#include <string.h>
+
+
+GLInstanceArray::GLInstanceArray(void): nNumInstances(0), nMaxInstances(0), pMatrices(NULL), pColors(NULL),
+	bMatrices(false), bColors(false), uiInstanceBuffer(0), nBufferBytes(0), nSupported(-1)
+	{
+	}
+
+
+GLInstanceArray::~GLInstanceArray(void)
+	{
+	delete [] pMatrices;
+	delete [] pColors;
+
+	if(uiInstanceBuffer != 0)
+		glDeleteBuffers(1, &uiInstanceBuffer);
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Instance data usually changes every frame, so the buffer is orphaned
+// rather than written over while the last frame's draws still read it
+void GLInstanceArray::CopyInstanceData(GLuint nInstances, const M3DMatrix44f *pNewMatrices, const M3DVector4f *pNewColors)
+	{
+	if(nInstances > nMaxInstances) {
+		delete [] pMatrices;
+		delete [] pColors;
+		pMatrices = new M3DMatrix44f[nInstances];
+		pColors = new M3DVector4f[nInstances];
+		nMaxInstances = nInstances;
+		}
+
+	nNumInstances = nInstances;
+	bMatrices = (pNewMatrices != NULL);
+	bColors = (pNewColors != NULL);
+	if(bMatrices)
+		memcpy(pMatrices, pNewMatrices, sizeof(M3DMatrix44f) * nInstances);
+	if(bColors)
+		memcpy(pColors, pNewColors, sizeof(M3DVector4f) * nInstances);
+
+#ifndef OPENGL_ES
+	GLsizeiptr nMatrixBytes = bMatrices ? sizeof(M3DMatrix44f) * nInstances : 0;
+	GLsizeiptr nColorBytes = bColors ? sizeof(M3DVector4f) * nInstances : 0;
+	if(nMatrixBytes + nColorBytes == 0 || !IsSupported())
+		return;
+
+	if(uiInstanceBuffer == 0)
+		glGenBuffers(1, &uiInstanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, uiInstanceBuffer);
+	if(nMatrixBytes + nColorBytes > nBufferBytes)
+		nBufferBytes = nMatrixBytes + nColorBytes;
+	glBufferData(GL_ARRAY_BUFFER, nBufferBytes, NULL, GL_STREAM_DRAW);
+
+	if(bMatrices)
+		glBufferSubData(GL_ARRAY_BUFFER, 0, nMatrixBytes, pMatrices);
+	if(bColors)
+		glBufferSubData(GL_ARRAY_BUFFER, nMatrixBytes, nColorBytes, pColors);
+#endif
+	}
+
+
+bool GLInstanceArray::IsSupported(void)
+	{
+#ifdef OPENGL_ES
+	return false;
+#else
+	if(nSupported < 0) {
+		GLint nMajor = 0, nMinor = 0;
+		gltGetOpenGLVersion(nMajor, nMinor);
+		nSupported = (nMajor > 3 || (nMajor == 3 && nMinor >= 3)) ? 1 : 0;
+		}
+	return nSupported != 0;
+#endif
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// A mat4 attribute takes four locations, one per column. Whatever isn't
+// given comes from the current values instead of an array.
+void GLInstanceArray::Bind(void)
+	{
+#ifndef OPENGL_ES
+	if(bMatrices || bColors)
+		glBindBuffer(GL_ARRAY_BUFFER, uiInstanceBuffer);
+
+	for(GLuint i = 0; i < 4; i++) {
+		GLuint uiAttribute = GLT_ATTRIBUTE_INSTANCE_MATRIX0 + i;
+		if(bMatrices) {
+			glEnableVertexAttribArray(uiAttribute);
+			glVertexAttribPointer(uiAttribute, 4, GL_FLOAT, GL_FALSE, sizeof(M3DMatrix44f), (const GLvoid *)(sizeof(M3DVector4f) * i));
+			glVertexAttribDivisor(uiAttribute, 1);
+			}
+		else
+			glVertexAttrib4f(uiAttribute, i == 0, i == 1, i == 2, i == 3);
+		}
+
+	if(bColors) {
+		GLintptr nColorOffset = bMatrices ? sizeof(M3DMatrix44f) * nNumInstances : 0;
+		glEnableVertexAttribArray(GLT_ATTRIBUTE_INSTANCE_COLOR);
+		glVertexAttribPointer(GLT_ATTRIBUTE_INSTANCE_COLOR, 4, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)nColorOffset);
+		glVertexAttribDivisor(GLT_ATTRIBUTE_INSTANCE_COLOR, 1);
+		}
+	else
+		glVertexAttrib4f(GLT_ATTRIBUTE_INSTANCE_COLOR, 1.0f, 1.0f, 1.0f, 1.0f);
+#endif
+	}
+
+
+void GLInstanceArray::Unbind(void)
+	{
+#ifndef OPENGL_ES
+	if(bMatrices)
+		for(GLuint i = 0; i < 4; i++) {
+			glVertexAttribDivisor(GLT_ATTRIBUTE_INSTANCE_MATRIX0 + i, 0);
+			glDisableVertexAttribArray(GLT_ATTRIBUTE_INSTANCE_MATRIX0 + i);
+			}
+
+	if(bColors) {
+		glVertexAttribDivisor(GLT_ATTRIBUTE_INSTANCE_COLOR, 0);
+		glDisableVertexAttribArray(GLT_ATTRIBUTE_INSTANCE_COLOR);
+		}
+#endif
+	}
+
+
+void GLInstanceArray::SetCurrent(GLuint i)
+	{
+	static const M3DMatrix44f mIdentity = { 1.0f, 0.0f, 0.0f, 0.0f,
+											0.0f, 1.0f, 0.0f, 0.0f,
+											0.0f, 0.0f, 1.0f, 0.0f,
+											0.0f, 0.0f, 0.0f, 1.0f };
+	static const M3DVector4f vWhite = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+	const GLfloat *pMatrix = bMatrices ? pMatrices[i] : mIdentity;
+	for(GLuint j = 0; j < 4; j++)
+		glVertexAttrib4fv(GLT_ATTRIBUTE_INSTANCE_MATRIX0 + j, pMatrix + 4 * j);
+
+	glVertexAttrib4fv(GLT_ATTRIBUTE_INSTANCE_COLOR, bColors ? pColors[i] : vWhite);
+	}
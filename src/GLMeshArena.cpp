@@ -0,0 +1,172 @@
+/*
+GLMeshArena.cpp
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <GLMeshArena.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Everything handed out is aligned to this, and so is the chunk header
+#define ARENA_ALIGN		16
+#define ARENA_ROUND(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_HEADER	ARENA_ROUND(sizeof(Chunk))
+
+
+GLMeshArena::GLMeshArena(size_t nChunk): pFirst(NULL), pCurrent(NULL), pLast(NULL), nChunkBytes(nChunk), nReserved(0), nUsers(0)
+	{
+	}
+
+GLMeshArena::~GLMeshArena(void)
+	{
+	nUsers = 0;
+	Trim();
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// One more batch is building with this arena
+void GLMeshArena::Acquire(void)
+	{
+	nUsers++;
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// A batch is done. When nobody is left, everything handed out is dead,
+// so start over at the beginning of the first chunk.
+void GLMeshArena::Release(void)
+	{
+	if(nUsers == 0)
+		return;
+
+	if(--nUsers != 0)
+		return;
+
+	for(Chunk *pChunk = pFirst; pChunk != NULL; pChunk = pChunk->pNext)
+		pChunk->nUsed = 0;
+
+	pCurrent = pFirst;
+	pLast = NULL;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Bump allocate from the current chunk, moving on to the next kept chunk
+// or getting a new one from the heap when it doesn't fit.
+void *GLMeshArena::Alloc(size_t nBytes)
+	{
+	nBytes = ARENA_ROUND(nBytes);
+
+	while(pCurrent != NULL && pCurrent->nSize - pCurrent->nUsed < nBytes)
+		{
+		if(pCurrent->pNext == NULL)
+			break;
+		pCurrent = pCurrent->pNext;
+		}
+
+	if(pCurrent == NULL || pCurrent->nSize - pCurrent->nUsed < nBytes)
+		{
+		size_t nSize = (nBytes > nChunkBytes) ? nBytes : nChunkBytes;
+		Chunk *pChunk = (Chunk *)malloc(CHUNK_HEADER + nSize);
+		if(pChunk == NULL)
+			return NULL;
+
+		pChunk->pNext = NULL;
+		pChunk->nSize = nSize;
+		pChunk->nUsed = 0;
+		nReserved += nSize;
+
+		// Goes on the end of the list, after the current chunk
+		if(pCurrent == NULL)
+			pFirst = pChunk;
+		else
+			pCurrent->pNext = pChunk;
+		pCurrent = pChunk;
+		}
+
+	void *pMem = (unsigned char *)pCurrent + CHUNK_HEADER + pCurrent->nUsed;
+	pCurrent->nUsed += nBytes;
+	pLast = pMem;
+	return pMem;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Make an allocation bigger
+void *GLMeshArena::Grow(void *pOld, size_t nOldBytes, size_t nNewBytes)
+	{
+	if(pOld == NULL)
+		return Alloc(nNewBytes);
+
+	// Last thing out of the current chunk? Just move the top.
+	if(pOld == pLast)
+		{
+		size_t nOffset = (unsigned char *)pOld - ((unsigned char *)pCurrent + CHUNK_HEADER);
+		if(ARENA_ROUND(nNewBytes) <= pCurrent->nSize - nOffset)
+			{
+			pCurrent->nUsed = nOffset + ARENA_ROUND(nNewBytes);
+			return pOld;
+			}
+		}
+
+	void *pNew = Alloc(nNewBytes);
+	if(pNew != NULL)
+		memcpy(pNew, pOld, nOldBytes);
+	return pNew;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Free all the chunks
+void GLMeshArena::Trim(void)
+	{
+	if(nUsers != 0)
+		return;
+
+	while(pFirst != NULL)
+		{
+		Chunk *pNext = pFirst->pNext;
+		free(pFirst);
+		pFirst = pNext;
+		}
+
+	pCurrent = NULL;
+	pLast = NULL;
+	nReserved = 0;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Shared by every batch that doesn't have an arena of its own
+GLMeshArena *GLMeshArena::GetDefault(void)
+	{
+	static GLMeshArena defaultArena;
+	return &defaultArena;
+	}
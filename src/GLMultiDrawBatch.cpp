@@ -0,0 +1,263 @@
+/*
+GLMultiDrawBatch.cpp
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <GLMultiDrawBatch.h>
+#include <GLTools.h>
+#include <string.h>
+
+
+GLMultiDrawBatch::GLMultiDrawBatch(void): nNumDraws(0), nMaxDraws(0), ppBatches(NULL), pMatrices(NULL), pColors(NULL),
+	pGroupOf(NULL), ppSorted(NULL), pSortedMatrices(NULL), pSortedColors(NULL), pCommands(NULL),
+	pGroups(NULL), nNumGroups(0), nMaxGroups(0), uiCommandBuffer(0), nCommandBytes(0), nSupported(-1)
+	{
+	}
+
+
+GLMultiDrawBatch::~GLMultiDrawBatch(void)
+	{
+	delete [] ppBatches;
+	delete [] pMatrices;
+	delete [] pColors;
+	delete [] pGroupOf;
+	delete [] ppSorted;
+	delete [] pSortedMatrices;
+	delete [] pSortedColors;
+	delete [] pCommands;
+	delete [] pGroups;
+
+	if(uiCommandBuffer != 0)
+		glDeleteBuffers(1, &uiCommandBuffer);
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Indirect commands need a base instance to find their matrix and color
+bool GLMultiDrawBatch::IsSupported(void)
+	{
+#ifdef OPENGL_ES
+	return false;
+#else
+	if(nSupported < 0) {
+		GLint nMajor = 0, nMinor = 0;
+		gltGetOpenGLVersion(nMajor, nMinor);
+		nSupported = (nMajor > 4 || (nMajor == 4 && nMinor >= 3) ||
+					  (gltIsExtSupported("GL_ARB_multi_draw_indirect") && gltIsExtSupported("GL_ARB_base_instance"))) ? 1 : 0;
+		}
+	return nSupported != 0;
+#endif
+	}
+
+
+void GLMultiDrawBatch::Begin(void)
+	{
+	nNumDraws = 0;
+	nNumGroups = 0;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// The arrays double when they run out, so a scene rebuilt every frame
+// stops allocating after the first one
+void GLMultiDrawBatch::AddBatch(GLTriangleBatch &batch, const M3DMatrix44f mModel, const M3DVector4f vColor)
+	{
+	if(nNumDraws == nMaxDraws) {
+		GLuint nNewMax = (nMaxDraws != 0) ? nMaxDraws * 2 : 64;
+
+		GLTriangleBatch **ppNewBatches = new GLTriangleBatch*[nNewMax];
+		M3DMatrix44f *pNewMatrices = new M3DMatrix44f[nNewMax];
+		M3DVector4f *pNewColors = new M3DVector4f[nNewMax];
+		memcpy(ppNewBatches, ppBatches, sizeof(GLTriangleBatch *) * nNumDraws);
+		memcpy(pNewMatrices, pMatrices, sizeof(M3DMatrix44f) * nNumDraws);
+		memcpy(pNewColors, pColors, sizeof(M3DVector4f) * nNumDraws);
+
+		delete [] ppBatches;
+		delete [] pMatrices;
+		delete [] pColors;
+		ppBatches = ppNewBatches;
+		pMatrices = pNewMatrices;
+		pColors = pNewColors;
+
+		// These are filled in by End(), nothing to keep
+		delete [] pGroupOf;
+		delete [] ppSorted;
+		delete [] pSortedMatrices;
+		delete [] pSortedColors;
+		delete [] pCommands;
+		pGroupOf = new GLuint[nNewMax];
+		ppSorted = new GLTriangleBatch*[nNewMax];
+		pSortedMatrices = new M3DMatrix44f[nNewMax];
+		pSortedColors = new M3DVector4f[nNewMax];
+		pCommands = new GLT_DRAW_ELEMENTS_COMMAND[nNewMax];
+
+		nMaxDraws = nNewMax;
+		}
+
+	ppBatches[nNumDraws] = &batch;
+	memcpy(pMatrices[nNumDraws], mModel, sizeof(M3DMatrix44f));
+	if(vColor != NULL)
+		memcpy(pColors[nNumDraws], vColor, sizeof(M3DVector4f));
+	else
+		pColors[nNumDraws][0] = pColors[nNumDraws][1] = pColors[nNumDraws][2] = pColors[nNumDraws][3] = 1.0f;
+	nNumDraws++;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// There are only ever a few groups, one per pool page and index type, so
+// a straight search is fine
+GLuint GLMultiDrawBatch::FindGroup(GLuint uiVertexArray, GLenum indexType)
+	{
+	for(GLuint i = 0; i < nNumGroups; i++)
+		if(pGroups[i].uiVertexArray == uiVertexArray && pGroups[i].indexType == indexType)
+			return i;
+
+	if(nNumGroups == nMaxGroups) {
+		GLuint nNewMax = (nMaxGroups != 0) ? nMaxGroups * 2 : 8;
+		GLT_DRAW_GROUP *pNewGroups = new GLT_DRAW_GROUP[nNewMax];
+		memcpy(pNewGroups, pGroups, sizeof(GLT_DRAW_GROUP) * nNumGroups);
+		delete [] pGroups;
+		pGroups = pNewGroups;
+		nMaxGroups = nNewMax;
+		}
+
+	GLT_DRAW_GROUP &group = pGroups[nNumGroups];
+	group.uiVertexArray = uiVertexArray;
+	group.indexType = indexType;
+	group.nFirst = 0;
+	group.nCount = 0;
+	return nNumGroups++;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// A counting sort by group. Draw i of a group is command nFirst + i, and
+// its base instance is the same number, which is where its matrix and
+// color end up in the instance array.
+void GLMultiDrawBatch::End(void)
+	{
+	nNumGroups = 0;
+	for(GLuint i = 0; i < nNumDraws; i++) {
+		GLTriangleBatch *pBatch = ppBatches[i];
+		GLuint uiVertexArray = pBatch->IsPooled() ? GLBufferPool::GetVertexArray(pBatch->GetPoolBlock()) : 0;
+		pGroupOf[i] = FindGroup(uiVertexArray, pBatch->GetIndexType());
+		pGroups[pGroupOf[i]].nCount++;
+		}
+
+	GLuint nFirst = 0;
+	for(GLuint i = 0; i < nNumGroups; i++) {
+		pGroups[i].nFirst = nFirst;
+		nFirst += pGroups[i].nCount;
+		pGroups[i].nCount = 0;
+		}
+
+	for(GLuint i = 0; i < nNumDraws; i++) {
+		GLT_DRAW_GROUP &group = pGroups[pGroupOf[i]];
+		GLuint iDraw = group.nFirst + group.nCount++;
+		GLTriangleBatch *pBatch = ppBatches[i];
+
+		ppSorted[iDraw] = pBatch;
+		memcpy(pSortedMatrices[iDraw], pMatrices[i], sizeof(M3DMatrix44f));
+		memcpy(pSortedColors[iDraw], pColors[i], sizeof(M3DVector4f));
+
+		GLT_DRAW_ELEMENTS_COMMAND &command = pCommands[iDraw];
+		command.nCount = pBatch->GetIndexCount();
+		command.nInstanceCount = 1;
+		command.nFirstIndex = 0;
+		command.nBaseVertex = 0;
+		command.nBaseInstance = iDraw;
+		if(group.uiVertexArray != 0) {
+			const GLT_POOL_BLOCK &block = pBatch->GetPoolBlock();
+			GLsizeiptr nIndexSize = (group.indexType == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+			command.nFirstIndex = (GLuint)(block.nIndexOffset / nIndexSize);
+			command.nBaseVertex = block.nBaseVertex;
+			}
+		}
+
+	instances.CopyInstanceData(nNumDraws, pSortedMatrices, pSortedColors);
+
+#ifndef OPENGL_ES
+	if(nNumDraws == 0 || !IsSupported())
+		return;
+
+	GLsizeiptr nBytes = sizeof(GLT_DRAW_ELEMENTS_COMMAND) * nNumDraws;
+	if(uiCommandBuffer == 0)
+		glGenBuffers(1, &uiCommandBuffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, uiCommandBuffer);
+	if(nBytes > nCommandBytes) {
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, nBytes, pCommands, GL_STATIC_DRAW);
+		nCommandBytes = nBytes;
+		}
+	else
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, nBytes, pCommands);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+#endif
+	}
+
+
+GLuint GLMultiDrawBatch::GetCallCount(void)
+	{
+	GLuint nCalls = 0;
+	for(GLuint i = 0; i < nNumGroups; i++)
+		nCalls += (pGroups[i].uiVertexArray != 0 && IsSupported()) ? 1 : pGroups[i].nCount;
+
+	return nCalls;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// The instance attributes have a divisor of one, and a divisor counts
+// from the base instance, so each command reads its own matrix and color
+void GLMultiDrawBatch::Draw(void)
+	{
+	for(GLuint i = 0; i < nNumGroups; i++) {
+		const GLT_DRAW_GROUP &group = pGroups[i];
+
+	#ifndef OPENGL_ES
+		if(group.uiVertexArray != 0 && IsSupported()) {
+			glBindVertexArray(group.uiVertexArray);
+			instances.Bind();
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, uiCommandBuffer);
+			glMultiDrawElementsIndirect(GL_TRIANGLES, group.indexType,
+										(const GLvoid *)(sizeof(GLT_DRAW_ELEMENTS_COMMAND) * group.nFirst), group.nCount, 0);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+			instances.Unbind();
+			glBindVertexArray(0);
+			continue;
+			}
+	#endif
+
+		for(GLuint j = group.nFirst; j < group.nFirst + group.nCount; j++) {
+			instances.SetCurrent(j);
+			ppSorted[j]->Draw();
+			}
+		}
+	}
@@ -31,12 +31,37 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 #include <GLShaderManager.h>
 #include <GLTools.h>
 #include <stdarg.h>
+#include <string.h>
 
 
 ///////////////////////////////////////////////////////////////////////////////
 // Stock Shader Source Code
 ///////////////////////////////////////////////////////////////////////////////
 
+///////////////////////////////////////////////////////////////////////////////
+// Every stock vertex shader starts with the transforms and the light
+// position, either as loose uniforms or (SetTransformBlock()) as a std140
+// uniform block laid out like GLT_TRANSFORM_BLOCK. The fragment shaders
+// get the matching #version.
+static const char *szTransformUniforms =	"uniform mat4 mvpMatrix;"
+											"uniform mat4 mvMatrix;"
+											"uniform mat4 pMatrix;"
+											"uniform vec3 vLightPos;";
+
+static const char *szTransformBlock =	"#version 140\n"
+										"layout(std140) uniform GLTTransforms {"
+										" mat4 mvpMatrix;"
+										" mat4 mvMatrix;"
+										" mat4 pMatrix;"
+										" vec3 vLightPos;"
+										"};";
+
+static const char *szTransformBlockFP =	"#version 140\n";
+
+// Big enough for any stock shader with its transforms in front
+#define GLT_STOCK_SOURCE_LENGTH		4096
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Identity Shader (GLT_SHADER_IDENTITY)
 // This shader does no transformations at all, and uses the current
@@ -61,8 +86,7 @@ static const char *szIdentityShaderFP =
 // Flat Shader (GLT_SHADER_FLAT)
 // This shader applies the given model view matrix to the verticies, 
 // and uses a uniform color value.
-static const char *szFlatShaderVP =	"uniform mat4 mvpMatrix;"
-									"attribute vec4 vVertex;"
+static const char *szFlatShaderVP =	"attribute vec4 vVertex;"
 									"void main(void) "
 									"{ gl_Position = mvpMatrix * vVertex; "
 									"}";
@@ -79,8 +103,7 @@ static const char *szFlatShaderFP =
 ///////////////////////////////////////////////////////////////////////////////
 // GLT_SHADER_SHADED
 // Point light, diffuse lighting only
-static const char *szShadedVP =		"uniform mat4 mvpMatrix;"
-									"attribute vec4 vColor;"
+static const char *szShadedVP =		"attribute vec4 vColor;"
 									"attribute vec4 vVertex;"
 									"varying vec4 vFragColor;"
 									"void main(void) {"
@@ -99,9 +122,7 @@ static const char *szShadedFP =
 									
 // GLT_SHADER_DEFAULT_LIGHT
 // Simple diffuse, directional, and vertex based light
-static const char *szDefaultLightVP = "uniform mat4 mvMatrix;"
-									  "uniform mat4 pMatrix;"
-									  "varying vec4 vFragColor;"
+static const char *szDefaultLightVP = "varying vec4 vFragColor;"
 									  "attribute vec4 vVertex;"
 									  "attribute vec3 vNormal;"
 									  "uniform vec4 vColor;"
@@ -132,10 +153,7 @@ static const char *szDefaultLightFP =
 
 //GLT_SHADER_POINT_LIGHT_DIFF
 // Point light, diffuse lighting only
-static const char *szPointLightDiffVP =	  "uniform mat4 mvMatrix;"
-										  "uniform mat4 pMatrix;"
-										  "uniform vec3 vLightPos;"
-										  "uniform vec4 vColor;"
+static const char *szPointLightDiffVP =	  "uniform vec4 vColor;"
 										  "attribute vec4 vVertex;"
 										  "attribute vec3 vNormal;"
 										  "varying vec4 vFragColor;"
@@ -170,8 +188,7 @@ static const char *szPointLightDiffFP =
 
 //GLT_SHADER_TEXTURE_REPLACE
 // Just put the texture on the polygons
-static const char *szTextureReplaceVP =	"uniform mat4 mvpMatrix;"
-										"attribute vec4 vVertex;"
+static const char *szTextureReplaceVP =	"attribute vec4 vVertex;"
 										"attribute vec2 vTexCoord0;"
 										"varying vec2 vTex;"
 										"void main(void) "
@@ -191,8 +208,7 @@ static const char *szTextureReplaceFP =
 
 
 // Just put the texture on the polygons
-static const char *szTextureRectReplaceVP =	"uniform mat4 mvpMatrix;"
-                                        "attribute vec4 vVertex;"
+static const char *szTextureRectReplaceVP =	"attribute vec4 vVertex;"
                                         "attribute vec2 vTexCoord0;"
                                         "varying vec2 vTex;"
                                         "void main(void) "
@@ -214,8 +230,7 @@ static const char *szTextureRectReplaceFP =
 
 //GLT_SHADER_TEXTURE_MODULATE
 // Just put the texture on the polygons, but multiply by the color (as a unifomr)
-static const char *szTextureModulateVP ="uniform mat4 mvpMatrix;"
-										"attribute vec4 vVertex;"
+static const char *szTextureModulateVP ="attribute vec4 vVertex;"
 										"attribute vec2 vTexCoord0;"
 										"varying vec2 vTex;"
 										"void main(void) "
@@ -238,10 +253,7 @@ static const char *szTextureModulateFP =
 
 //GLT_SHADER_TEXTURE_POINT_LIGHT_DIFF
 // Point light (Diffuse only), with texture (modulated)
-static const char *szTexturePointLightDiffVP =	  "uniform mat4 mvMatrix;"
-												  "uniform mat4 pMatrix;"
-												  "uniform vec3 vLightPos;"
-												  "uniform vec4 vColor;"
+static const char *szTexturePointLightDiffVP =	  "uniform vec4 vColor;"
 												  "attribute vec4 vVertex;"
 												  "attribute vec3 vNormal;"
 												  "varying vec4 vFragColor;"
@@ -287,13 +299,89 @@ static const char *szTexturePointLightDiffFP =
 // GLT_SHADER_TEXTURE_POINT_LIGHT_DIFF
 // Modulate texture with diffuse point light
 
+///////////////////////////////////////////////////////////////////////////////
+// GLT_SHADER_FLAT_INSTANCED
+// The flat shader, drawn many times at once. Each instance has a model
+// matrix and a color (GLInstanceArray), mvpMatrix is the view projection.
+static const char *szFlatInstancedVP =	"uniform vec4 vColor;"
+										"attribute vec4 vVertex;"
+										"attribute mat4 mInstance;"
+										"attribute vec4 vInstanceColor;"
+										"varying vec4 vFragColor;"
+										"void main(void) "
+										"{ vFragColor = vColor * vInstanceColor; "
+										" gl_Position = mvpMatrix * (mInstance * vVertex); "
+										"}";
+
+static const char *szFlatInstancedFP =
+#ifdef OPENGL_ES
+										"precision mediump float;"
+#endif
+										"varying vec4 vFragColor; "
+										"void main(void) { "
+										" gl_FragColor = vFragColor; "
+										"}";
+
+// GLT_SHADER_POINT_LIGHT_DIFF_INSTANCED
+// Point light, diffuse lighting only, with mvMatrix the view matrix and
+// each instance's model matrix applied first
+static const char *szPointLightDiffInstancedVP = "uniform vec4 vColor;"
+										  "attribute vec4 vVertex;"
+										  "attribute vec3 vNormal;"
+										  "attribute mat4 mInstance;"
+										  "attribute vec4 vInstanceColor;"
+										  "varying vec4 vFragColor;"
+										  "void main(void) { "
+										  " mat4 mvInstance = mvMatrix * mInstance;"
+										  " mat3 mNormalMatrix;"
+										  " mNormalMatrix[0] = normalize(mvInstance[0].xyz);"
+										  " mNormalMatrix[1] = normalize(mvInstance[1].xyz);"
+										  " mNormalMatrix[2] = normalize(mvInstance[2].xyz);"
+										  " vec3 vNorm = normalize(mNormalMatrix * vNormal);"
+										  " vec4 ecPosition;"
+										  " vec3 ecPosition3;"
+										  " ecPosition = mvInstance * vVertex;"
+										  " ecPosition3 = ecPosition.xyz /ecPosition.w;"
+										  " vec3 vLightDir = normalize(vLightPos - ecPosition3);"
+										  " float fDot = max(0.0, dot(vNorm, vLightDir)); "
+										  " vec4 vInstanced = vColor * vInstanceColor;"
+										  " vFragColor.rgb = vInstanced.rgb * fDot;"
+										  " vFragColor.a = vInstanced.a;"
+										  " gl_Position = pMatrix * ecPosition; "
+										  "}";
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Uniforms the stock shaders use, in GLT_STOCK_UNIFORM order
+static const char *szStockUniformNames[GLT_UNIFORM_LAST] = { "mvpMatrix", "mvMatrix", "pMatrix", "vColor", "vLightPos", "textureUnit0" };
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Constructor, just zero out everything
 GLShaderManager::GLShaderManager(void)
 	{
 	// Set stock shader handles to 0... uninitialized
-	for(unsigned int i = 0; i < GLT_SHADER_LAST; i++)
+	for(unsigned int i = 0; i < GLT_SHADER_LAST; i++) {
 		uiStockShaders[i] = 0;
+		for(unsigned int j = 0; j < GLT_UNIFORM_LAST; j++)
+			iStockUniforms[i][j] = -1;
+		}
+
+	bUseTransformBlock = false;
+	nTransformSlots = 1024;
+	uiTransformBuffer = 0;
+	pTransformMap = NULL;
+	nTransformStride = 0;
+	nTransformSlot = 0;
+#ifndef OPENGL_ES
+	for(unsigned int i = 0; i < GLT_TRANSFORM_RING_SEGMENTS; i++)
+		transformFences[i] = 0;
+#endif
+	memset(&pendingTransforms, 0, sizeof(GLT_TRANSFORM_BLOCK));
+	bTransformsChanged = false;
+
+	bTrackState = false;
+	InvalidateState();
 	}
 	
 ///////////////////////////////////////////////////////////////////////////////
@@ -310,42 +398,111 @@ GLShaderManager::~GLShaderManager(void)
 //		for(i = 0; i < shaderTable.size(); i++)
 //			glDeleteProgram(shaderTable[i].uiShaderID);
 		}
+
+	DeleteTransformRing();
 	}
 	
 	
-///////////////////////////////////////////////////////////////////////////////
-// Initialize and load the stock shaders
-bool GLShaderManager::InitializeStockShaders(void)
+///////////////////////////////////////////////////////////////////////
+// Put a prefix in front of a stock shader's source
+static const char *StockSource(char *szBuffer, const char *szPrefix, const char *szSource)
 	{
-	// Be warned, going over 128 shaders may cause a
-	// hickup for a reallocation.
-//	shaderTable.reserve(128);
-	
-	uiStockShaders[GLT_SHADER_IDENTITY]			= gltLoadShaderPairSrcWithAttributes(szIdentityShaderVP, szIdentityShaderFP, 1, GLT_ATTRIBUTE_VERTEX, "vVertex");
-	uiStockShaders[GLT_SHADER_FLAT]				= gltLoadShaderPairSrcWithAttributes(szFlatShaderVP, szFlatShaderFP, 1, GLT_ATTRIBUTE_VERTEX, "vVertex");
-	uiStockShaders[GLT_SHADER_SHADED]			= gltLoadShaderPairSrcWithAttributes(szShadedVP, szShadedFP, 2,
+	strncpy(szBuffer, szPrefix, GLT_STOCK_SOURCE_LENGTH - 1);
+	szBuffer[GLT_STOCK_SOURCE_LENGTH - 1] = '\0';
+	strncat(szBuffer, szSource, GLT_STOCK_SOURCE_LENGTH - strlen(szBuffer) - 1);
+	return szBuffer;
+	}
+
+
+///////////////////////////////////////////////////////////////////////
+// Compile and link all the stock shaders, with the transforms declared
+// by szVertexPrefix
+void GLShaderManager::LoadStockShaders(const char *szVertexPrefix, const char *szFragmentPrefix)
+	{
+	char szVP[GLT_STOCK_SOURCE_LENGTH];
+	char szFP[GLT_STOCK_SOURCE_LENGTH];
+
+	for(unsigned int i = 0; i < GLT_SHADER_LAST; i++)
+		if(uiStockShaders[i] != 0) {
+			glDeleteProgram(uiStockShaders[i]);
+			uiStockShaders[i] = 0;
+			}
+
+	uiStockShaders[GLT_SHADER_IDENTITY]			= gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szIdentityShaderVP), StockSource(szFP, szFragmentPrefix, szIdentityShaderFP), 1, GLT_ATTRIBUTE_VERTEX, "vVertex");
+	uiStockShaders[GLT_SHADER_FLAT]				= gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szFlatShaderVP), StockSource(szFP, szFragmentPrefix, szFlatShaderFP), 1, GLT_ATTRIBUTE_VERTEX, "vVertex");
+	uiStockShaders[GLT_SHADER_SHADED]			= gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szShadedVP), StockSource(szFP, szFragmentPrefix, szShadedFP), 2,
 																								GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_COLOR, "vColor");
 
 
-	uiStockShaders[GLT_SHADER_DEFAULT_LIGHT]	= gltLoadShaderPairSrcWithAttributes(szDefaultLightVP, szDefaultLightFP, 2,
+	uiStockShaders[GLT_SHADER_DEFAULT_LIGHT]	= gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szDefaultLightVP), StockSource(szFP, szFragmentPrefix, szDefaultLightFP), 2,
 																								GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_NORMAL, "vNormal");
 	
-	uiStockShaders[GLT_SHADER_POINT_LIGHT_DIFF] = gltLoadShaderPairSrcWithAttributes(szPointLightDiffVP, szPointLightDiffFP, 2,
+	uiStockShaders[GLT_SHADER_POINT_LIGHT_DIFF] = gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szPointLightDiffVP), StockSource(szFP, szFragmentPrefix, szPointLightDiffFP), 2,
 																								GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_NORMAL, "vNormal");
 
-	uiStockShaders[GLT_SHADER_TEXTURE_REPLACE]  = gltLoadShaderPairSrcWithAttributes(szTextureReplaceVP, szTextureReplaceFP, 2, 
+	uiStockShaders[GLT_SHADER_TEXTURE_REPLACE]  = gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szTextureReplaceVP), StockSource(szFP, szFragmentPrefix, szTextureReplaceFP), 2, 
 																								GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_TEXTURE0, "vTexCoord0");
 
-	uiStockShaders[GLT_SHADER_TEXTURE_MODULATE] = gltLoadShaderPairSrcWithAttributes(szTextureModulateVP, szTextureModulateFP, 2,
+	uiStockShaders[GLT_SHADER_TEXTURE_MODULATE] = gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szTextureModulateVP), StockSource(szFP, szFragmentPrefix, szTextureModulateFP), 2,
 														GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_TEXTURE0, "vTexCoord0");
 
-	uiStockShaders[GLT_SHADER_TEXTURE_POINT_LIGHT_DIFF] = gltLoadShaderPairSrcWithAttributes(szTexturePointLightDiffVP, szTexturePointLightDiffFP, 3,
+	uiStockShaders[GLT_SHADER_TEXTURE_POINT_LIGHT_DIFF] = gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szTexturePointLightDiffVP), StockSource(szFP, szFragmentPrefix, szTexturePointLightDiffFP), 3,
 																GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_NORMAL, "vNormal", GLT_ATTRIBUTE_TEXTURE0, "vTexCoord0");
 
 	
-    uiStockShaders[GLT_SHADER_TEXTURE_RECT_REPLACE] = gltLoadShaderPairSrcWithAttributes(szTextureRectReplaceVP, szTextureRectReplaceFP, 2, 
+    uiStockShaders[GLT_SHADER_TEXTURE_RECT_REPLACE] = gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szTextureRectReplaceVP), StockSource(szFP, szFragmentPrefix, szTextureRectReplaceFP), 2, 
                                                                                              GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_TEXTURE0, "vTexCoord0");
 
+	uiStockShaders[GLT_SHADER_FLAT_INSTANCED] = gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szFlatInstancedVP), StockSource(szFP, szFragmentPrefix, szFlatInstancedFP), 3,
+														GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_INSTANCE_MATRIX0, "mInstance",
+														GLT_ATTRIBUTE_INSTANCE_COLOR, "vInstanceColor");
+
+	uiStockShaders[GLT_SHADER_POINT_LIGHT_DIFF_INSTANCED] = gltLoadShaderPairSrcWithAttributes(StockSource(szVP, szVertexPrefix, szPointLightDiffInstancedVP), StockSource(szFP, szFragmentPrefix, szPointLightDiffFP), 4,
+														GLT_ATTRIBUTE_VERTEX, "vVertex", GLT_ATTRIBUTE_NORMAL, "vNormal",
+														GLT_ATTRIBUTE_INSTANCE_MATRIX0, "mInstance", GLT_ATTRIBUTE_INSTANCE_COLOR, "vInstanceColor");
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Initialize and load the stock shaders
+bool GLShaderManager::InitializeStockShaders(void)
+	{
+	// Be warned, going over 128 shaders may cause a
+	// hickup for a reallocation.
+//	shaderTable.reserve(128);
+	
+	// The uniform block needs its ring, and shaders that compile. If either
+	// doesn't work out, the stock shaders use loose uniforms as always.
+	DeleteTransformRing();
+	if(bUseTransformBlock && CreateTransformRing()) {
+		LoadStockShaders(szTransformBlock, szTransformBlockFP);
+		for(unsigned int i = 0; i < GLT_SHADER_LAST; i++)
+			if(uiStockShaders[i] == 0) {
+				DeleteTransformRing();
+				break;
+				}
+		}
+
+	if(pTransformMap == NULL)
+		LoadStockShaders(szTransformUniforms, "");
+
+	// Look up every uniform once, rather than by name on every
+	// UseStockShader(). The ones a shader doesn't have stay -1.
+	for(unsigned int i = 0; i < GLT_SHADER_LAST; i++)
+		for(unsigned int j = 0; j < GLT_UNIFORM_LAST; j++)
+			iStockUniforms[i][j] = (uiStockShaders[i] != 0) ? glGetUniformLocation(uiStockShaders[i], szStockUniformNames[j]) : -1;
+	InvalidateState();
+
+#ifndef OPENGL_ES
+	// All the stock shaders read the same block
+	if(pTransformMap != NULL)
+		for(unsigned int i = 0; i < GLT_SHADER_LAST; i++) {
+			GLuint uiBlock = glGetUniformBlockIndex(uiStockShaders[i], "GLTTransforms");
+			if(uiBlock != GL_INVALID_INDEX)
+				glUniformBlockBinding(uiStockShaders[i], uiBlock, GLT_TRANSFORM_BLOCK_BINDING);
+			}
+#endif
+
     if(uiStockShaders[0] != 0)
 		return true;
 		
@@ -353,6 +510,163 @@ bool GLShaderManager::InitializeStockShaders(void)
 	}
 	
 
+///////////////////////////////////////////////////////////////////////
+// Skip the GL calls that wouldn't change anything. Off by default, since
+// it goes wrong as soon as the program or a stock shader's uniforms are
+// changed behind the shader manager's back.
+void GLShaderManager::SetStateTracking(bool bTrack)
+	{
+	bTrackState = bTrack;
+	InvalidateState();
+	}
+
+void GLShaderManager::InvalidateState(void)
+	{
+	uiCurrentProgram = 0;
+	for(unsigned int i = 0; i < GLT_SHADER_LAST; i++)
+		for(unsigned int j = 0; j < GLT_UNIFORM_LAST; j++)
+			stockShadows[i][j].bValid = false;
+
+	// The block binding may have been changed too
+	bTransformsChanged = true;
+	}
+
+
+///////////////////////////////////////////////////////////////////////
+// Transform block. Takes effect at the next InitializeStockShaders().
+void GLShaderManager::SetTransformBlock(bool bUse, GLuint nSlots)
+	{
+	if(nSlots < GLT_TRANSFORM_RING_SEGMENTS)
+		nSlots = GLT_TRANSFORM_RING_SEGMENTS;
+
+	bUseTransformBlock = bUse;
+	nTransformSlots = nSlots - (nSlots % GLT_TRANSFORM_RING_SEGMENTS);
+	}
+
+
+///////////////////////////////////////////////////////////////////////
+// One persistently mapped buffer of nTransformSlots blocks, each padded
+// out to the uniform buffer offset alignment. Needs uniform blocks
+// (OpenGL 3.1) and ARB_buffer_storage (OpenGL 4.4).
+bool GLShaderManager::CreateTransformRing(void)
+	{
+#ifndef OPENGL_ES
+	GLint nMajor = 0, nMinor = 0;
+	gltGetOpenGLVersion(nMajor, nMinor);
+	if(nMajor < 3 || (nMajor == 3 && nMinor < 1))
+		return false;
+	if((nMajor == 3 || (nMajor == 4 && nMinor < 4)) && !gltIsExtSupported("GL_ARB_buffer_storage"))
+		return false;
+
+	GLint nAlignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &nAlignment);
+	if(nAlignment < 1)
+		nAlignment = 256;
+	nTransformStride = ((sizeof(GLT_TRANSFORM_BLOCK) + nAlignment - 1) / nAlignment) * nAlignment;
+
+	GLsizeiptr nBytes = (GLsizeiptr)nTransformStride * nTransformSlots;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &uiTransformBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, uiTransformBuffer);
+	glBufferStorage(GL_UNIFORM_BUFFER, nBytes, NULL, flags);
+	pTransformMap = (GLubyte *)glMapBufferRange(GL_UNIFORM_BUFFER, 0, nBytes, flags);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	if(pTransformMap == NULL) {
+		glDeleteBuffers(1, &uiTransformBuffer);
+		uiTransformBuffer = 0;
+		return false;
+		}
+
+	// The first block written goes in slot 0
+	nTransformSlot = nTransformSlots - 1;
+	m3dLoadIdentity44(pendingTransforms.mvpMatrix);
+	m3dLoadIdentity44(pendingTransforms.mvMatrix);
+	m3dLoadIdentity44(pendingTransforms.pMatrix);
+	pendingTransforms.vLightPos[0] = pendingTransforms.vLightPos[1] = pendingTransforms.vLightPos[2] = 0.0f;
+	pendingTransforms.vLightPos[3] = 1.0f;
+	bTransformsChanged = true;
+	return true;
+#else
+	return false;
+#endif
+	}
+
+
+void GLShaderManager::DeleteTransformRing(void)
+	{
+#ifndef OPENGL_ES
+	for(unsigned int i = 0; i < GLT_TRANSFORM_RING_SEGMENTS; i++)
+		if(transformFences[i] != 0) {
+			glDeleteSync(transformFences[i]);
+			transformFences[i] = 0;
+			}
+
+	if(uiTransformBuffer != 0) {
+		glBindBuffer(GL_UNIFORM_BUFFER, uiTransformBuffer);
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glDeleteBuffers(1, &uiTransformBuffer);
+		}
+#endif
+	uiTransformBuffer = 0;
+	pTransformMap = NULL;
+	}
+
+
+///////////////////////////////////////////////////////////////////////
+// Copy the pending transforms into the next slot of the ring and bind it.
+// The ring is fenced in GLT_TRANSFORM_RING_SEGMENTS pieces. Moving into a
+// piece fences the one before it, since nothing drawn from here on can use
+// the slots there, and waits for the GPU to be done with this one, which
+// it normally long since is.
+void GLShaderManager::WriteTransforms(void)
+	{
+#ifndef OPENGL_ES
+	GLuint nSegmentSlots = nTransformSlots / GLT_TRANSFORM_RING_SEGMENTS;
+	nTransformSlot = (nTransformSlot + 1) % nTransformSlots;
+
+	if(nTransformSlot % nSegmentSlots == 0) {
+		GLuint iSegment = nTransformSlot / nSegmentSlots;
+		GLuint iPrevious = (iSegment + GLT_TRANSFORM_RING_SEGMENTS - 1) % GLT_TRANSFORM_RING_SEGMENTS;
+
+		if(transformFences[iPrevious] != 0)
+			glDeleteSync(transformFences[iPrevious]);
+		transformFences[iPrevious] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+		if(transformFences[iSegment] != 0) {
+			while(glClientWaitSync(transformFences[iSegment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+				;
+			glDeleteSync(transformFences[iSegment]);
+			transformFences[iSegment] = 0;
+			}
+		}
+
+	GLintptr nOffset = (GLintptr)nTransformStride * nTransformSlot;
+	memcpy(pTransformMap + nOffset, &pendingTransforms, sizeof(GLT_TRANSFORM_BLOCK));
+	glBindBufferRange(GL_UNIFORM_BUFFER, GLT_TRANSFORM_BLOCK_BINDING, uiTransformBuffer, nOffset, sizeof(GLT_TRANSFORM_BLOCK));
+#endif
+	bTransformsChanged = false;
+	}
+
+
+///////////////////////////////////////////////////////////////////////
+// An object's transforms, once for all the stock shaders that draw it
+void GLShaderManager::SetTransforms(const M3DMatrix44f mvMatrix, const M3DMatrix44f pMatrix, const M3DVector3f vLightPos)
+	{
+	if(pTransformMap == NULL)
+		return;
+
+	M3DMatrix44f mvpMatrix;
+	m3dMatrixMultiply44(mvpMatrix, pMatrix, mvMatrix);
+	StockTransform(GLT_UNIFORM_MVP_MATRIX, mvpMatrix, sizeof(M3DMatrix44f));
+	StockTransform(GLT_UNIFORM_MV_MATRIX, mvMatrix, sizeof(M3DMatrix44f));
+	StockTransform(GLT_UNIFORM_P_MATRIX, pMatrix, sizeof(M3DMatrix44f));
+	if(vLightPos != NULL)
+		StockTransform(GLT_UNIFORM_LIGHT_POSITION, vLightPos, sizeof(M3DVector3f));
+	CommitTransforms();
+	}
+
+
 ///////////////////////////////////////////////////////////////////////
 // Use a specific stock shader, and set the appropriate uniforms
 GLint GLShaderManager::UseStockShader(GLT_STOCK_SHADER nShaderID, ...)
@@ -366,10 +680,9 @@ GLint GLShaderManager::UseStockShader(GLT_STOCK_SHADER nShaderID, ...)
 	va_start(uniformList, nShaderID);
 
 	// Bind to the correct shader
-	glUseProgram(uiStockShaders[nShaderID]);
+	BindStockShader(nShaderID);
 
 	// Set up the uniforms
-	GLint iTransform, iModelMatrix, iProjMatrix, iColor, iLight, iTextureUnit;
 	int				iInteger;
 	M3DMatrix44f* mvpMatrix;
 	M3DMatrix44f*  pMatrix;
@@ -380,110 +693,92 @@ GLint GLShaderManager::UseStockShader(GLT_STOCK_SHADER nShaderID, ...)
 	switch(nShaderID)
 		{
 		case GLT_SHADER_FLAT:			// Just the modelview projection matrix and the color
-			iTransform = glGetUniformLocation(uiStockShaders[nShaderID], "mvpMatrix");
+		case GLT_SHADER_FLAT_INSTANCED:
 		    mvpMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iTransform, 1, GL_FALSE, *mvpMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MVP_MATRIX, *mvpMatrix);
 
-			iColor = glGetUniformLocation(uiStockShaders[nShaderID], "vColor");
 			vColor = va_arg(uniformList, M3DVector4f*);
-			glUniform4fv(iColor, 1, *vColor);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, *vColor);
 			break;
 
         case GLT_SHADER_TEXTURE_RECT_REPLACE:
 		case GLT_SHADER_TEXTURE_REPLACE:	// Just the texture place
-			iTransform = glGetUniformLocation(uiStockShaders[nShaderID], "mvpMatrix");
 		    mvpMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iTransform, 1, GL_FALSE, *mvpMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MVP_MATRIX, *mvpMatrix);
 
-			iTextureUnit = glGetUniformLocation(uiStockShaders[nShaderID], "textureUnit0");
 			iInteger = va_arg(uniformList, int);
-			glUniform1i(iTextureUnit, iInteger);
+			StockUniform1i(nShaderID, GLT_UNIFORM_TEXTURE_UNIT0, iInteger);
 			break;
 
 		case GLT_SHADER_TEXTURE_MODULATE: // Multiply the texture by the geometry color
-			iTransform = glGetUniformLocation(uiStockShaders[nShaderID], "mvpMatrix");
 		    mvpMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iTransform, 1, GL_FALSE, *mvpMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MVP_MATRIX, *mvpMatrix);
 
-			iColor = glGetUniformLocation(uiStockShaders[nShaderID], "vColor");
 			vColor = va_arg(uniformList, M3DVector4f*);
-			glUniform4fv(iColor, 1, *vColor);			
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, *vColor);
 
-			iTextureUnit = glGetUniformLocation(uiStockShaders[nShaderID], "textureUnit0");
 			iInteger = va_arg(uniformList, int);
-			glUniform1i(iTextureUnit, iInteger);
+			StockUniform1i(nShaderID, GLT_UNIFORM_TEXTURE_UNIT0, iInteger);
 			break;
 
 
 		case GLT_SHADER_DEFAULT_LIGHT:
-			iModelMatrix = glGetUniformLocation(uiStockShaders[nShaderID], "mvMatrix");
 		    mvMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iModelMatrix, 1, GL_FALSE, *mvMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MV_MATRIX, *mvMatrix);
 
-			iProjMatrix = glGetUniformLocation(uiStockShaders[nShaderID], "pMatrix");
 		    pMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iProjMatrix, 1, GL_FALSE, *pMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_P_MATRIX, *pMatrix);
 
-			iColor = glGetUniformLocation(uiStockShaders[nShaderID], "vColor");
 			vColor = va_arg(uniformList, M3DVector4f*);
-			glUniform4fv(iColor, 1, *vColor);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, *vColor);
 			break;
 
 		case GLT_SHADER_POINT_LIGHT_DIFF:
-			iModelMatrix = glGetUniformLocation(uiStockShaders[nShaderID], "mvMatrix");
+		case GLT_SHADER_POINT_LIGHT_DIFF_INSTANCED:
 		    mvMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iModelMatrix, 1, GL_FALSE, *mvMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MV_MATRIX, *mvMatrix);
 
-			iProjMatrix = glGetUniformLocation(uiStockShaders[nShaderID], "pMatrix");
 		    pMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iProjMatrix, 1, GL_FALSE, *pMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_P_MATRIX, *pMatrix);
 
-			iLight = glGetUniformLocation(uiStockShaders[nShaderID], "vLightPos");
 			vLightPos = va_arg(uniformList, M3DVector3f*);
-			glUniform3fv(iLight, 1, *vLightPos);
+			StockUniform3(nShaderID, GLT_UNIFORM_LIGHT_POSITION, *vLightPos);
 
-			iColor = glGetUniformLocation(uiStockShaders[nShaderID], "vColor");
 			vColor = va_arg(uniformList, M3DVector4f*);
-			glUniform4fv(iColor, 1, *vColor);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, *vColor);
 			break;			
 
 		case GLT_SHADER_TEXTURE_POINT_LIGHT_DIFF:
-			iModelMatrix = glGetUniformLocation(uiStockShaders[nShaderID], "mvMatrix");
 		    mvMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iModelMatrix, 1, GL_FALSE, *mvMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MV_MATRIX, *mvMatrix);
 
-			iProjMatrix = glGetUniformLocation(uiStockShaders[nShaderID], "pMatrix");
 		    pMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iProjMatrix, 1, GL_FALSE, *pMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_P_MATRIX, *pMatrix);
 
-			iLight = glGetUniformLocation(uiStockShaders[nShaderID], "vLightPos");
 			vLightPos = va_arg(uniformList, M3DVector3f*);
-			glUniform3fv(iLight, 1, *vLightPos);
+			StockUniform3(nShaderID, GLT_UNIFORM_LIGHT_POSITION, *vLightPos);
 
-			iColor = glGetUniformLocation(uiStockShaders[nShaderID], "vColor");
 			vColor = va_arg(uniformList, M3DVector4f*);
-			glUniform4fv(iColor, 1, *vColor);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, *vColor);
 
-			iTextureUnit = glGetUniformLocation(uiStockShaders[nShaderID], "textureUnit0");
 			iInteger = va_arg(uniformList, int);
-			glUniform1i(iTextureUnit, iInteger);
+			StockUniform1i(nShaderID, GLT_UNIFORM_TEXTURE_UNIT0, iInteger);
 			break;
 
 
 		case GLT_SHADER_SHADED:		// Just the modelview projection matrix. Color is an attribute
-			iTransform = glGetUniformLocation(uiStockShaders[nShaderID], "mvpMatrix");
 		    pMatrix = va_arg(uniformList, M3DMatrix44f*);
-			glUniformMatrix4fv(iTransform, 1, GL_FALSE, *pMatrix);
+			StockUniformMatrix4(nShaderID, GLT_UNIFORM_MVP_MATRIX, *pMatrix);
 			break;
 
 		case GLT_SHADER_IDENTITY:	// Just the Color
-			iColor = glGetUniformLocation(uiStockShaders[nShaderID], "vColor");
 			vColor = va_arg(uniformList, M3DVector4f*);
-			glUniform4fv(iColor, 1, *vColor);
+			StockUniform4(nShaderID, GLT_UNIFORM_COLOR, *vColor);
 		default:
 			break;
 		}
 	va_end(uniformList);
+	CommitTransforms();
 
 	return uiStockShaders[nShaderID];
 	}
@@ -500,6 +795,15 @@ GLuint GLShaderManager::GetStockShader(GLT_STOCK_SHADER nShaderID)
 	}
 
 
+GLint GLShaderManager::GetStockUniform(GLT_STOCK_SHADER nShaderID, GLT_STOCK_UNIFORM nUniform)
+	{
+	if(nShaderID >= GLT_SHADER_LAST || nUniform >= GLT_UNIFORM_LAST)
+		return -1;
+
+	return iStockUniforms[nShaderID][nUniform];
+	}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Lookup a previously loaded shader. If szFragProg == NULL, it is assumed to be
 // the same name as szVertexProg
@@ -580,86 +884,13 @@ GLuint GLShaderManager::LoadShaderPairWithAttributes(const char *szVertexProgFil
 
 	SHADERLOOKUPETRY shaderEntry;
 
-    // Temporary Shader objects
-    GLuint hVertexShader;
-    GLuint hFragmentShader;   
-    GLint testVal;
-	
-    // Create shader objects
-    hVertexShader = glCreateShader(GL_VERTEX_SHADER);
-    hFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	
-    // Load them. If fail clean up and return null
-    if(gltLoadShaderFile(szVertexProgFileName, hVertexShader) == false)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return 0;
-		}
-	
-    if(gltLoadShaderFile(szFragmentProgFileName, hFragmentShader) == false)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return 0;
-		}
-    
-    // Compile them
-    glCompileShader(hVertexShader);
-    glCompileShader(hFragmentShader);
-    
-    // Check for errors
-    glGetShaderiv(hVertexShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return 0;
-		}
-    
-    glGetShaderiv(hFragmentShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return 0;
-		}
-    
-    // Link them - assuming it works...
-	shaderEntry.uiShaderID = glCreateProgram();
-    glAttachShader(shaderEntry.uiShaderID, hVertexShader);
-    glAttachShader(shaderEntry.uiShaderID, hFragmentShader);
-
-
-	// List of attributes
+	// Compile and link them, binding the attributes
 	va_list attributeList;
 	va_start(attributeList, szFragmentProgFileName);
-
-	char *szNextArg;
-	int iArgCount = va_arg(attributeList, int);	// Number of attributes
-	for(int i = 0; i < iArgCount; i++)
-		{
-		int index = va_arg(attributeList, int);
-		szNextArg = va_arg(attributeList, char*);
-		glBindAttribLocation(shaderEntry.uiShaderID, index, szNextArg);
-		}
-
+	shaderEntry.uiShaderID = gltLoadShaderPairWithAttributesV(szVertexProgFileName, szFragmentProgFileName, attributeList);
 	va_end(attributeList);
-
-    glLinkProgram(shaderEntry.uiShaderID);
-	
-    // These are no longer needed
-    glDeleteShader(hVertexShader);
-    glDeleteShader(hFragmentShader);  
-    
-    // Make sure link worked too
-    glGetProgramiv(shaderEntry.uiShaderID, GL_LINK_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-		glDeleteProgram(shaderEntry.uiShaderID);
+	if(shaderEntry.uiShaderID == 0)
 		return 0;
-		}
-    
 
 	// Add it...
 	strncpy(shaderEntry.szVertexShaderName, szVertexProgFileName, MAX_SHADER_NAME_LENGTH);
@@ -680,74 +911,14 @@ GLuint GLShaderManager::LoadShaderPairSrcWithAttributes(const char *szName, cons
 
 	SHADERLOOKUPETRY shaderEntry;
 
-    // Temporary Shader objects
-    GLuint hVertexShader;
-    GLuint hFragmentShader;  
-    GLint testVal;
-	
-    // Create shader objects
-    hVertexShader = glCreateShader(GL_VERTEX_SHADER);
-    hFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	
-    // Load them. 
-    gltLoadShaderSrc(szVertexProg, hVertexShader);
-    gltLoadShaderSrc(szFragmentProg, hFragmentShader);
-   
-    // Compile them
-    glCompileShader(hVertexShader);
-    glCompileShader(hFragmentShader);
-    
-    // Check for errors
-    glGetShaderiv(hVertexShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return 0;
-		}
-    
-    glGetShaderiv(hFragmentShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return 0;
-		}
-    
-    // Link them - assuming it works...
-	shaderEntry.uiShaderID = glCreateProgram();
-    glAttachShader(shaderEntry.uiShaderID, hVertexShader);
-    glAttachShader(shaderEntry.uiShaderID, hFragmentShader);
-
-	// List of attributes
+	// Compile and link them, binding the attributes
 	va_list attributeList;
 	va_start(attributeList, szFragmentProg);
-
-	char *szNextArg;
-	int iArgCount = va_arg(attributeList, int);	// Number of attributes
-	for(int i = 0; i < iArgCount; i++)
-		{
-		int index = va_arg(attributeList, int);
-		szNextArg = va_arg(attributeList, char*);
-		glBindAttribLocation(shaderEntry.uiShaderID, index, szNextArg);
-		}
+	shaderEntry.uiShaderID = gltLoadShaderPairSrcWithAttributesV(szVertexProg, szFragmentProg, attributeList);
 	va_end(attributeList);
-
-
-    glLinkProgram(shaderEntry.uiShaderID);
-	
-    // These are no longer needed
-    glDeleteShader(hVertexShader);
-    glDeleteShader(hFragmentShader);  
-    
-    // Make sure link worked too
-    glGetProgramiv(shaderEntry.uiShaderID, GL_LINK_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-		glDeleteProgram(shaderEntry.uiShaderID);
+	if(shaderEntry.uiShaderID == 0)
 		return 0;
-		}
-     
+
 	// Add it...
 	strncpy(shaderEntry.szVertexShaderName, szName, MAX_SHADER_NAME_LENGTH);
 	strncpy(shaderEntry.szFragShaderName, szName, MAX_SHADER_NAME_LENGTH);
@@ -115,6 +115,23 @@ int gltIsExtSupported(const char *extension)
 	return 0;
 	}
 
+///////////////////////////////////////////////////////////////////////////////
+// Can buffer objects and vertex array objects be set up without binding
+// them? The extension check is only made on contexts older than 4.5.
+int gltIsDirectStateAccessSupported(void)
+	{
+	#ifndef OPENGL_ES
+	GLint nMajor = 0, nMinor = 0;
+	gltGetOpenGLVersion(nMajor, nMinor);
+	if(nMajor > 4 || (nMajor == 4 && nMinor >= 5))
+		return 1;
+
+	if(gltIsExtSupported("GL_ARB_direct_state_access") && gltIsExtSupported("GL_ARB_buffer_storage"))
+		return 1;
+	#endif
+	return 0;
+	}
+
 /////////////////////////////////////////////////////////////////////////////////
 // No-op on anything other than the Mac, sets the working directory to 
 // the /Resources folder
@@ -608,7 +625,9 @@ void gltMakeCylinder(GLTriangleBatch& cylinderBatch, GLfloat baseRadius, GLfloat
 // Make a cube, centered at the origin, and with a specified "radius"
 void gltMakeCube(GLBatch& cubeBatch, GLfloat fRadius )
     {
-    cubeBatch.Begin(GL_TRIANGLES, 36, 1);
+    // Four corners per face, each face has its own normal. The two
+    // triangles of a face share the corners on the diagonal.
+    cubeBatch.Begin(GL_TRIANGLES, 24, 1, 36);
             
     /////////////////////////////////////////////
     // Top of cube
@@ -624,14 +643,6 @@ void gltMakeCube(GLBatch& cubeBatch, GLfloat fRadius )
     cubeBatch.MultiTexCoord2f(0, 0.0f, 0.0f);
     cubeBatch.Vertex3f(-fRadius, fRadius, -fRadius);
     
-    cubeBatch.Normal3f(0.0f, fRadius, 0.0f);
-    cubeBatch.MultiTexCoord2f(0, fRadius, fRadius);
-    cubeBatch.Vertex3f(fRadius, fRadius, fRadius);
-    
-    cubeBatch.Normal3f(0.0f, fRadius, 0.0f);
-    cubeBatch.MultiTexCoord2f(0, 0.0f, 0.0f);
-    cubeBatch.Vertex3f(-fRadius, fRadius, -fRadius);
-    
     cubeBatch.Normal3f(0.0f, fRadius, 0.0f);
     cubeBatch.MultiTexCoord2f(0, 0.0f, fRadius);
     cubeBatch.Vertex3f(-fRadius, fRadius, fRadius);
@@ -655,14 +666,6 @@ void gltMakeCube(GLBatch& cubeBatch, GLfloat fRadius )
     cubeBatch.MultiTexCoord2f(0, 0.0f, fRadius);
     cubeBatch.Vertex3f(-fRadius, -fRadius, fRadius);
     
-    cubeBatch.Normal3f(0.0f, -fRadius, 0.0f);
-    cubeBatch.MultiTexCoord2f(0, 0.0f, 0.0f);
-    cubeBatch.Vertex3f(-fRadius, -fRadius, -fRadius);
-    
-    cubeBatch.Normal3f(0.0f, -fRadius, 0.0f);
-    cubeBatch.MultiTexCoord2f(0, fRadius, fRadius);
-    cubeBatch.Vertex3f(fRadius, -fRadius, fRadius);
-    
     ///////////////////////////////////////////
     // Left side of cube
     cubeBatch.Normal3f(-fRadius, 0.0f, 0.0f);
@@ -677,14 +680,6 @@ void gltMakeCube(GLBatch& cubeBatch, GLfloat fRadius )
     cubeBatch.MultiTexCoord2f(0, 0.0f, 0.0f);
     cubeBatch.Vertex3f(-fRadius, -fRadius, -fRadius);
     
-    cubeBatch.Normal3f(-fRadius, 0.0f, 0.0f);
-    cubeBatch.MultiTexCoord2f(0, fRadius, fRadius);
-    cubeBatch.Vertex3f(-fRadius, fRadius, fRadius);
-    
-    cubeBatch.Normal3f(-fRadius, 0.0f, 0.0f);
-    cubeBatch.MultiTexCoord2f(0, 0.0f, 0.0f);
-    cubeBatch.Vertex3f(-fRadius, -fRadius, -fRadius);
-    
     cubeBatch.Normal3f(-fRadius, 0.0f, 0.0f);
     cubeBatch.MultiTexCoord2f(0, 0.0f, fRadius);
     cubeBatch.Vertex3f(-fRadius, -fRadius, fRadius);
@@ -702,18 +697,10 @@ void gltMakeCube(GLBatch& cubeBatch, GLfloat fRadius )
     cubeBatch.MultiTexCoord2f(0, fRadius, fRadius);
     cubeBatch.Vertex3f(fRadius, fRadius, fRadius);
     
-    cubeBatch.Normal3f(fRadius, 0.0f, 0.0f);
-    cubeBatch.MultiTexCoord2f(0, fRadius, fRadius);
-    cubeBatch.Vertex3f(fRadius, fRadius, fRadius);
-    
     cubeBatch.Normal3f(fRadius, 0.0f, 0.0f);
     cubeBatch.MultiTexCoord2f(0, 0.0f, fRadius);
     cubeBatch.Vertex3f(fRadius, -fRadius, fRadius);
     
-    cubeBatch.Normal3f(fRadius, 0.0f, 0.0f);
-    cubeBatch.MultiTexCoord2f(0, 0.0f, 0.0f);
-    cubeBatch.Vertex3f(fRadius, -fRadius, -fRadius);
-    
     // Front and Back
     // Front
     cubeBatch.Normal3f(0.0f, 0.0f, fRadius);
@@ -728,18 +715,10 @@ void gltMakeCube(GLBatch& cubeBatch, GLfloat fRadius )
     cubeBatch.MultiTexCoord2f(0, 0.0f, fRadius);
     cubeBatch.Vertex3f(-fRadius, fRadius, fRadius);
     
-    cubeBatch.Normal3f(0.0f, 0.0f, fRadius);
-    cubeBatch.MultiTexCoord2f(0, 0.0f, fRadius);
-    cubeBatch.Vertex3f(-fRadius, fRadius, fRadius);
-    
     cubeBatch.Normal3f(0.0f, 0.0f, fRadius);
     cubeBatch.MultiTexCoord2f(0, 0.0f, 0.0f);
     cubeBatch.Vertex3f(-fRadius, -fRadius, fRadius);
     
-    cubeBatch.Normal3f(0.0f, 0.0f, fRadius);
-    cubeBatch.MultiTexCoord2f(0, fRadius, 0.0f);
-    cubeBatch.Vertex3f(fRadius, -fRadius, fRadius);
-    
     // Back
     cubeBatch.Normal3f(0.0f, 0.0f, -fRadius);
     cubeBatch.MultiTexCoord2f(0, fRadius, 0.0f);
@@ -753,17 +732,24 @@ void gltMakeCube(GLBatch& cubeBatch, GLfloat fRadius )
     cubeBatch.MultiTexCoord2f(0, 0.0f, fRadius);
     cubeBatch.Vertex3f(-fRadius, fRadius, -fRadius);
     
-    cubeBatch.Normal3f(0.0f, 0.0f, -fRadius);
-    cubeBatch.MultiTexCoord2f(0, 0.0f, fRadius);
-    cubeBatch.Vertex3f(-fRadius, fRadius, -fRadius);
-    
     cubeBatch.Normal3f(0.0f, 0.0f, -fRadius);
     cubeBatch.MultiTexCoord2f(0, fRadius, fRadius);
     cubeBatch.Vertex3f(fRadius, fRadius, -fRadius);
 
-	cubeBatch.Normal3f(0.0f, 0.0f, -fRadius);
-	cubeBatch.MultiTexCoord2f(0, fRadius, 0.0f);
-	cubeBatch.Vertex3f(fRadius, -fRadius, -fRadius);   
+    // Corners 0, 1, 2 and 0, 2, 3 of every face
+    GLuint cubeIndexes[36];
+    for(GLuint iFace = 0; iFace < 6; iFace++)
+        {
+        GLuint iCorner = iFace * 4;
+        cubeIndexes[iFace * 6 + 0] = iCorner;
+        cubeIndexes[iFace * 6 + 1] = iCorner + 1;
+        cubeIndexes[iFace * 6 + 2] = iCorner + 2;
+        cubeIndexes[iFace * 6 + 3] = iCorner;
+        cubeIndexes[iFace * 6 + 4] = iCorner + 2;
+        cubeIndexes[iFace * 6 + 5] = iCorner + 3;
+        }
+    cubeBatch.CopyIndexData(cubeIndexes);
+
     cubeBatch.End();
 	}	
 
@@ -1160,6 +1146,281 @@ bool gltLoadShaderFile(const char *szFile, GLuint shader)
     return true;
 	}   
 
+
+//////////////////////////////////////////////////////////////////////////
+// Program binary cache. Each linked program is one file in the cache
+// directory, named after its key: a header, the binary format, the length
+// and the binary itself. An empty directory name is off. It's kept short
+// enough to leave room in a path for the file name.
+#define GLT_CACHE_DIR_LENGTH	(FILENAME_MAX - 32)
+static char szProgramCacheDir[GLT_CACHE_DIR_LENGTH] = "";
+
+static const char szProgramCacheMagic[8] = { 'G', 'L', 'T', 'P', 'B', 'I', 'N', '1' };
+
+// 64 bit FNV-1a, added to a byte at a time
+#define GLT_FNV_OFFSET_BASIS	14695981039346656037ULL
+#define GLT_FNV_PRIME			1099511628211ULL
+
+static unsigned long long gltHashBytes(unsigned long long nHash, const void *pData, size_t nBytes)
+	{
+	const unsigned char *pBytes = (const unsigned char *)pData;
+	for(size_t i = 0; i < nBytes; i++) {
+		nHash ^= pBytes[i];
+		nHash *= GLT_FNV_PRIME;
+		}
+	return nHash;
+	}
+
+// Strings go in with their terminator, so "ab" "c" and "a" "bc" differ
+static unsigned long long gltHashString(unsigned long long nHash, const char *szString)
+	{
+	if(szString == NULL)
+		szString = "";
+	return gltHashBytes(nHash, szString, strlen(szString) + 1);
+	}
+
+static void gltProgramCachePath(char *szPath, unsigned long long nKey, const char *szExtension)
+	{
+	snprintf(szPath, FILENAME_MAX, "%s/%016llx.%s", szProgramCacheDir, nKey, szExtension);
+	}
+
+
+void gltSetProgramCacheDir(const char *szDir)
+	{
+	if(szDir == NULL)
+		szDir = "";
+	strncpy(szProgramCacheDir, szDir, GLT_CACHE_DIR_LENGTH - 1);
+	szProgramCacheDir[GLT_CACHE_DIR_LENGTH - 1] = '\0';
+	}
+
+
+//////////////////////////////////////////////////////////////////////////
+// Key for a program made of these shaders, read before they're compiled,
+// with these attribute bindings (the count, then index and name pairs, as
+// the loaders take them, NULL for none) on this driver. 0 when there's no
+// cache or the driver can't hand out program binaries. pAttributes is
+// left where it was.
+static unsigned long long gltProgramCacheKey(const GLuint *pShaders, int nShaders, va_list *pAttributes)
+	{
+	if(szProgramCacheDir[0] == '\0')
+		return 0;
+
+#ifndef OPENGL_ES
+	GLint nMajor = 0, nMinor = 0;
+	gltGetOpenGLVersion(nMajor, nMinor);
+	if((nMajor < 4 || (nMajor == 4 && nMinor < 1)) && !gltIsExtSupported("GL_ARB_get_program_binary"))
+		return 0;
+
+	GLint nFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nFormats);
+	if(nFormats == 0)
+		return 0;
+
+	// A new driver or a different GPU can't use the old binaries
+	unsigned long long nHash = GLT_FNV_OFFSET_BASIS;
+	nHash = gltHashString(nHash, (const char *)glGetString(GL_VENDOR));
+	nHash = gltHashString(nHash, (const char *)glGetString(GL_RENDERER));
+	nHash = gltHashString(nHash, (const char *)glGetString(GL_VERSION));
+	nHash = gltHashString(nHash, (const char *)glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+	for(int i = 0; i < nShaders; i++) {
+		GLint nType = 0, nLength = 0;
+		glGetShaderiv(pShaders[i], GL_SHADER_TYPE, &nType);
+		glGetShaderiv(pShaders[i], GL_SHADER_SOURCE_LENGTH, &nLength);
+
+		GLchar *szSource = new GLchar[nLength + 1];
+		szSource[0] = '\0';
+		glGetShaderSource(pShaders[i], nLength + 1, NULL, szSource);
+		nHash = gltHashBytes(nHash, &nType, sizeof(GLint));
+		nHash = gltHashString(nHash, szSource);
+		delete [] szSource;
+		}
+
+	// No attributes hashes the same as a count of 0
+	int iArgCount = 0;
+	va_list attributeList;
+	if(pAttributes != NULL) {
+		va_copy(attributeList, *pAttributes);
+		iArgCount = va_arg(attributeList, int);
+		}
+	nHash = gltHashBytes(nHash, &iArgCount, sizeof(int));
+	for(int i = 0; i < iArgCount; i++) {
+		int index = va_arg(attributeList, int);
+		nHash = gltHashBytes(nHash, &index, sizeof(int));
+		nHash = gltHashString(nHash, va_arg(attributeList, char*));
+		}
+	if(pAttributes != NULL)
+		va_end(attributeList);
+
+	// 0 is "not cached"
+	return (nHash != 0) ? nHash : 1;
+#else
+	return 0;
+#endif
+	}
+
+
+//////////////////////////////////////////////////////////////////////////
+// A program from the cache, or 0 if there isn't one. A binary the driver
+// won't take, or a file that doesn't look right, is thrown away so the
+// next successful link replaces it.
+static GLuint gltLoadCachedProgram(unsigned long long nKey)
+	{
+#ifndef OPENGL_ES
+	if(nKey == 0)
+		return 0;
+
+	char szPath[FILENAME_MAX];
+	gltProgramCachePath(szPath, nKey, "bin");
+	FILE *fp = fopen(szPath, "rb");
+	if(fp == NULL)
+		return 0;
+
+	char magic[sizeof(szProgramCacheMagic)];
+	GLenum format = 0;
+	GLint nLength = 0;
+	GLubyte *pBinary = NULL;
+	bool bRead = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, szProgramCacheMagic, sizeof(magic)) == 0 &&
+				 fread(&format, sizeof(GLenum), 1, fp) == 1 && fread(&nLength, sizeof(GLint), 1, fp) == 1 && nLength > 0;
+	if(bRead) {
+		pBinary = new GLubyte[nLength];
+		bRead = fread(pBinary, nLength, 1, fp) == 1;
+		}
+	fclose(fp);
+
+	// Only hand the driver a format it says it knows
+	GLuint hProgram = 0;
+	if(bRead) {
+		GLint nFormats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nFormats);
+		GLint *pFormats = new GLint[nFormats];
+		glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, pFormats);
+		for(GLint i = 0; i < nFormats; i++)
+			if((GLenum)pFormats[i] == format) {
+				hProgram = glCreateProgram();
+				break;
+				}
+		delete [] pFormats;
+		}
+
+	if(hProgram != 0) {
+		glProgramBinary(hProgram, format, pBinary, nLength);
+		GLint testVal = GL_FALSE;
+		glGetProgramiv(hProgram, GL_LINK_STATUS, &testVal);
+		if(testVal == GL_FALSE) {
+			glDeleteProgram(hProgram);
+			hProgram = 0;
+			}
+		}
+	delete [] pBinary;
+
+	if(hProgram == 0)
+		remove(szPath);
+
+	return hProgram;
+#else
+	return 0;
+#endif
+	}
+
+
+//////////////////////////////////////////////////////////////////////////
+// After a successful link. The file is written under another name and
+// renamed into place, so a crash or a second process never leaves half
+// a binary where the loader would find it.
+static void gltSaveCachedProgram(unsigned long long nKey, GLuint hProgram)
+	{
+#ifndef OPENGL_ES
+	if(nKey == 0)
+		return;
+
+	GLint nLength = 0;
+	glGetProgramiv(hProgram, GL_PROGRAM_BINARY_LENGTH, &nLength);
+	if(nLength <= 0)
+		return;
+
+	GLubyte *pBinary = new GLubyte[nLength];
+	GLenum format = 0;
+	GLsizei nWritten = 0;
+	glGetProgramBinary(hProgram, nLength, &nWritten, &format, pBinary);
+
+	char szPath[FILENAME_MAX], szTempPath[FILENAME_MAX];
+	gltProgramCachePath(szPath, nKey, "bin");
+	gltProgramCachePath(szTempPath, nKey, "tmp");
+
+	FILE *fp = (nWritten > 0) ? fopen(szTempPath, "wb") : NULL;
+	if(fp != NULL) {
+		GLint nSize = nWritten;
+		bool bWritten = fwrite(szProgramCacheMagic, sizeof(szProgramCacheMagic), 1, fp) == 1 &&
+						fwrite(&format, sizeof(GLenum), 1, fp) == 1 && fwrite(&nSize, sizeof(GLint), 1, fp) == 1 &&
+						fwrite(pBinary, nSize, 1, fp) == 1;
+		bWritten = (fclose(fp) == 0) && bWritten;
+
+		// rename() won't replace a file on Windows
+		if(bWritten && rename(szTempPath, szPath) != 0) {
+			remove(szPath);
+			bWritten = rename(szTempPath, szPath) == 0;
+			}
+		if(!bWritten)
+			remove(szTempPath);
+		}
+
+	delete [] pBinary;
+#endif
+	}
+
+//////////////////////////////////////////////////////////////////////////
+// Compile shaders that have their source loaded and link them, binding the
+// attributes in pAttributes (the count, then index and name pairs, or NULL
+// for none). With the program cache on, the program comes from the cache
+// when it's there and goes into it when it links. Returns 0 if a shader
+// doesn't compile, otherwise the program, which may still have failed to
+// link. The shaders are the caller's to check and delete.
+static GLuint gltBuildProgram(const GLuint *pShaders, int nShaders, va_list *pAttributes)
+	{
+	unsigned long long nCacheKey = gltProgramCacheKey(pShaders, nShaders, pAttributes);
+	GLuint hProgram = gltLoadCachedProgram(nCacheKey);
+	if(hProgram != 0)
+		return hProgram;
+
+	GLint testVal;
+	for(int i = 0; i < nShaders; i++)
+		glCompileShader(pShaders[i]);
+
+	for(int i = 0; i < nShaders; i++) {
+		glGetShaderiv(pShaders[i], GL_COMPILE_STATUS, &testVal);
+		if(testVal == GL_FALSE)
+			return 0;
+		}
+
+	hProgram = glCreateProgram();
+	for(int i = 0; i < nShaders; i++)
+		glAttachShader(hProgram, pShaders[i]);
+
+	// Now, we need to bind the attribute names to their specific locations
+	if(pAttributes != NULL) {
+		int iArgCount = va_arg(*pAttributes, int);	// Number of attributes
+		for(int i = 0; i < iArgCount; i++) {
+			int index = va_arg(*pAttributes, int);
+			char *szNextArg = va_arg(*pAttributes, char*);
+			glBindAttribLocation(hProgram, index, szNextArg);
+			}
+		}
+
+#ifndef OPENGL_ES
+	if(nCacheKey != 0)
+		glProgramParameteri(hProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
+	glLinkProgram(hProgram);
+
+	glGetProgramiv(hProgram, GL_LINK_STATUS, &testVal);
+	if(testVal != GL_FALSE)
+		gltSaveCachedProgram(nCacheKey, hProgram);
+
+	return hProgram;
+	}
+
+
 /////////////////////////////////////////////////////////////////
 // Load a pair of shaders, compile, and link together. Specify the complete
 // source text for each shader. After the shader names, specify the number
@@ -1174,32 +1435,22 @@ GLuint gltLoadShaderTripletWithAttributes(const char *szVertexShader,
     GLuint hFragmentShader = 0;
     GLuint hReturn = 0;
     GLint testVal;
-	int iArgCount;
+    GLuint hShaders[3];
+    int nShaders = 0;
+    va_list attributeList;
 
-    // Create shader objects
+    // Create shader objects and load them
     hVertexShader = glCreateShader(GL_VERTEX_SHADER);
     if (gltLoadShaderFile(szVertexShader, hVertexShader) == false)
         goto failed;
-    glCompileShader(hVertexShader);
-    glGetShaderiv(hVertexShader, GL_COMPILE_STATUS, &testVal);
-    if  (testVal == GL_FALSE) {
-        char infoLog[1024];
-        glGetShaderInfoLog(hVertexShader, 1024, NULL, infoLog);
-        goto failed;
-    }
+    hShaders[nShaders++] = hVertexShader;
 
     // Geometry shader is optional
     if (szGeometryShader) {
         hGeometryShader = glCreateShader(GL_GEOMETRY_SHADER);
         if(gltLoadShaderFile(szGeometryShader, hGeometryShader) == false)
             goto failed;
-        glCompileShader(hGeometryShader);
-        glGetShaderiv(hGeometryShader, GL_COMPILE_STATUS, &testVal);
-        if  (testVal == GL_FALSE) {
-            char infoLog[1024];
-            glGetShaderInfoLog(hGeometryShader, 1024, NULL, infoLog);
-            goto failed;
-        }
+        hShaders[nShaders++] = hGeometryShader;
     }
 
     // Fragment shader is optional (transform feedback only)
@@ -1207,41 +1458,15 @@ GLuint gltLoadShaderTripletWithAttributes(const char *szVertexShader,
         hFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
         if (gltLoadShaderFile(szFragmentShader, hFragmentShader) == false)
             goto failed;
-        glCompileShader(hFragmentShader);
-        glGetShaderiv(hFragmentShader, GL_COMPILE_STATUS, &testVal);
-        if  (testVal == GL_FALSE) {
-            char infoLog[1024];
-            glGetShaderInfoLog(hFragmentShader, 1024, NULL, infoLog);
-            goto failed;
-        }
+        hShaders[nShaders++] = hFragmentShader;
     }
 
-    // Create the final program object, and attach the shaders
-    hReturn = glCreateProgram();
-    glAttachShader(hReturn, hVertexShader);
-    if (szGeometryShader)
-        glAttachShader(hReturn, hGeometryShader);
-    if (szFragmentShader)
-        glAttachShader(hReturn, hFragmentShader);
-
-    // Now, we need to bind the attribute names to their specific locations
-    // List of attributes
-    va_list attributeList;
+    // Compile and link them, binding the attributes that follow the names
     va_start(attributeList, szFragmentShader);
-
-    // Iterate over this argument list
-    char *szNextArg;
-    iArgCount = va_arg(attributeList, int);	// Number of attributes
-    for(int i = 0; i < iArgCount; i++)
-    {
-        int index = va_arg(attributeList, int);
-        szNextArg = va_arg(attributeList, char*);
-        glBindAttribLocation(hReturn, index, szNextArg);
-    }
+    hReturn = gltBuildProgram(hShaders, nShaders, &attributeList);
     va_end(attributeList);
-
-    // Attempt to link    
-    glLinkProgram(hReturn);
+    if (hReturn == 0)
+        goto failed;
 
     // These are no longer needed
     glDeleteShader(hVertexShader);
@@ -1277,13 +1502,24 @@ failed:
 // of attributes, followed by the index and attribute name of each attribute
 GLuint gltLoadShaderPairWithAttributes(const char *szVertexProg, const char *szFragmentProg, ...)
 	{
+	va_list attributeList;
+	va_start(attributeList, szFragmentProg);
+	GLuint hReturn = gltLoadShaderPairWithAttributesV(szVertexProg, szFragmentProg, attributeList);
+	va_end(attributeList);
+
+	return hReturn;
+	}
+
+GLuint gltLoadShaderPairWithAttributesV(const char *szVertexProg, const char *szFragmentProg, va_list attributeList)
+	{
     // Temporary Shader objects
-    GLuint hVertexShader;
-    GLuint hFragmentShader; 
+    GLuint hShaders[2];
     GLuint hReturn = 0;   
     GLint testVal;
 	
     // Create shader objects
+    GLuint &hVertexShader = hShaders[0];
+    GLuint &hFragmentShader = hShaders[1];
     hVertexShader = glCreateShader(GL_VERTEX_SHADER);
     hFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
 	
@@ -1306,63 +1542,36 @@ GLuint gltLoadShaderPairWithAttributes(const char *szVertexProg, const char *szF
         return (GLuint)NULL;
 		}
     
-    // Compile them both
-    glCompileShader(hVertexShader);
-    glCompileShader(hFragmentShader);
-    
-    // Check for errors in vertex shader
-    glGetShaderiv(hVertexShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-		char infoLog[1024];
-		glGetShaderInfoLog(hVertexShader, 1024, NULL, infoLog);
-		fprintf(stderr, "The shader at %s failed to compile with the following error:\n%s\n", szVertexProg, infoLog);
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return (GLuint)NULL;
-		}
-    
-    // Check for errors in fragment shader
-    glGetShaderiv(hFragmentShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-		char infoLog[1024];
-		glGetShaderInfoLog(hFragmentShader, 1024, NULL, infoLog);
-		fprintf(stderr, "The shader at %s failed to compile with the following error:\n%s\n", szFragmentProg, infoLog);
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return (GLuint)NULL;
-		}
-    
-    // Create the final program object, and attach the shaders
-    hReturn = glCreateProgram();
-    glAttachShader(hReturn, hVertexShader);
-    glAttachShader(hReturn, hFragmentShader);
-
+    // Compile them both and link them, binding the attributes
+	va_list attributes;
+	va_copy(attributes, attributeList);
+    hReturn = gltBuildProgram(hShaders, 2, &attributes);
+	va_end(attributes);
 
-    // Now, we need to bind the attribute names to their specific locations
-	// List of attributes
-	va_list attributeList;
-	va_start(attributeList, szFragmentProg);
-
-    // Iterate over this argument list
-	char *szNextArg;
-	int iArgCount = va_arg(attributeList, int);	// Number of attributes
-	for(int i = 0; i < iArgCount; i++)
+    if(hReturn == 0)
 		{
-		int index = va_arg(attributeList, int);
-		szNextArg = va_arg(attributeList, char*);
-		glBindAttribLocation(hReturn, index, szNextArg);
+		// Check for errors in vertex shader, then in fragment shader
+		char infoLog[1024];
+		glGetShaderiv(hVertexShader, GL_COMPILE_STATUS, &testVal);
+		if(testVal == GL_FALSE)
+			{
+			glGetShaderInfoLog(hVertexShader, 1024, NULL, infoLog);
+			fprintf(stderr, "The shader at %s failed to compile with the following error:\n%s\n", szVertexProg, infoLog);
+			}
+		else
+			{
+			glGetShaderInfoLog(hFragmentShader, 1024, NULL, infoLog);
+			fprintf(stderr, "The shader at %s failed to compile with the following error:\n%s\n", szFragmentProg, infoLog);
+			}
 		}
-	va_end(attributeList);
-
-    // Attempt to link    
-    glLinkProgram(hReturn);
 	
     // These are no longer needed
     glDeleteShader(hVertexShader);
     glDeleteShader(hFragmentShader);  
     
+    if(hReturn == 0)
+        return (GLuint)NULL;
+
     // Make sure link worked too
     glGetProgramiv(hReturn, GL_LINK_STATUS, &testVal);
     if(testVal == GL_FALSE)
@@ -1386,12 +1595,13 @@ GLuint gltLoadShaderPairWithAttributes(const char *szVertexProg, const char *szF
 GLuint gltLoadShaderPair(const char *szVertexProg, const char *szFragmentProg)
 	{
     // Temporary Shader objects
-    GLuint hVertexShader;
-    GLuint hFragmentShader; 
+    GLuint hShaders[2];
     GLuint hReturn = 0;   
     GLint testVal;
 	
     // Create shader objects
+    GLuint &hVertexShader = hShaders[0];
+    GLuint &hFragmentShader = hShaders[1];
     hVertexShader = glCreateShader(GL_VERTEX_SHADER);
     hFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
 	
@@ -1410,38 +1620,16 @@ GLuint gltLoadShaderPair(const char *szVertexProg, const char *szFragmentProg)
         return (GLuint)NULL;
 		}
     
-    // Compile them
-    glCompileShader(hVertexShader);
-    glCompileShader(hFragmentShader);
-    
-    // Check for errors
-    glGetShaderiv(hVertexShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return (GLuint)NULL;
-		}
-    
-    glGetShaderiv(hFragmentShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return (GLuint)NULL;
-		}
-    
-    // Link them - assuming it works...
-    hReturn = glCreateProgram();
-    glAttachShader(hReturn, hVertexShader);
-    glAttachShader(hReturn, hFragmentShader);
-
-    glLinkProgram(hReturn);
+    // Compile and link them
+    hReturn = gltBuildProgram(hShaders, 2, NULL);
 	
     // These are no longer needed
     glDeleteShader(hVertexShader);
     glDeleteShader(hFragmentShader);  
     
+    if(hReturn == 0)
+        return (GLuint)NULL;
+
     // Make sure link worked too
     glGetProgramiv(hReturn, GL_LINK_STATUS, &testVal);
     if(testVal == GL_FALSE)
@@ -1538,50 +1726,28 @@ failed:
 GLuint gltLoadShaderPairSrc(const char *szVertexSrc, const char *szFragmentSrc)
 	{
     // Temporary Shader objects
-    GLuint hVertexShader;
-    GLuint hFragmentShader; 
+    GLuint hShaders[2];
     GLuint hReturn = 0;   
     GLint testVal;
 	
     // Create shader objects
-    hVertexShader = glCreateShader(GL_VERTEX_SHADER);
-    hFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    hShaders[0] = glCreateShader(GL_VERTEX_SHADER);
+    hShaders[1] = glCreateShader(GL_FRAGMENT_SHADER);
 	
     // Load them. 
-    gltLoadShaderSrc(szVertexSrc, hVertexShader);
-    gltLoadShaderSrc(szFragmentSrc, hFragmentShader);
+    gltLoadShaderSrc(szVertexSrc, hShaders[0]);
+    gltLoadShaderSrc(szFragmentSrc, hShaders[1]);
    
-    // Compile them
-    glCompileShader(hVertexShader);
-    glCompileShader(hFragmentShader);
-    
-    // Check for errors
-    glGetShaderiv(hVertexShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return (GLuint)NULL;
-		}
-    
-    glGetShaderiv(hFragmentShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return (GLuint)NULL;
-		}
-    
-    // Link them - assuming it works...
-    hReturn = glCreateProgram();
-    glAttachShader(hReturn, hVertexShader);
-    glAttachShader(hReturn, hFragmentShader);
-    glLinkProgram(hReturn);
+    // Compile and link them
+    hReturn = gltBuildProgram(hShaders, 2, NULL);
 	
     // These are no longer needed
-    glDeleteShader(hVertexShader);
-    glDeleteShader(hFragmentShader);  
+    glDeleteShader(hShaders[0]);
+    glDeleteShader(hShaders[1]);  
     
+    if(hReturn == 0)
+        return (GLuint)NULL;
+
     // Make sure link worked too
     glGetProgramiv(hReturn, GL_LINK_STATUS, &testVal);
     if(testVal == GL_FALSE)
@@ -1599,67 +1765,42 @@ GLuint gltLoadShaderPairSrc(const char *szVertexSrc, const char *szFragmentSrc)
 // just loading say a vertex program... you have to do both.
 GLuint gltLoadShaderPairSrcWithAttributes(const char *szVertexSrc, const char *szFragmentSrc, ...)
 	{
+	va_list attributeList;
+	va_start(attributeList, szFragmentSrc);
+	GLuint hReturn = gltLoadShaderPairSrcWithAttributesV(szVertexSrc, szFragmentSrc, attributeList);
+	va_end(attributeList);
+
+	return hReturn;
+	}
+
+GLuint gltLoadShaderPairSrcWithAttributesV(const char *szVertexSrc, const char *szFragmentSrc, va_list attributeList)
+	{
     // Temporary Shader objects
-    GLuint hVertexShader;
-    GLuint hFragmentShader; 
+    GLuint hShaders[2];
     GLuint hReturn = 0;   
     GLint testVal;
 	
     // Create shader objects
-    hVertexShader = glCreateShader(GL_VERTEX_SHADER);
-    hFragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    hShaders[0] = glCreateShader(GL_VERTEX_SHADER);
+    hShaders[1] = glCreateShader(GL_FRAGMENT_SHADER);
 	
     // Load them. 
-    gltLoadShaderSrc(szVertexSrc, hVertexShader);
-    gltLoadShaderSrc(szFragmentSrc, hFragmentShader);
+    gltLoadShaderSrc(szVertexSrc, hShaders[0]);
+    gltLoadShaderSrc(szFragmentSrc, hShaders[1]);
    
-    // Compile them
-    glCompileShader(hVertexShader);
-    glCompileShader(hFragmentShader);
-    
-    // Check for errors
-    glGetShaderiv(hVertexShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return (GLuint)NULL;
-		}
-    
-    glGetShaderiv(hFragmentShader, GL_COMPILE_STATUS, &testVal);
-    if(testVal == GL_FALSE)
-		{
-        glDeleteShader(hVertexShader);
-        glDeleteShader(hFragmentShader);
-        return (GLuint)NULL;
-		}
-    
-    // Link them - assuming it works...
-    hReturn = glCreateProgram();
-    glAttachShader(hReturn, hVertexShader);
-    glAttachShader(hReturn, hFragmentShader);
-
-	// List of attributes
-	va_list attributeList;
-	va_start(attributeList, szFragmentSrc);
-
-	char *szNextArg;
-	int iArgCount = va_arg(attributeList, int);	// Number of attributes
-	for(int i = 0; i < iArgCount; i++)
-		{
-		int index = va_arg(attributeList, int);
-		szNextArg = va_arg(attributeList, char*);
-		glBindAttribLocation(hReturn, index, szNextArg);
-		}
-	va_end(attributeList);
-
-
-    glLinkProgram(hReturn);
+    // Compile and link them, binding the attributes
+	va_list attributes;
+	va_copy(attributes, attributeList);
+    hReturn = gltBuildProgram(hShaders, 2, &attributes);
+	va_end(attributes);
 	
     // These are no longer needed
-    glDeleteShader(hVertexShader);
-    glDeleteShader(hFragmentShader);  
+    glDeleteShader(hShaders[0]);
+    glDeleteShader(hShaders[1]);  
     
+    if(hReturn == 0)
+        return (GLuint)NULL;
+
     // Make sure link worked too
     glGetProgramiv(hReturn, GL_LINK_STATUS, &testVal);
     if(testVal == GL_FALSE)
@@ -1672,8 +1813,6 @@ GLuint gltLoadShaderPairSrcWithAttributes(const char *szVertexSrc, const char *s
 	}   
 
 
-
-
 /////////////////////////////////////////////////////////////////
 // Check for any GL errors that may affect rendering
 // Check the framebuffer, the shader, and general errors
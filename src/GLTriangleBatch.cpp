@@ -34,8 +34,8 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
  *  container. The AddTriangle() function searches the current list of triangles
  *  and determines if the vertex/normal/texcoord is a duplicate. If so, it addes
  *  an entry to the index array instead of the list of vertices.
- *  When finished, call EndMesh() to free up extra unneeded memory that is reserved
- *  as workspace when you call BeginMesh().
+ *  When finished, call End() to hand back the workspace memory that BeginMesh()
+ *  borrowed from the mesh arena.
  *
  *  This class can easily be extended to contain other vertex attributes, and to 
  *  save itself and load itself from disk (thus forming the beginnings of a custom
@@ -45,6 +45,10 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 
 #include <GLTriangleBatch.h>
 #include <GLShaderManager.h>
+#include <GLMeshArena.h>
+#include <GLTools.h>
+#include <math.h>
+#include <thread>
 
 //////////////////////// TEMPORARY TEMPORARY TEMPORARY - On SnowLeopard this is suppored, but GLEW doens't hook up properly
 //////////////////////// Fixed probably in 10.6.3
@@ -54,6 +58,236 @@ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF S
 #define glBindVertexArray	glBindVertexArrayAPPLE
 #endif
 
+// How small a difference to equate when welding vertices
+#define WELD_EPSILON        0.00001f
+
+// The hash grid cells are a few epsilons wide, so a vertex can only match
+// something in its own cell or in the one neighbor it is closest to on each axis.
+#define WELD_CELL_SIZE      (4.0 * WELD_EPSILON)
+#define WELD_CELL_MARGIN    0.3
+
+// Cell coordinates are clamped to this, well inside what a long long holds
+#define WELD_CELL_LIMIT     1.0e15
+
+// The sort based weld in BuildMeshParallel() sorts 32 bit keys eleven bits
+// at a time, and doesn't bother starting a thread for less than this many vertices
+#define WELD_RADIX_BITS     11
+#define WELD_RADIX_SIZE     (1 << WELD_RADIX_BITS)
+#define WELD_MIN_PER_THREAD 16384
+
+
+///////////////////////////////////////////////////////////
+// Hash a grid cell coordinate into a bucket
+static inline GLuint HashCell(long long ix, long long iy, long long iz, GLuint nMask)
+    {
+    unsigned long long h = (unsigned long long)ix * 73856093ULL ^
+                           (unsigned long long)iy * 19349663ULL ^
+                           (unsigned long long)iz * 83492791ULL;
+    return (GLuint)(h ^ (h >> 29)) & nMask;
+    }
+
+///////////////////////////////////////////////////////////
+// A position along one axis in cell units. NaN, infinity, and anything too
+// far out to convert to a cell number end up in the edge cells, where the
+// full compare still decides what matches.
+static inline double CellCoord(float fPos)
+    {
+    double q = (double)fPos / WELD_CELL_SIZE;
+    if(!(q > -WELD_CELL_LIMIT))
+        return -WELD_CELL_LIMIT;
+    if(q > WELD_CELL_LIMIT)
+        return WELD_CELL_LIMIT;
+    return q;
+    }
+
+///////////////////////////////////////////////////////////
+// The bucket a vertex position is filed under
+static inline GLuint HashVertex(const M3DVector3f vVert, GLuint nMask)
+    {
+    return HashCell((long long)floor(CellCoord(vVert[0])),
+                    (long long)floor(CellCoord(vVert[1])),
+                    (long long)floor(CellCoord(vVert[2])), nMask);
+    }
+
+
+///////////////////////////////////////////////////////////
+// Snap one attribute to the nearest multiple of the weld epsilon. Values
+// too big for that, NaN and infinity included, are numbered past the end
+// of the range by their bits instead. Floats that large are much further
+// apart than the epsilon anyway, so only identical ones should match.
+static inline long long QuantizeCoord(float f)
+    {
+    double q = floor((double)f / WELD_EPSILON + 0.5);
+    if(q > -WELD_CELL_LIMIT && q < WELD_CELL_LIMIT)
+        return (long long)q;
+
+    GLuint nBits;
+    memcpy(&nBits, &f, sizeof(nBits));
+    return (1LL << 52) + nBits;
+    }
+
+///////////////////////////////////////////////////////////
+// Snap every attribute of a vertex to the weld epsilon grid. The normal
+// is made unit length first, as AddTriangle() does.
+static inline void QuantizeVertex(const M3DVector3f vVert, const M3DVector3f vNorm, const M3DVector2f vTexCoord, long long q[8])
+    {
+    M3DVector3f vUnit;
+    m3dCopyVector3(vUnit, vNorm);
+    m3dNormalizeVector3(vUnit);
+
+    for(int i = 0; i < 3; i++)
+        {
+        q[i] = QuantizeCoord(vVert[i]);
+        q[i+3] = QuantizeCoord(vUnit[i]);
+        }
+    q[6] = QuantizeCoord(vTexCoord[0]);
+    q[7] = QuantizeCoord(vTexCoord[1]);
+    }
+
+///////////////////////////////////////////////////////////
+// Sort key of a quantized vertex. Different vertices can share a key,
+// the weld sorts them next to each other and then compares for real.
+static inline GLuint WeldKey(const long long q[8])
+    {
+    unsigned long long h = 0;
+    for(int i = 0; i < 8; i++)
+        {
+        h = (h ^ (unsigned long long)q[i]) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+        }
+    return (GLuint)(h >> 32);
+    }
+
+///////////////////////////////////////////////////////////
+// Start of thread t's share of n items
+static inline GLuint WorkerSlice(GLuint n, GLuint t, GLuint nThreads)
+    {
+    return (GLuint)(((unsigned long long)n * t) / nThreads);
+    }
+
+///////////////////////////////////////////////////////////
+// Call job(t) once for each t in 0..nThreads-1, each on its own thread,
+// and wait for all of them. The calling thread does t = 0 itself.
+template <class JOB> static void RunWorkers(GLuint nThreads, JOB job)
+    {
+    std::thread *pWorkers = new std::thread[nThreads];
+    for(GLuint t = 1; t < nThreads; t++)
+        pWorkers[t] = std::thread(job, t);
+
+    job(0);
+
+    for(GLuint t = 1; t < nThreads; t++)
+        pWorkers[t].join();
+    delete [] pWorkers;
+    }
+
+
+///////////////////////////////////////////////////////////
+// One vertex of the packed layout, 16 bytes
+struct GLT_PACKED_VERTEX
+    {
+    GLshort position[4];    // Normalized, w is always 1
+    GLuint normal;          // GL_INT_2_10_10_10_REV, normalized
+    GLushort texCoord[2];   // Half floats
+    };
+
+///////////////////////////////////////////////////////////
+// Nearest half float to a float. Too big turns into infinity, too small
+// into a denormal or zero.
+static GLushort FloatToHalf(GLfloat f)
+    {
+    GLuint u;
+    memcpy(&u, &f, sizeof(GLuint));
+
+    GLushort sign = (GLushort)((u >> 16) & 0x8000);
+    GLint exponent = (GLint)((u >> 23) & 0xff) - 127 + 15;
+    GLuint mantissa = u & 0x7fffff;
+
+    if(exponent >= 31)
+        return sign | 0x7c00;
+
+    if(exponent <= 0)
+        {
+        if(exponent < -10)
+            return sign;
+
+        mantissa |= 0x800000;
+        GLuint nShift = 14 - exponent;
+        GLuint h = mantissa >> nShift;
+        GLuint nRest = mantissa & ((1u << nShift) - 1);
+        GLuint nHalf = 1u << (nShift - 1);
+        if(nRest > nHalf || (nRest == nHalf && (h & 1)))
+            h++;
+        return sign | (GLushort)h;
+        }
+
+    // Round to nearest even. Rounding can carry into the exponent, which
+    // is still the right answer.
+    GLuint h = ((GLuint)exponent << 10) | (mantissa >> 13);
+    GLuint nRest = mantissa & 0x1fff;
+    if(nRest > 0x1000 || (nRest == 0x1000 && (h & 1)))
+        h++;
+    return sign | (GLushort)h;
+    }
+
+///////////////////////////////////////////////////////////
+// Unit normal as three signed 10 bit normalized values
+static GLuint PackNormal(const M3DVector3f vNorm)
+    {
+    GLuint nPacked = 0;
+    for(int i = 0; i < 3; i++)
+        {
+        GLint v = (GLint)floor(vNorm[i] * 511.0f + 0.5f);
+        if(v > 511) v = 511;
+        if(v < -511) v = -511;
+        nPacked |= ((GLuint)v & 0x3ff) << (10 * i);
+        }
+    return nPacked;
+    }
+
+///////////////////////////////////////////////////////////
+// Can this context read the packed layout?
+static bool PackedLayoutSupported(void)
+    {
+    GLint nMajor = 0, nMinor = 0;
+    gltGetOpenGLVersion(nMajor, nMinor);
+    if(nMajor > 3 || (nMajor == 3 && nMinor >= 3))
+        return true;
+
+    return gltIsExtSupported("GL_ARB_vertex_type_2_10_10_10_rev") &&
+           (nMajor >= 3 || gltIsExtSupported("GL_ARB_half_float_vertex"));
+    }
+
+///////////////////////////////////////////////////////////
+// Attribute pointers for the single buffer layouts, read from whatever is
+// bound to GL_ARRAY_BUFFER. GLBufferPool pages use these too, which is
+// what lets every mesh of one format share a page.
+static void SetupInterleavedAttributes(void)
+    {
+    // Everything comes out of the one buffer, 32 bytes per vertex
+    GLsizei nStride = sizeof(GLfloat) * 8;
+    glEnableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
+    glEnableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
+    glEnableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0);
+    glVertexAttribPointer(GLT_ATTRIBUTE_VERTEX, 3, GL_FLOAT, GL_FALSE, nStride, 0);
+    glVertexAttribPointer(GLT_ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, nStride, (const GLvoid *)(sizeof(GLfloat) * 3));
+    glVertexAttribPointer(GLT_ATTRIBUTE_TEXTURE0, 2, GL_FLOAT, GL_FALSE, nStride, (const GLvoid *)(sizeof(GLfloat) * 6));
+    }
+
+#ifndef OPENGL_ES
+static void SetupPackedAttributes(void)
+    {
+    // One buffer again, but 16 bytes per vertex and everything normalized
+    GLsizei nStride = sizeof(GLT_PACKED_VERTEX);
+    glEnableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
+    glEnableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
+    glEnableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0);
+    glVertexAttribPointer(GLT_ATTRIBUTE_VERTEX, 4, GL_SHORT, GL_TRUE, nStride, 0);
+    glVertexAttribPointer(GLT_ATTRIBUTE_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE, nStride, (const GLvoid *)(sizeof(GLshort) * 4));
+    glVertexAttribPointer(GLT_ATTRIBUTE_TEXTURE0, 2, GL_HALF_FLOAT, GL_FALSE, nStride, (const GLvoid *)(sizeof(GLshort) * 4 + sizeof(GLuint)));
+    }
+#endif
+
 
 ///////////////////////////////////////////////////////////
 // Constructor, does what constructors do... set everything to zero or NULL
@@ -64,53 +298,305 @@ GLTriangleBatch::GLTriangleBatch(void)
     pNorms = NULL;
     pTexCoords = NULL;
     
+    pArena = GLMeshArena::GetDefault();
+    bBuilding = false;
+    bExternalArrays = false;
     nMaxIndexes = 0;
+    nMaxVerts = 0;
     nNumIndexes = 0;
     nNumVerts = 0;
+    indexType = GL_UNSIGNED_SHORT;
+    vertexLayout = GLT_LAYOUT_SEPARATE;
+    bPackedVertices = false;
+    m3dLoadIdentity44(positionMatrix);
+    bOptimizeCache = false;
+    bOptimizeFetch = false;
+    fACMR = 0.0f;
+
+    bufferObjects[VERTEX_DATA] = bufferObjects[NORMAL_DATA] = 0;
+    bufferObjects[TEXTURE_DATA] = bufferObjects[INDEX_DATA] = 0;
+    vertexArrayBufferObject = 0;
+
+    pBufferPool = NULL;
+    pBlockPool = NULL;
+    poolBlock.pPage = NULL;
+
+    weldMode = GLT_WELD_HASH_GRID;
+    pHashBuckets = NULL;
+    pHashNext = NULL;
+    nHashMask = 0;
+
+    bRetainGeometry = false;
+    pRetainedVerts = NULL;
+    pRetainedNorms = NULL;
+    pRetainedTexCoords = NULL;
+    pRetainedIndexes = NULL;
     }
     
 ////////////////////////////////////////////////////////////
-// Free any dynamically allocated memory. For those C programmers
-// coming to C++, it is perfectly valid to delete a NULL pointer.
+// Free any dynamically allocated memory. The workspace belongs to
+// the arena, we just have to say we're done with it.
 GLTriangleBatch::~GLTriangleBatch(void)
     {
-    // Just in case these still are allocated when the object is destroyed
-    delete [] pIndexes;
-    delete [] pVerts;
-    delete [] pNorms;
-    delete [] pTexCoords;
+    // Just in case a mesh is still being built when the object is destroyed
+    if(bBuilding)
+        pArena->Release();
+
+    FreeRetainedGeometry();
     
-    // Delete buffer objects
+    // Delete buffer objects, or give back the space in the pool
     glDeleteBuffers(4, bufferObjects);
+    if(pBlockPool != NULL)
+        pBlockPool->Free(poolBlock);
     
     #ifndef OPENGL_ES
-    glDeleteVertexArrays(1, &vertexArrayBufferObject);
+    if(vertexArrayBufferObject != 0)
+        glDeleteVertexArrays(1, &vertexArrayBufferObject);
     #endif
     }
     
 ////////////////////////////////////////////////////////////
-// Start assembling a mesh. You need to specify a maximum amount
-// of indexes that you expect. The EndMesh will clean up any uneeded
-// memory. This is far better than shreading your heap with STL containers...
-// At least that's my humble opinion.
-void GLTriangleBatch::BeginMesh(GLuint nMaxVerts)
+// Start assembling a mesh. nIndexHint is how many indexes you expect,
+// but it's only a starting size: the workspace grows if you go past it.
+// The workspace comes out of a mesh arena rather than the heap, and
+// End() hands it back so the next mesh can reuse the same memory.
+void GLTriangleBatch::BeginMesh(GLuint nIndexHint)
     {
     // Just in case this gets called more than once...
-    delete [] pIndexes;
-    delete [] pVerts;
-    delete [] pNorms;
-    delete [] pTexCoords;
-    
-    nMaxIndexes = nMaxVerts;
+    ReleaseWorkspace();
+    pArena->Acquire();
+    bBuilding = true;
+
+    if(nIndexHint < 48)
+        nIndexHint = 48;
+
     nNumIndexes = 0;
     nNumVerts = 0;
+    nMaxIndexes = nIndexHint;
+
+    // Welding usually leaves far fewer vertices than indexes (about
+    // one in six for a regular grid), so start the vertex arrays smaller
+    nMaxVerts = nIndexHint / 4;
     
-    // Allocate new blocks. In reality, the other arrays will be
-    // much shorter than the index array
-    pIndexes = new GLushort[nMaxIndexes];
-    pVerts = new M3DVector3f[nMaxIndexes];
-    pNorms = new M3DVector3f[nMaxIndexes];
-    pTexCoords = new M3DVector2f[nMaxIndexes];
+    pIndexes = (GLuint *)pArena->Alloc(sizeof(GLuint) * nMaxIndexes);
+    pVerts = (M3DVector3f *)pArena->Alloc(sizeof(M3DVector3f) * nMaxVerts);
+    pNorms = (M3DVector3f *)pArena->Alloc(sizeof(M3DVector3f) * nMaxVerts);
+    pTexCoords = (M3DVector2f *)pArena->Alloc(sizeof(M3DVector2f) * nMaxVerts);
+
+    // The hash grid gets at least one bucket per vertex
+    if(weldMode == GLT_WELD_HASH_GRID)
+        {
+        pHashNext = (GLuint *)pArena->Alloc(sizeof(GLuint) * nMaxVerts);
+        RehashVertices();
+        }
+    }
+
+
+////////////////////////////////////////////////////////////
+// Done with the workspace, give it back to the arena
+void GLTriangleBatch::ReleaseWorkspace(void)
+    {
+    if(bBuilding)
+        pArena->Release();
+    bBuilding = false;
+    bExternalArrays = false;
+
+    pIndexes = NULL;
+    pVerts = NULL;
+    pNorms = NULL;
+    pTexCoords = NULL;
+    pHashBuckets = NULL;
+    pHashNext = NULL;
+    }
+
+
+////////////////////////////////////////////////////////////
+// BeginMesh() only sets up the hash grid when it's asked for, so the
+// search can't change under a mesh that's half built
+void GLTriangleBatch::SetWeldMode(GLT_WELD_MODE mode)
+    {
+    if(bBuilding)
+        return;
+
+    weldMode = mode;
+    }
+
+
+////////////////////////////////////////////////////////////
+// Use a different arena for the workspace. Not while building a mesh.
+void GLTriangleBatch::SetMeshArena(GLMeshArena *pNewArena)
+    {
+    if(bBuilding)
+        return;
+
+    pArena = (pNewArena != NULL) ? pNewArena : GLMeshArena::GetDefault();
+    }
+
+
+////////////////////////////////////////////////////////////
+// Keep (or stop keeping) a copy of the mesh after End()
+void GLTriangleBatch::SetRetainGeometry(bool bRetain)
+    {
+    bRetainGeometry = bRetain;
+    if(!bRetain)
+        FreeRetainedGeometry();
+    }
+
+
+////////////////////////////////////////////////////////////
+// Copy the finished mesh out of the workspace. pIndexData is what went
+// into the index buffer, so it's already in indexType format.
+void GLTriangleBatch::RetainGeometry(const GLvoid *pIndexData)
+    {
+    GLuint nIndexSize = (indexType == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+
+    pRetainedVerts = new M3DVector3f[nNumVerts];
+    pRetainedNorms = new M3DVector3f[nNumVerts];
+    pRetainedTexCoords = new M3DVector2f[nNumVerts];
+    pRetainedIndexes = new GLubyte[nIndexSize * nNumIndexes];
+
+    memcpy(pRetainedVerts, pVerts, sizeof(M3DVector3f) * nNumVerts);
+    memcpy(pRetainedNorms, pNorms, sizeof(M3DVector3f) * nNumVerts);
+    memcpy(pRetainedTexCoords, pTexCoords, sizeof(M3DVector2f) * nNumVerts);
+    memcpy(pRetainedIndexes, pIndexData, nIndexSize * nNumIndexes);
+    }
+
+
+void GLTriangleBatch::FreeRetainedGeometry(void)
+    {
+    delete [] pRetainedVerts;
+    delete [] pRetainedNorms;
+    delete [] pRetainedTexCoords;
+    delete [] pRetainedIndexes;
+
+    pRetainedVerts = NULL;
+    pRetainedNorms = NULL;
+    pRetainedTexCoords = NULL;
+    pRetainedIndexes = NULL;
+    }
+
+
+////////////////////////////////////////////////////////////
+// Size the hash grid for the vertex capacity, and file the vertices
+// that are already there.
+void GLTriangleBatch::RehashVertices(void)
+    {
+    GLuint nBuckets = 16;
+    while(nBuckets < nMaxVerts)
+        nBuckets <<= 1;
+
+    nHashMask = nBuckets - 1;
+    pHashBuckets = (GLuint *)pArena->Alloc(sizeof(GLuint) * nBuckets);
+    memset(pHashBuckets, 0, sizeof(GLuint) * nBuckets);
+
+    for(GLuint v = 0; v < nNumVerts; v++)
+        {
+        GLuint iBucket = HashVertex(pVerts[v], nHashMask);
+        pHashNext[v] = pHashBuckets[iBucket];
+        pHashBuckets[iBucket] = v + 1;
+        }
+    }
+
+
+////////////////////////////////////////////////////////////
+// Out of room, double the index or vertex workspace
+void GLTriangleBatch::GrowIndexes(void)
+    {
+    GLuint nNewMax = nMaxIndexes * 2;
+    pIndexes = (GLuint *)pArena->Grow(pIndexes, sizeof(GLuint) * nNumIndexes, sizeof(GLuint) * nNewMax);
+    nMaxIndexes = nNewMax;
+    }
+
+void GLTriangleBatch::GrowVertices(void)
+    {
+    GLuint nNewMax = nMaxVerts * 2;
+    pVerts = (M3DVector3f *)pArena->Grow(pVerts, sizeof(M3DVector3f) * nNumVerts, sizeof(M3DVector3f) * nNewMax);
+    pNorms = (M3DVector3f *)pArena->Grow(pNorms, sizeof(M3DVector3f) * nNumVerts, sizeof(M3DVector3f) * nNewMax);
+    pTexCoords = (M3DVector2f *)pArena->Grow(pTexCoords, sizeof(M3DVector2f) * nNumVerts, sizeof(M3DVector2f) * nNewMax);
+    nMaxVerts = nNewMax;
+
+    if(pHashNext != NULL)
+        {
+        pHashNext = (GLuint *)pArena->Grow(pHashNext, sizeof(GLuint) * nNumVerts, sizeof(GLuint) * nNewMax);
+        RehashVertices();
+        }
+    }
+
+
+/////////////////////////////////////////////////////////////////
+// Look for a vertex that matches this one closely enough to be reused.
+// Returns the lowest matching index, or nNumVerts if there is none. 
+GLuint GLTriangleBatch::FindVertex(M3DVector3f vVert, M3DVector3f vNorm, M3DVector2f vTexCoord)
+    {
+    const float e = WELD_EPSILON;
+
+    if(weldMode == GLT_WELD_LINEAR)
+        {
+        for(GLuint iMatch = 0; iMatch < nNumVerts; iMatch++)
+            {
+            // If the vertex positions are the same
+            if(m3dCloseEnough(pVerts[iMatch][0], vVert[0], e) &&
+               m3dCloseEnough(pVerts[iMatch][1], vVert[1], e) &&
+               m3dCloseEnough(pVerts[iMatch][2], vVert[2], e) &&
+                   
+               // AND the Normal is the same...
+               m3dCloseEnough(pNorms[iMatch][0], vNorm[0], e) &&
+               m3dCloseEnough(pNorms[iMatch][1], vNorm[1], e) &&
+               m3dCloseEnough(pNorms[iMatch][2], vNorm[2], e) &&
+                   
+                // And Texture is the same...
+                m3dCloseEnough(pTexCoords[iMatch][0], vTexCoord[0], e) &&
+                m3dCloseEnough(pTexCoords[iMatch][1], vTexCoord[1], e))
+                return iMatch;
+            }
+        return nNumVerts;
+        }
+
+    // Which cell is the position in, and is it near enough to the edge
+    // of the cell that a match could be sitting in the neighbor?
+    long long iCell[3];
+    int iNeighbor[3];
+    for(int i = 0; i < 3; i++)
+        {
+        double q = CellCoord(vVert[i]);
+        double fCell = floor(q);
+        iCell[i] = (long long)fCell;
+        iNeighbor[i] = 0;
+        if(q - fCell < WELD_CELL_MARGIN)
+            iNeighbor[i] = -1;
+        else if(fCell + 1.0 - q < WELD_CELL_MARGIN)
+            iNeighbor[i] = 1;
+        }
+
+    // Check every combination of home/neighbor cell, keeping the lowest
+    // index so the result is the same as the linear scan.
+    GLuint iBest = nNumVerts;
+    for(int n = 0; n < 8; n++)
+        {
+        if(((n & 1) && iNeighbor[0] == 0) || ((n & 2) && iNeighbor[1] == 0) || ((n & 4) && iNeighbor[2] == 0))
+            continue;
+
+        GLuint iBucket = HashCell(iCell[0] + ((n & 1) ? iNeighbor[0] : 0),
+                                  iCell[1] + ((n & 2) ? iNeighbor[1] : 0),
+                                  iCell[2] + ((n & 4) ? iNeighbor[2] : 0), nHashMask);
+
+        for(GLuint iEntry = pHashBuckets[iBucket]; iEntry != 0; iEntry = pHashNext[iEntry-1])
+            {
+            GLuint iMatch = iEntry - 1;
+            if(iMatch < iBest &&
+               m3dCloseEnough(pVerts[iMatch][0], vVert[0], e) &&
+               m3dCloseEnough(pVerts[iMatch][1], vVert[1], e) &&
+               m3dCloseEnough(pVerts[iMatch][2], vVert[2], e) &&
+               m3dCloseEnough(pNorms[iMatch][0], vNorm[0], e) &&
+               m3dCloseEnough(pNorms[iMatch][1], vNorm[1], e) &&
+               m3dCloseEnough(pNorms[iMatch][2], vNorm[2], e) &&
+               m3dCloseEnough(pTexCoords[iMatch][0], vTexCoord[0], e) &&
+               m3dCloseEnough(pTexCoords[iMatch][1], vTexCoord[1], e))
+                iBest = iMatch;
+            }
+        }
+
+    return iBest;
     }
   
 /////////////////////////////////////////////////////////////////
@@ -120,8 +606,6 @@ void GLTriangleBatch::BeginMesh(GLuint nMaxVerts)
 // array grows by one as well.
 void GLTriangleBatch::AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3DVector2f vTexCoords[3])
     {
-    const  float e = 0.00001f; // How small a difference to equate
-
     // First thing we do is make sure the normals are unit length!
     // It's almost always a good idea to work with pre-normalized normals
     m3dNormalizeVector3(vNorms[0]);
@@ -132,101 +616,803 @@ void GLTriangleBatch::AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M
     // Search for match - triangle consists of three verts
     for(GLuint iVertex = 0; iVertex < 3; iVertex++)
         {
-        GLuint iMatch = 0;
-        for(iMatch = 0; iMatch < nNumVerts; iMatch++)
+        if(nNumIndexes == nMaxIndexes)
+            GrowIndexes();
+
+        GLuint iMatch = FindVertex(verts[iVertex], vNorms[iVertex], vTexCoords[iVertex]);
+        if(iMatch < nNumVerts)
             {
-            // If the vertex positions are the same
-            if(m3dCloseEnough(pVerts[iMatch][0], verts[iVertex][0], e) &&
-               m3dCloseEnough(pVerts[iMatch][1], verts[iVertex][1], e) &&
-               m3dCloseEnough(pVerts[iMatch][2], verts[iVertex][2], e) &&
-                   
-               // AND the Normal is the same...
-               m3dCloseEnough(pNorms[iMatch][0], vNorms[iVertex][0], e) &&
-               m3dCloseEnough(pNorms[iMatch][1], vNorms[iVertex][1], e) &&
-               m3dCloseEnough(pNorms[iMatch][2], vNorms[iVertex][2], e) &&
-                   
-                // And Texture is the same...
-                m3dCloseEnough(pTexCoords[iMatch][0], vTexCoords[iVertex][0], e) &&
-                m3dCloseEnough(pTexCoords[iMatch][1], vTexCoords[iVertex][1], e))
-                {
-                // Then add the index only
-                pIndexes[nNumIndexes] = iMatch;
-                nNumIndexes++;
-                break;
-                }
+            // Then add the index only
+            pIndexes[nNumIndexes] = iMatch;
+            nNumIndexes++;
+            continue;
             }
             
         // No match for this vertex, add to end of list
-        if(iMatch == nNumVerts && nNumVerts < nMaxIndexes && nNumIndexes < nMaxIndexes)
+        if(nNumVerts == nMaxVerts)
+            GrowVertices();
+
+        memcpy(pVerts[nNumVerts], verts[iVertex], sizeof(M3DVector3f));
+        memcpy(pNorms[nNumVerts], vNorms[iVertex], sizeof(M3DVector3f));
+        memcpy(pTexCoords[nNumVerts], vTexCoords[iVertex], sizeof(M3DVector2f));
+
+        // File it under its grid cell
+        if(pHashBuckets != NULL)
             {
-            memcpy(pVerts[nNumVerts], verts[iVertex], sizeof(M3DVector3f));
-            memcpy(pNorms[nNumVerts], vNorms[iVertex], sizeof(M3DVector3f));
-            memcpy(pTexCoords[nNumVerts], vTexCoords[iVertex], sizeof(M3DVector2f));
-            pIndexes[nNumIndexes] = nNumVerts;
-            nNumIndexes++; 
-            nNumVerts++;
-            }   
+            GLuint iBucket = HashVertex(verts[iVertex], nHashMask);
+            pHashNext[nNumVerts] = pHashBuckets[iBucket];
+            pHashBuckets[iBucket] = nNumVerts + 1;
+            }
+
+        pIndexes[nNumIndexes] = nNumVerts;
+        nNumIndexes++; 
+        nNumVerts++;
         }
     }
     
 
 
 //////////////////////////////////////////////////////////////////
-// Compact the data. This is a nice utility, but you should really
-// save the results of the indexing for future use if the model data
-// is static (doesn't change).
-void GLTriangleBatch::End(void)
+// Load a mesh that is already indexed. With no reordering requested the
+// caller's arrays are uploaded directly; otherwise End() needs its own
+// copy to rearrange.
+void GLTriangleBatch::LoadIndexedMesh(GLuint nVerts, M3DVector3f *verts, M3DVector3f *vNorms, M3DVector2f *vTexCoords,
+                                      GLuint nIndexes, GLuint *indexes)
+    {
+    // Toss anything left over from BeginMesh(). End() will want some
+    // scratch memory either way.
+    ReleaseWorkspace();
+    pArena->Acquire();
+    bBuilding = true;
+
+    nNumVerts = nVerts;
+    nNumIndexes = nIndexes - (nIndexes % 3);
+    nMaxIndexes = nNumIndexes;
+    nMaxVerts = nNumVerts;
+
+    if(!bOptimizeCache && !bOptimizeFetch)
+        {
+        pVerts = verts;
+        pNorms = vNorms;
+        pTexCoords = vTexCoords;
+        pIndexes = indexes;
+        bExternalArrays = true;
+        }
+    else
+        {
+        pVerts = (M3DVector3f *)pArena->Alloc(sizeof(M3DVector3f) * nNumVerts);
+        pNorms = (M3DVector3f *)pArena->Alloc(sizeof(M3DVector3f) * nNumVerts);
+        pTexCoords = (M3DVector2f *)pArena->Alloc(sizeof(M3DVector2f) * nNumVerts);
+        pIndexes = (GLuint *)pArena->Alloc(sizeof(GLuint) * nNumIndexes);
+        memcpy(pVerts, verts, sizeof(M3DVector3f) * nNumVerts);
+        memcpy(pNorms, vNorms, sizeof(M3DVector3f) * nNumVerts);
+        memcpy(pTexCoords, vTexCoords, sizeof(M3DVector2f) * nNumVerts);
+        memcpy(pIndexes, indexes, sizeof(GLuint) * nNumIndexes);
+        }
+
+    End();
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Weld a whole triangle soup at once, spread over nThreads threads.
+// Instead of looking up each vertex as it arrives, every vertex gets a key
+// from its quantized attributes and the keys are radix sorted, which lines
+// duplicates up next to each other. Each run of equal keys is then split
+// into distinct vertices, and the survivors are numbered in the order they
+// first appear in the input so the result looks like AddTriangle()'s.
+void GLTriangleBatch::BuildMeshParallel(GLuint nTriangles, M3DVector3f *verts, M3DVector3f *vNorms, M3DVector2f *vTexCoords,
+                                        GLuint nThreads)
+    {
+    ReleaseWorkspace();
+    pArena->Acquire();
+    bBuilding = true;
+
+    GLuint nInput = nTriangles * 3;
+
+    // One thread per core, unless there isn't enough work to go around
+    if(nThreads == 0)
+        nThreads = std::thread::hardware_concurrency();
+    if(nThreads > nInput / WELD_MIN_PER_THREAD)
+        nThreads = nInput / WELD_MIN_PER_THREAD;
+    if(nThreads == 0)
+        nThreads = 1;
+
+    GLuint *pKeys = (GLuint *)pArena->Alloc(sizeof(GLuint) * nInput);
+    GLuint *pIds = (GLuint *)pArena->Alloc(sizeof(GLuint) * nInput);
+    GLuint *pKeysOut = (GLuint *)pArena->Alloc(sizeof(GLuint) * nInput);
+    GLuint *pIdsOut = (GLuint *)pArena->Alloc(sizeof(GLuint) * nInput);
+    GLuint *pCounts = (GLuint *)pArena->Alloc(sizeof(GLuint) * WELD_RADIX_SIZE * nThreads);
+
+    // Key every input vertex
+    RunWorkers(nThreads, [&](GLuint t) {
+        GLuint iEnd = WorkerSlice(nInput, t+1, nThreads);
+        long long q[8];
+        for(GLuint i = WorkerSlice(nInput, t, nThreads); i < iEnd; i++)
+            {
+            QuantizeVertex(verts[i], vNorms[i], vTexCoords[i], q);
+            pKeys[i] = WeldKey(q);
+            pIds[i] = i;
+            }
+        });
+
+    // Least significant digit first radix sort. Each thread counts the digits
+    // in its slice, then scatters the slice to where the counts say it goes.
+    // Slices keep their order, so the sort is stable and equal keys stay in
+    // input order.
+    for(GLuint iShift = 0; iShift < 32; iShift += WELD_RADIX_BITS)
+        {
+        RunWorkers(nThreads, [&](GLuint t) {
+            GLuint *pCount = &pCounts[t * WELD_RADIX_SIZE];
+            memset(pCount, 0, sizeof(GLuint) * WELD_RADIX_SIZE);
+            GLuint iEnd = WorkerSlice(nInput, t+1, nThreads);
+            for(GLuint i = WorkerSlice(nInput, t, nThreads); i < iEnd; i++)
+                pCount[(pKeys[i] >> iShift) & (WELD_RADIX_SIZE - 1)]++;
+            });
+
+        // Turn the counts into starting positions, digit by digit and thread
+        // by thread within a digit. If every key has the same digit this pass
+        // wouldn't move anything.
+        GLuint nTotal = 0;
+        bool bSorted = false;
+        for(GLuint d = 0; d < WELD_RADIX_SIZE; d++)
+            {
+            GLuint nDigit = 0;
+            for(GLuint t = 0; t < nThreads; t++)
+                {
+                GLuint nCount = pCounts[t * WELD_RADIX_SIZE + d];
+                pCounts[t * WELD_RADIX_SIZE + d] = nTotal;
+                nTotal += nCount;
+                nDigit += nCount;
+                }
+            if(nDigit == nInput)
+                bSorted = true;
+            }
+        if(bSorted)
+            continue;
+
+        RunWorkers(nThreads, [&](GLuint t) {
+            GLuint *pNext = &pCounts[t * WELD_RADIX_SIZE];
+            GLuint iEnd = WorkerSlice(nInput, t+1, nThreads);
+            for(GLuint i = WorkerSlice(nInput, t, nThreads); i < iEnd; i++)
+                {
+                GLuint iDest = pNext[(pKeys[i] >> iShift) & (WELD_RADIX_SIZE - 1)]++;
+                pKeysOut[iDest] = pKeys[i];
+                pIdsOut[iDest] = pIds[i];
+                }
+            });
+
+        GLuint *pSwap = pKeys; pKeys = pKeysOut; pKeysOut = pSwap;
+        pSwap = pIds; pIds = pIdsOut; pIdsOut = pSwap;
+        }
+
+    // Split each run of equal keys into distinct vertices. pRep[i] is the
+    // lowest numbered input vertex that i welds to (itself if it's the first).
+    // Thread slices are pushed forward to the start of a run so no run is
+    // shared between two threads.
+    GLuint *pRep = pKeysOut;
+    RunWorkers(nThreads, [&](GLuint t) {
+        GLuint iStart = WorkerSlice(nInput, t, nThreads);
+        GLuint iEnd = WorkerSlice(nInput, t+1, nThreads);
+        while(iStart > 0 && iStart < nInput && pKeys[iStart] == pKeys[iStart-1])
+            iStart++;
+        while(iEnd < nInput && pKeys[iEnd] == pKeys[iEnd-1])
+            iEnd++;
+
+        long long q[8], qRun[8], qOther[8];
+        GLuint iRun = iStart;
+        for(GLuint j = iStart; j < iEnd; j++)
+            {
+            if(pKeys[j] != pKeys[iRun])
+                iRun = j;
+
+            GLuint id = pIds[j];
+            pRep[id] = id;
+            if(j == iRun)
+                {
+                QuantizeVertex(verts[id], vNorms[id], vTexCoords[id], qRun);
+                continue;
+                }
+
+            // Almost always the same as the first vertex of the run
+            QuantizeVertex(verts[id], vNorms[id], vTexCoords[id], q);
+            if(memcmp(q, qRun, sizeof(q)) == 0)
+                {
+                pRep[id] = pIds[iRun];
+                continue;
+                }
+
+            // Unless two different vertices happen to share a key
+            for(GLuint k = iRun + 1; k < j; k++)
+                {
+                GLuint idOther = pIds[k];
+                if(pRep[idOther] != idOther)
+                    continue;
+
+                QuantizeVertex(verts[idOther], vNorms[idOther], vTexCoords[idOther], qOther);
+                if(memcmp(q, qOther, sizeof(q)) == 0)
+                    {
+                    pRep[id] = idOther;
+                    break;
+                    }
+                }
+            }
+        });
+
+    // Number the surviving vertices in input order. Count them per slice
+    // first so every thread knows where its numbers start.
+    RunWorkers(nThreads, [&](GLuint t) {
+        GLuint nCount = 0;
+        GLuint iEnd = WorkerSlice(nInput, t+1, nThreads);
+        for(GLuint i = WorkerSlice(nInput, t, nThreads); i < iEnd; i++)
+            if(pRep[i] == i)
+                nCount++;
+        pCounts[t] = nCount;
+        });
+
+    nNumVerts = 0;
+    for(GLuint t = 0; t < nThreads; t++)
+        {
+        GLuint nCount = pCounts[t];
+        pCounts[t] = nNumVerts;
+        nNumVerts += nCount;
+        }
+
+    nMaxVerts = nNumVerts;
+    pVerts = (M3DVector3f *)pArena->Alloc(sizeof(M3DVector3f) * nNumVerts);
+    pNorms = (M3DVector3f *)pArena->Alloc(sizeof(M3DVector3f) * nNumVerts);
+    pTexCoords = (M3DVector2f *)pArena->Alloc(sizeof(M3DVector2f) * nNumVerts);
+
+    GLuint *pNewIndex = pIdsOut;
+    RunWorkers(nThreads, [&](GLuint t) {
+        GLuint iNext = pCounts[t];
+        GLuint iEnd = WorkerSlice(nInput, t+1, nThreads);
+        for(GLuint i = WorkerSlice(nInput, t, nThreads); i < iEnd; i++)
+            {
+            if(pRep[i] != i)
+                continue;
+
+            memcpy(pVerts[iNext], verts[i], sizeof(M3DVector3f));
+            m3dCopyVector3(pNorms[iNext], vNorms[i]);
+            m3dNormalizeVector3(pNorms[iNext]);
+            memcpy(pTexCoords[iNext], vTexCoords[i], sizeof(M3DVector2f));
+            pNewIndex[i] = iNext++;
+            }
+        });
+
+    // And finally the index list, one entry per input vertex
+    nNumIndexes = nInput;
+    nMaxIndexes = nInput;
+    pIndexes = (GLuint *)pArena->Alloc(sizeof(GLuint) * nInput);
+    RunWorkers(nThreads, [&](GLuint t) {
+        GLuint iEnd = WorkerSlice(nInput, t+1, nThreads);
+        for(GLuint i = WorkerSlice(nInput, t, nThreads); i < iEnd; i++)
+            pIndexes[i] = pNewIndex[pRep[i]];
+        });
+
+    End();
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Squeeze the vertices into the 16 byte packed format.
+// Positions are stored relative to the center of the bounding box, divided
+// by its largest half width so they all land in [-1, 1]. The scale is the
+// same on every axis so normals don't need any correction.
+const GLvoid *GLTriangleBatch::PackVertices(void)
+    {
+    M3DVector3f vMin = { 0.0f, 0.0f, 0.0f };
+    M3DVector3f vMax = { 0.0f, 0.0f, 0.0f };
+    if(nNumVerts != 0)
+        {
+        m3dCopyVector3(vMin, pVerts[0]);
+        m3dCopyVector3(vMax, pVerts[0]);
+        }
+    for(GLuint v = 1; v < nNumVerts; v++)
+        for(int i = 0; i < 3; i++)
+            {
+            if(pVerts[v][i] < vMin[i]) vMin[i] = pVerts[v][i];
+            if(pVerts[v][i] > vMax[i]) vMax[i] = pVerts[v][i];
+            }
+
+    M3DVector3f vCenter;
+    GLfloat fScale = 0.0f;
+    for(int i = 0; i < 3; i++)
+        {
+        vCenter[i] = (vMin[i] + vMax[i]) * 0.5f;
+        if((vMax[i] - vMin[i]) * 0.5f > fScale)
+            fScale = (vMax[i] - vMin[i]) * 0.5f;
+        }
+    if(fScale == 0.0f)
+        fScale = 1.0f;
+
+    GLT_PACKED_VERTEX *pPacked = (GLT_PACKED_VERTEX *)pArena->Alloc(sizeof(GLT_PACKED_VERTEX) * nNumVerts);
+    for(GLuint v = 0; v < nNumVerts; v++)
+        {
+        for(int i = 0; i < 3; i++)
+            {
+            GLint q = (GLint)floor((pVerts[v][i] - vCenter[i]) / fScale * 32767.0f + 0.5f);
+            if(q > 32767) q = 32767;
+            if(q < -32767) q = -32767;
+            pPacked[v].position[i] = (GLshort)q;
+            }
+        pPacked[v].position[3] = 32767;
+        pPacked[v].normal = PackNormal(pNorms[v]);
+        pPacked[v].texCoord[0] = FloatToHalf(pTexCoords[v][0]);
+        pPacked[v].texCoord[1] = FloatToHalf(pTexCoords[v][1]);
+        }
+
+    positionMatrix[0] = positionMatrix[5] = positionMatrix[10] = fScale;
+    positionMatrix[12] = vCenter[0];
+    positionMatrix[13] = vCenter[1];
+    positionMatrix[14] = vCenter[2];
+
+    return pPacked;
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Weave the three arrays together into one, 32 bytes per vertex
+const GLvoid *GLTriangleBatch::InterleaveVertices(void)
+    {
+    GLfloat *pInterleaved = (GLfloat *)pArena->Alloc(sizeof(GLfloat) * (nNumVerts * 8));
+    for(GLuint i = 0; i < nNumVerts; i++)
+        {
+        memcpy(&pInterleaved[i*8], pVerts[i], sizeof(M3DVector3f));
+        memcpy(&pInterleaved[i*8+3], pNorms[i], sizeof(M3DVector3f));
+        memcpy(&pInterleaved[i*8+6], pTexCoords[i], sizeof(M3DVector2f));
+        }
+
+    return pInterleaved;
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Reorder the triangles so vertices are reused while they are still in
+// the post-transform cache. This is Tipsify (Sander, Nehab and Barczak,
+// "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"):
+// fan around one vertex at a time, then hop to a neighbor that is still
+// in the cache, falling back to recently used vertices at a dead end.
+// It runs in linear time, so it's cheap enough to do on every build.
+void GLTriangleBatch::OptimizeVertexCache(void)
+    {
+    const GLuint k = GLT_VERTEX_CACHE_SIZE;
+    GLuint nNumTriangles = nNumIndexes / 3;
+    if(nNumTriangles == 0 || nNumVerts == 0)
+        return;
+
+    // Vertex to triangle adjacency. pOffsets[v] ... pOffsets[v+1] indexes the
+    // triangles that use v in pAdjacency.
+    GLuint *pLiveCount = (GLuint *)pArena->Alloc(sizeof(GLuint) * nNumVerts);     // Triangles not emitted yet, per vertex
+    GLuint *pOffsets = (GLuint *)pArena->Alloc(sizeof(GLuint) * (nNumVerts + 1));
+    GLuint *pAdjacency = (GLuint *)pArena->Alloc(sizeof(GLuint) * (nNumTriangles * 3));
+    memset(pLiveCount, 0, sizeof(GLuint) * nNumVerts);
+    for(GLuint i = 0; i < nNumTriangles * 3; i++)
+        pLiveCount[pIndexes[i]]++;
+
+    pOffsets[0] = 0;
+    for(GLuint v = 0; v < nNumVerts; v++)
+        pOffsets[v+1] = pOffsets[v] + pLiveCount[v];
+
+    GLuint *pFill = (GLuint *)pArena->Alloc(sizeof(GLuint) * nNumVerts);
+    memcpy(pFill, pOffsets, sizeof(GLuint) * nNumVerts);
+    for(GLuint i = 0; i < nNumTriangles * 3; i++)
+        pAdjacency[pFill[pIndexes[i]]++] = i / 3;
+
+    // Cache time stamps start far enough in the past to count as misses
+    GLuint *pCacheTime = (GLuint *)pArena->Alloc(sizeof(GLuint) * nNumVerts);
+    memset(pCacheTime, 0, sizeof(GLuint) * nNumVerts);
+    GLuint nTime = k + 1;
+
+    bool *pEmitted = (bool *)pArena->Alloc(sizeof(bool) * nNumTriangles);
+    memset(pEmitted, 0, sizeof(bool) * nNumTriangles);
+
+    GLuint *pDeadEnd = (GLuint *)pArena->Alloc(sizeof(GLuint) * (nNumTriangles * 3));   // Stack of recently used vertices
+    GLuint nDeadEnd = 0;
+    GLuint *pCandidates = (GLuint *)pArena->Alloc(sizeof(GLuint) * (nNumTriangles * 3));
+    GLuint *pOutput = (GLuint *)pArena->Alloc(sizeof(GLuint) * (nNumTriangles * 3));
+    GLuint nOutput = 0;
+    GLuint iCursor = 0;                                 // Scan position for the last resort search
+
+    GLint iFan = pIndexes[0];
+    while(iFan >= 0)
+        {
+        // Emit every remaining triangle around the fanning vertex
+        GLuint nCandidates = 0;
+        for(GLuint a = pOffsets[iFan]; a < pOffsets[iFan+1]; a++)
+            {
+            GLuint t = pAdjacency[a];
+            if(pEmitted[t])
+                continue;
+
+            for(GLuint c = 0; c < 3; c++)
+                {
+                GLuint v = pIndexes[t*3+c];
+                pOutput[nOutput++] = v;
+                pDeadEnd[nDeadEnd++] = v;
+                pCandidates[nCandidates++] = v;
+                pLiveCount[v]--;
+                if(nTime - pCacheTime[v] > k)
+                    pCacheTime[v] = nTime++;
+                }
+            pEmitted[t] = true;
+            }
+
+        // Pick the candidate that will still be in the cache after its
+        // remaining triangles are emitted, preferring the oldest one
+        iFan = -1;
+        GLint iBestPriority = -1;
+        for(GLuint n = 0; n < nCandidates; n++)
+            {
+            GLuint v = pCandidates[n];
+            if(pLiveCount[v] == 0)
+                continue;
+
+            GLint iPriority = 0;
+            if(nTime - pCacheTime[v] + 2 * pLiveCount[v] <= k)
+                iPriority = nTime - pCacheTime[v];
+
+            if(iPriority > iBestPriority)
+                {
+                iBestPriority = iPriority;
+                iFan = v;
+                }
+            }
+
+        // Dead end, back up through the recently used vertices, then
+        // just take the next vertex that still has triangles
+        while(iFan < 0 && nDeadEnd > 0)
+            {
+            GLuint v = pDeadEnd[--nDeadEnd];
+            if(pLiveCount[v] > 0)
+                iFan = v;
+            }
+
+        while(iFan < 0 && iCursor < nNumVerts)
+            {
+            if(pLiveCount[iCursor] > 0)
+                iFan = iCursor;
+            iCursor++;
+            }
+        }
+
+    pIndexes = pOutput;
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Move the vertices into the order the index buffer first references
+// them, and renumber the indexes to match. Do this after the triangles
+// have been put in their final order.
+void GLTriangleBatch::OptimizeVertexFetch(void)
+    {
+    if(nNumVerts == 0)
+        return;
+
+    // New number for each old vertex, nNumVerts means not placed yet
+    GLuint *pRemap = (GLuint *)pArena->Alloc(sizeof(GLuint) * nNumVerts);
+    for(GLuint v = 0; v < nNumVerts; v++)
+        pRemap[v] = nNumVerts;
+
+    M3DVector3f *pNewVerts = (M3DVector3f *)pArena->Alloc(sizeof(M3DVector3f) * nNumVerts);
+    M3DVector3f *pNewNorms = (M3DVector3f *)pArena->Alloc(sizeof(M3DVector3f) * nNumVerts);
+    M3DVector2f *pNewTexCoords = (M3DVector2f *)pArena->Alloc(sizeof(M3DVector2f) * nNumVerts);
+    GLuint nPlaced = 0;
+
+    for(GLuint i = 0; i < nNumIndexes; i++)
+        {
+        GLuint v = pIndexes[i];
+        if(pRemap[v] == nNumVerts)
+            {
+            memcpy(pNewVerts[nPlaced], pVerts[v], sizeof(M3DVector3f));
+            memcpy(pNewNorms[nPlaced], pNorms[v], sizeof(M3DVector3f));
+            memcpy(pNewTexCoords[nPlaced], pTexCoords[v], sizeof(M3DVector2f));
+            pRemap[v] = nPlaced++;
+            }
+        pIndexes[i] = pRemap[v];
+        }
+
+    // Anything no triangle uses goes on the end
+    for(GLuint v = 0; v < nNumVerts; v++)
+        if(pRemap[v] == nNumVerts)
+            {
+            memcpy(pNewVerts[nPlaced], pVerts[v], sizeof(M3DVector3f));
+            memcpy(pNewNorms[nPlaced], pNorms[v], sizeof(M3DVector3f));
+            memcpy(pNewTexCoords[nPlaced], pTexCoords[v], sizeof(M3DVector2f));
+            nPlaced++;
+            }
+
+    pVerts = pNewVerts;
+    pNorms = pNewNorms;
+    pTexCoords = pNewTexCoords;
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Run the index buffer through a simulated FIFO vertex cache and return
+// the number of misses (vertex shader runs) per triangle.
+GLfloat GLTriangleBatch::MeasureACMR(void)
+    {
+    GLuint nNumTriangles = nNumIndexes / 3;
+    if(nNumTriangles == 0)
+        return 0.0f;
+
+    // A vertex is in the cache if fewer than GLT_VERTEX_CACHE_SIZE other
+    // vertices have been loaded since it was.
+    GLuint *pLoadTime = (GLuint *)pArena->Alloc(sizeof(GLuint) * nNumVerts);
+    memset(pLoadTime, 0, sizeof(GLuint) * nNumVerts);
+    GLuint nMisses = GLT_VERTEX_CACHE_SIZE + 1;
+    GLuint nStart = nMisses;
+
+    for(GLuint i = 0; i < nNumTriangles * 3; i++)
+        {
+        GLuint v = pIndexes[i];
+        if(nMisses - pLoadTime[v] > GLT_VERTEX_CACHE_SIZE)
+            pLoadTime[v] = nMisses++;
+        }
+
+    return (GLfloat)(nMisses - nStart) / (GLfloat)nNumTriangles;
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Point the vertex attributes at the buffer objects. This is recorded in
+// the vertex array object, or done on every draw when there isn't one.
+void GLTriangleBatch::SetupVertexAttributes(void)
+    {
+    #ifndef OPENGL_ES
+    if(bPackedVertices)
+        {
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
+        SetupPackedAttributes();
+        }
+    else
+    #endif
+    if(vertexLayout != GLT_LAYOUT_SEPARATE)
+        {
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
+        SetupInterleavedAttributes();
+        }
+    else
+        {
+        glEnableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
+        glEnableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
+        glEnableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0);
+
+        // Vertex data
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
+        glVertexAttribPointer(GLT_ATTRIBUTE_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+        // Normal data
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[NORMAL_DATA]);
+        glVertexAttribPointer(GLT_ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+        // Texture coordinates
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[TEXTURE_DATA]);
+        glVertexAttribPointer(GLT_ATTRIBUTE_TEXTURE0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        }
+
+    // Indexes
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferObjects[INDEX_DATA]);
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Buffer objects of the batch's own, the classic way: bind each one and
+// fill it, then point the attributes at them.
+void GLTriangleBatch::CreateBuffers(const GLvoid *pVertexData, GLsizei nStride, const GLvoid *pIndexData, GLsizeiptr nIndexBytes)
     {
     #ifndef OPENGL_ES
 	// Create the master vertex array object
 	glGenVertexArrays(1, &vertexArrayBufferObject);
 	glBindVertexArray(vertexArrayBufferObject);
 	#endif
-    
-    // Create the buffer objects
-    glGenBuffers(4, bufferObjects);
-    
+
     // Copy data to video memory
-    // Vertex data
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
-	glEnableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*3, pVerts, GL_STATIC_DRAW);
-	glVertexAttribPointer(GLT_ATTRIBUTE_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    if(pVertexData != NULL && (bPackedVertices || vertexLayout != GLT_LAYOUT_SEPARATE))
+        {
+        glGenBuffers(1, &bufferObjects[VERTEX_DATA]);
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)nStride * nNumVerts, pVertexData, GL_STATIC_DRAW);
+        }
+    else
+        {
+        glGenBuffers(3, bufferObjects);
 
-    
-    // Normal data
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[NORMAL_DATA]);
-	glEnableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*3, pNorms, GL_STATIC_DRAW);
-	glVertexAttribPointer(GLT_ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    
-    // Texture coordinates
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[TEXTURE_DATA]);
-	glEnableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*2, pTexCoords, GL_STATIC_DRAW);
-	glVertexAttribPointer(GLT_ATTRIBUTE_TEXTURE0, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    
-    // Indexes
+        // Vertex data
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*3, pVerts, GL_STATIC_DRAW);
+
+        // Normal data
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[NORMAL_DATA]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*3, pNorms, GL_STATIC_DRAW);
+
+        // Texture coordinates
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[TEXTURE_DATA]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*2, pTexCoords, GL_STATIC_DRAW);
+        }
+
+    glGenBuffers(1, &bufferObjects[INDEX_DATA]);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferObjects[INDEX_DATA]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort)*nNumIndexes, pIndexes, GL_STATIC_DRAW);
-	
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, nIndexBytes, pIndexData, GL_STATIC_DRAW);
+
+    #ifndef OPENGL_ES
+    SetupVertexAttributes();
 
 	// Done
-#ifndef OPENGL_ES
 	glBindVertexArray(0);
+    #endif
+    }
+
+
+#ifndef OPENGL_ES
+//////////////////////////////////////////////////////////////////
+// One attribute of a vertex array object, read from vertex buffer binding
+// uiBinding nOffset bytes into each vertex
+static void VertexArrayAttribute(GLuint vertexArray, GLuint uiAttribute, GLuint uiBinding,
+                                 GLint nComponents, GLenum type, GLboolean bNormalized, GLuint nOffset)
+    {
+    glEnableVertexArrayAttrib(vertexArray, uiAttribute);
+    glVertexArrayAttribFormat(vertexArray, uiAttribute, nComponents, type, bNormalized, nOffset);
+    glVertexArrayAttribBinding(vertexArray, uiAttribute, uiBinding);
+    }
+
+//////////////////////////////////////////////////////////////////
+// The same objects with direct state access. The mesh never changes after
+// End(), so the buffers get immutable storage, which leaves the driver free
+// to put them wherever suits it. Nothing is bound along the way.
+void GLTriangleBatch::CreateImmutableBuffers(const GLvoid *pVertexData, GLsizei nStride, const GLvoid *pIndexData, GLsizeiptr nIndexBytes)
+    {
+    glCreateVertexArrays(1, &vertexArrayBufferObject);
+
+    if(pVertexData != NULL && (bPackedVertices || vertexLayout != GLT_LAYOUT_SEPARATE))
+        {
+        glCreateBuffers(1, &bufferObjects[VERTEX_DATA]);
+        glNamedBufferStorage(bufferObjects[VERTEX_DATA], (GLsizeiptr)nStride * nNumVerts, pVertexData, 0);
+        glVertexArrayVertexBuffer(vertexArrayBufferObject, 0, bufferObjects[VERTEX_DATA], 0, nStride);
+
+        if(bPackedVertices)
+            {
+            VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_VERTEX, 0, 4, GL_SHORT, GL_TRUE, 0);
+            VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_NORMAL, 0, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(GLshort) * 4);
+            VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_TEXTURE0, 0, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(GLshort) * 4 + sizeof(GLuint));
+            }
+        else
+            {
+            VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_VERTEX, 0, 3, GL_FLOAT, GL_FALSE, 0);
+            VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_NORMAL, 0, 3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 3);
+            VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_TEXTURE0, 0, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 6);
+            }
+        }
+    else
+        {
+        // One buffer and one binding per attribute
+        glCreateBuffers(3, bufferObjects);
+        glNamedBufferStorage(bufferObjects[VERTEX_DATA], sizeof(GLfloat)*nNumVerts*3, pVerts, 0);
+        glNamedBufferStorage(bufferObjects[NORMAL_DATA], sizeof(GLfloat)*nNumVerts*3, pNorms, 0);
+        glNamedBufferStorage(bufferObjects[TEXTURE_DATA], sizeof(GLfloat)*nNumVerts*2, pTexCoords, 0);
+
+        glVertexArrayVertexBuffer(vertexArrayBufferObject, 0, bufferObjects[VERTEX_DATA], 0, sizeof(GLfloat) * 3);
+        glVertexArrayVertexBuffer(vertexArrayBufferObject, 1, bufferObjects[NORMAL_DATA], 0, sizeof(GLfloat) * 3);
+        glVertexArrayVertexBuffer(vertexArrayBufferObject, 2, bufferObjects[TEXTURE_DATA], 0, sizeof(GLfloat) * 2);
+        VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_VERTEX, 0, 3, GL_FLOAT, GL_FALSE, 0);
+        VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_NORMAL, 1, 3, GL_FLOAT, GL_FALSE, 0);
+        VertexArrayAttribute(vertexArrayBufferObject, GLT_ATTRIBUTE_TEXTURE0, 2, 2, GL_FLOAT, GL_FALSE, 0);
+        }
+
+    glCreateBuffers(1, &bufferObjects[INDEX_DATA]);
+    glNamedBufferStorage(bufferObjects[INDEX_DATA], nIndexBytes, pIndexData, 0);
+    glVertexArrayElementBuffer(vertexArrayBufferObject, bufferObjects[INDEX_DATA]);
+    }
 #endif
-    
-    // Free older, larger arrays
-    delete [] pIndexes;
-    delete [] pVerts;
-    delete [] pNorms;
-    delete [] pTexCoords;
 
-    // Reasign pointers so they are marked as unused
-    pIndexes = NULL;
-    pVerts = NULL;
-    pNorms = NULL;
-    pTexCoords = NULL;
+
+//////////////////////////////////////////////////////////////////
+// Compact the data. This is a nice utility, but you should really
+// save the results of the indexing for future use if the model data
+// is static (doesn't change).
+void GLTriangleBatch::End(void)
+    {
+    // Nothing to finish?
+    if(!bBuilding)
+        return;
+
+    // If the batch is being rebuilt, let go of the last set of objects
+    glDeleteBuffers(4, bufferObjects);
+    bufferObjects[VERTEX_DATA] = bufferObjects[NORMAL_DATA] = 0;
+    bufferObjects[TEXTURE_DATA] = bufferObjects[INDEX_DATA] = 0;
+    if(pBlockPool != NULL)
+        {
+        pBlockPool->Free(poolBlock);
+        pBlockPool = NULL;
+        }
+    FreeRetainedGeometry();
+
+    #ifndef OPENGL_ES
+    if(vertexArrayBufferObject != 0)
+        {
+        glDeleteVertexArrays(1, &vertexArrayBufferObject);
+        vertexArrayBufferObject = 0;
+        }
+    #endif
+
+    // Reorder the triangles before they go anywhere
+    if(bOptimizeCache)
+        OptimizeVertexCache();
+    if(bOptimizeFetch)
+        OptimizeVertexFetch();
+    fACMR = MeasureACMR();
+
+    // The packed layout isn't available everywhere, interleaved is the
+    // next best thing
+    bPackedVertices = false;
+    m3dLoadIdentity44(positionMatrix);
+    #ifndef OPENGL_ES
+    if(vertexLayout == GLT_LAYOUT_PACKED && PackedLayoutSupported())
+        bPackedVertices = true;
+    #endif
+
+    // Vertex data for the single buffer layouts. The pool only takes those,
+    // so a separate mesh headed there is interleaved too.
+    const GLvoid *pVertexData = NULL;
+    GLsizei nStride = 0;
+    if(bPackedVertices)
+        {
+        pVertexData = PackVertices();
+        nStride = sizeof(GLT_PACKED_VERTEX);
+        }
+    else if(vertexLayout != GLT_LAYOUT_SEPARATE || pBufferPool != NULL)
+        {
+        pVertexData = InterleaveVertices();
+        nStride = sizeof(GLfloat) * 8;
+        }
+
+    // Indexes. Use the smaller type when every vertex can be reached with it.
+    const GLvoid *pIndexData = pIndexes;
+    GLsizeiptr nIndexBytes = sizeof(GLuint) * nNumIndexes;
+    indexType = GL_UNSIGNED_INT;
+    if(nNumVerts <= 65536)
+        {
+        GLushort *pShortIndexes = (GLushort *)pArena->Alloc(sizeof(GLushort) * nNumIndexes);
+        for(GLuint i = 0; i < nNumIndexes; i++)
+            pShortIndexes[i] = (GLushort)pIndexes[i];
+
+        indexType = GL_UNSIGNED_SHORT;
+        pIndexData = pShortIndexes;
+        nIndexBytes = sizeof(GLushort) * nNumIndexes;
+        }
+
+    // Hang on to a copy for the CPU
+    if(bRetainGeometry)
+        RetainGeometry(pIndexData);
+
+    // Try the shared pool first
+    #ifndef OPENGL_ES
+    if(pBufferPool != NULL && pVertexData != NULL)
+        {
+        GLT_POOL_ATTRIBUTE_SETUP pSetup = bPackedVertices ? SetupPackedAttributes : SetupInterleavedAttributes;
+        if(pBufferPool->Alloc(nStride, pSetup, nNumVerts, nIndexBytes, poolBlock))
+            {
+            pBufferPool->Upload(poolBlock, nNumVerts, pVertexData, nIndexBytes, pIndexData);
+            pBlockPool = pBufferPool;
+            }
+        }
+    #endif
+
+    if(pBlockPool == NULL)
+        {
+        // Immutable storage can't be empty
+        #ifndef OPENGL_ES
+        if(nNumVerts != 0 && nNumIndexes != 0 && gltIsDirectStateAccessSupported())
+            CreateImmutableBuffers(pVertexData, nStride, pIndexData, nIndexBytes);
+        else
+        #endif
+            CreateBuffers(pVertexData, nStride, pIndexData, nIndexBytes);
+        }
+    
+    // Hand the workspace back to the arena and mark the pointers unused.
+    // Arrays from LoadIndexedMesh() are the caller's and are left alone.
+    ReleaseWorkspace();
     
     // Unbind to anybody
     #ifndef OPENGL_ES
@@ -238,29 +1424,21 @@ void GLTriangleBatch::End(void)
 // Draw - make sure you call glEnableClientState for these arrays
 void GLTriangleBatch::Draw(void) 
 	{
+    // Pooled meshes draw with their page's vertex array object
+    if(pBlockPool != NULL)
+        {
+        pBlockPool->DrawElements(poolBlock, GL_TRIANGLES, nNumIndexes, indexType);
+        return;
+        }
+
     #ifndef OPENGL_ES
 	glBindVertexArray(vertexArrayBufferObject);
     #else
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
-    glEnableVertexAttribArray(GLT_ATTRIBUTE_VERTEX);
-    glVertexAttribPointer(GLT_ATTRIBUTE_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
-        
-    // Normal data
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[NORMAL_DATA]);
-    glEnableVertexAttribArray(GLT_ATTRIBUTE_NORMAL);
-    glVertexAttribPointer(GLT_ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    
-    // Texture coordinates
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[TEXTURE_DATA]);
-    glEnableVertexAttribArray(GLT_ATTRIBUTE_TEXTURE0);
-    glVertexAttribPointer(GLT_ATTRIBUTE_TEXTURE0, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    
-    // Indexes
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferObjects[INDEX_DATA]);
+    SetupVertexAttributes();
     #endif
 
 
-    glDrawElements(GL_TRIANGLES, nNumIndexes, GL_UNSIGNED_SHORT, 0);
+    glDrawElements(GL_TRIANGLES, nNumIndexes, indexType, 0);
     
     #ifndef OPENGL_ES
     // Unbind to anybody
@@ -273,3 +1451,32 @@ void GLTriangleBatch::Draw(void)
 	}    
 
 
+//////////////////////////////////////////////////////////////////////////
+// Every instance in one call, or one Draw() each without instancing
+void GLTriangleBatch::DrawInstanced(GLInstanceArray &instances)
+    {
+    #ifndef OPENGL_ES
+    if(instances.IsSupported())
+        {
+        if(instances.GetInstanceCount() == 0)
+            return;
+
+        if(pBlockPool != NULL)
+            {
+            pBlockPool->DrawElements(poolBlock, GL_TRIANGLES, nNumIndexes, indexType, &instances);
+            return;
+            }
+
+        glBindVertexArray(vertexArrayBufferObject);
+        instances.Bind();
+        glDrawElementsInstanced(GL_TRIANGLES, nNumIndexes, indexType, 0, instances.GetInstanceCount());
+        instances.Unbind();
+        glBindVertexArray(0);
+        return;
+        }
+    #endif
+
+    GLBatchBase::DrawInstanced(instances);
+    }
+
+
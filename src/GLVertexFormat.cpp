@@ -0,0 +1,126 @@
+/*
+GLVertexFormat.cpp
+ 
+Copyright (c) 2009, Richard S. Wright Jr.
+GLTools Open Source Library
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this list 
+of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this list 
+of conditions and the following disclaimer in the documentation and/or other 
+materials provided with the distribution.
+
+Neither the name of Richard S. Wright Jr. nor the names of other contributors may be used 
+to endorse or promote products derived from this software without specific prior 
+written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES 
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT 
+SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <GLVertexFormat.h>
+
+
+GLVertexFormat::GLVertexFormat(void): nAttributes(0), nEnd(0), nStride(0)
+	{
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Attributes are kept 4 byte aligned, some hardware fetches anything else
+// slowly or not at all
+bool GLVertexFormat::AddAttribute(GLuint uiIndex, GLint nComponents, GLenum type, GLboolean bNormalized)
+	{
+	return AddAttribute(uiIndex, nComponents, type, bNormalized, (nEnd + 3) & ~3u);
+	}
+
+bool GLVertexFormat::AddAttribute(GLuint uiIndex, GLint nComponents, GLenum type, GLboolean bNormalized, GLuint nOffset)
+	{
+	if(nAttributes == GLT_MAX_FORMAT_ATTRIBUTES || nComponents < 1 || nComponents > 4)
+		return false;
+
+	GLT_VERTEX_ATTRIBUTE &attribute = attributes[nAttributes++];
+	attribute.uiIndex = uiIndex;
+	attribute.nComponents = nComponents;
+	attribute.type = type;
+	attribute.bNormalized = bNormalized;
+	attribute.nOffset = nOffset;
+
+	// The packed types hold the whole attribute in one 32 bit word
+	GLuint nSize = TypeSize(type);
+	GLuint nBytes = (nSize != 0) ? nSize * nComponents : 4;
+	if(nOffset + nBytes > nEnd)
+		nEnd = nOffset + nBytes;
+
+	return true;
+	}
+
+
+GLsizei GLVertexFormat::GetStride(void) const
+	{
+	if(nStride != 0)
+		return nStride;
+
+	return (GLsizei)((nEnd + 3) & ~3u);
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Set up every attribute. This gets recorded in the vertex array object
+// that is bound, or has to be done before every draw without one.
+void GLVertexFormat::Setup(GLintptr nBaseOffset) const
+	{
+	GLsizei nVertexStride = GetStride();
+	for(GLuint i = 0; i < nAttributes; i++) {
+		const GLT_VERTEX_ATTRIBUTE &attribute = attributes[i];
+		glEnableVertexAttribArray(attribute.uiIndex);
+		glVertexAttribPointer(attribute.uiIndex, attribute.nComponents, attribute.type, attribute.bNormalized,
+							  nVertexStride, (const GLvoid *)(nBaseOffset + attribute.nOffset));
+		}
+	}
+
+
+void GLVertexFormat::Disable(void) const
+	{
+	for(GLuint i = 0; i < nAttributes; i++)
+		glDisableVertexAttribArray(attributes[i].uiIndex);
+	}
+
+
+GLuint GLVertexFormat::TypeSize(GLenum type)
+	{
+	switch(type) {
+		case GL_BYTE:
+		case GL_UNSIGNED_BYTE:
+			return 1;
+		case GL_SHORT:
+		case GL_UNSIGNED_SHORT:
+#ifdef GL_HALF_FLOAT
+		case GL_HALF_FLOAT:
+#endif
+			return 2;
+		case GL_INT:
+		case GL_UNSIGNED_INT:
+		case GL_FLOAT:
+		case GL_FIXED:
+			return 4;
+#ifdef GL_DOUBLE
+		case GL_DOUBLE:
+			return 8;
+#endif
+		}
+
+	return 0;
+	}